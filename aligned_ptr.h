@@ -1,7 +1,9 @@
 #ifndef ALIGNED_PTR_H
 #define ALIGNED_PTR_H
 
+#include <cstdlib>
 #include <memory>
+#include <stdexcept>
 
 template<typename T> 
 using aligned_ptr = std::unique_ptr<T[], decltype(&free)>;
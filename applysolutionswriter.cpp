@@ -1,33 +1,50 @@
-
 #include "applysolutionswriter.h"
 #include "solutionfile.h"
-#include "matrix2x2.h"
 
 #include <complex>
+#include <sstream>
+#include <stdexcept>
+
+#include <immintrin.h>
 
 ApplySolutionsWriter::ApplySolutionsWriter(std::unique_ptr<Writer> parentWriter, const std::string& filename) :
 	ForwardingWriter(std::move(parentWriter)),
-	_nChannels(0)
+	_nChannels(0),
+	_leftSolutions(empty_aligned<float>()),
+	_rightSolutions(empty_aligned<float>())
 {
 	SolutionFile solutionFile;
 	solutionFile.OpenForReading(filename.c_str());
 	
-	if(solutionFile.IntervalCount() != 1)
-		throw std::runtime_error("The provided solution file has multiple intervals, which is not supported. ");
 	if(solutionFile.PolarizationCount() != 4)
 		throw std::runtime_error("The provided solution file does not have 4 polarizations, which is not supported. ");
 	
+	_nIntervals = solutionFile.IntervalCount();
 	_nSolutionChannels = solutionFile.ChannelCount();
 	_nSolutionAntennas = solutionFile.AntennaCount();
-	_solutions.resize(_nSolutionAntennas * _nSolutionChannels);
-	size_t index = 0;
-	for(size_t a = 0; a!=_nSolutionAntennas; ++a) {
-		for(size_t ch = 0; ch!=_nSolutionChannels; ++ch) {
-			for(size_t p = 0; p!=4; ++p) {
-				_solutions[index][p] = solutionFile.ReadNextSolution();
-			}
-			++index;
-		}
+	if(_nIntervals == 0)
+		throw std::runtime_error("The provided solution file has no intervals. ");
+	_startTime = solutionFile.StartTime();
+	_intervalDuration = (solutionFile.EndTime() - solutionFile.StartTime()) / _nIntervals;
+	if(_nIntervals > 1 && !(_intervalDuration > 0.0))
+		throw std::runtime_error("The provided solution file has multiple intervals, but no valid time range to select them by. ");
+	
+	const size_t solutionCount = _nIntervals * _nSolutionAntennas * _nSolutionChannels;
+	_leftSolutions = make_aligned<float>(solutionCount * 8, 32);
+	_rightSolutions = make_aligned<float>(solutionCount * 8, 32);
+	for(size_t index = 0; index!=solutionCount; ++index) {
+		std::complex<float> jones[4];
+		for(size_t p = 0; p!=4; ++p)
+			jones[p] = std::complex<float>(solutionFile.ReadNextSolution());
+		std::complex<float>
+			*left = reinterpret_cast<std::complex<float>*>(&_leftSolutions[index * 8]),
+			*right = reinterpret_cast<std::complex<float>*>(&_rightSolutions[index * 8]);
+		for(size_t p = 0; p!=4; ++p)
+			left[p] = jones[p];
+		right[0] = std::conj(jones[0]);
+		right[1] = std::conj(jones[2]);
+		right[2] = std::conj(jones[1]);
+		right[3] = std::conj(jones[3]);
 	}
 }
 
@@ -40,7 +57,7 @@ void ApplySolutionsWriter::WriteBandInfo(const std::string &name, const std::vec
 	_correctedData.resize(_nChannels*4);
 	
 	ForwardingWriter::WriteBandInfo(name, channels, refFreq, totalBandwidth, flagRow);
-
+	
 	if(_nChannels < _nSolutionChannels || (_nChannels % _nSolutionChannels) != 0) {
 		std::ostringstream s;
 		s << "The provided solution file has an incorrect number of channels. Oobservation has " << _nChannels << " channels, and solution file has " << _nSolutionChannels << " channels.";
@@ -50,23 +67,144 @@ void ApplySolutionsWriter::WriteBandInfo(const std::string &name, const std::vec
 
 void ApplySolutionsWriter::WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float* weights)
 {
-	// Apply solution to averaged data
-	int channelRatio = _nChannels / _nSolutionChannels;
+	applySolutions(time, antenna1, antenna2, data, _correctedData.data());
+	
+	ForwardingWriter::WriteRow(time, timeCentroid, antenna1, antenna2, u, v, w, interval, _correctedData.data(), flags, weights);
+}
+
+void ApplySolutionsWriter::WriteRows(const RowBatch& batch)
+{
+	// The corrected data has the same row stride as the batch, such that it can be
+	// passed on together with the flags and weights of the batch
+	if(_correctedData.size() < batch.rowCount * batch.rowStride)
+		_correctedData.resize(batch.rowCount * batch.rowStride);
+	for(size_t row=0; row!=batch.rowCount; ++row)
+		applySolutions(batch.times[row], batch.antenna1[row], batch.antenna2[row], batch.Data(row), &_correctedData[row * batch.rowStride]);
 	
-	const MC2x2* solA = &_solutions[antenna1 * _nSolutionChannels];
-	const MC2x2* solB = &_solutions[antenna2 * _nSolutionChannels];
-	MC2x2 scratch;
+	RowBatch correctedBatch(batch);
+	correctedBatch.data = _correctedData.data();
+	ForwardingWriter::WriteRows(correctedBatch);
+}
+
+/**
+ * Calculates Ga V Gb^H for all channels of a row. The solutions of a solution channel
+ * are expanded into registers once, and applied to all channels that it covers.
+ */
+void ApplySolutionsWriter::applySolutions(double time, size_t antenna1, size_t antenna2, const std::complex<float>* data, std::complex<float>* correctedData) const
+{
+	const size_t
+		channelRatio = _nChannels / _nSolutionChannels,
+		intervalStart = intervalIndex(time) * _nSolutionAntennas;
+	const float
+		*leftSolutions = &_leftSolutions[(intervalStart + antenna1) * _nSolutionChannels * 8],
+		*rightSolutions = &_rightSolutions[(intervalStart + antenna2) * _nSolutionChannels * 8];
+#if defined(__SSE3__)
+	const float* values = reinterpret_cast<const float*>(data);
+	float* corrected = reinterpret_cast<float*>(correctedData);
+#endif
 	
-	for(size_t ch=0; ch!=_nChannels; ch++)
+	for(size_t solChannel=0; solChannel!=_nSolutionChannels; ++solChannel)
 	{
-		size_t solChannel = ch / channelRatio;
-	
-		MC2x2 dataAsDouble(data[ch * 4], data[ch * 4 +1], data[ch * 4 +2], data[ch * 4 +3]);
-		MC2x2::ATimesB(scratch, solA[solChannel], dataAsDouble);
-		MC2x2::ATimesHermB(dataAsDouble, scratch, solB[solChannel]);
-		for(size_t p=0; p!=4; ++p)
-			_correctedData[ch * 4 + p] = dataAsDouble[p];
+		const float
+			*left = leftSolutions + solChannel * 8,
+			*right = rightSolutions + solChannel * 8;
+		const size_t chStart = solChannel * channelRatio, chEnd = chStart + channelRatio;
+		// A complex product x*y is calculated as addsub(re(x)*y, im(x)*swap(y)), where the
+		// real and imaginary parts of the solutions are duplicated over the lanes
+#if defined(__AVX__)
+		// One channel (2x2 complex matrix) per register
+		const __m256
+			leftValues = _mm256_load_ps(left),
+			rightValues = _mm256_load_ps(right),
+			// [g0 g0 g2 g2] and [g1 g1 g3 g3]
+			left02 = _mm256_castpd_ps(_mm256_permute_pd(_mm256_castps_pd(leftValues), 0x0)),
+			left13 = _mm256_castpd_ps(_mm256_permute_pd(_mm256_castps_pd(leftValues), 0xF)),
+			// [h0 h1 h0 h1] and [h2 h3 h2 h3] of G^H, i.e. [g0* g2* g0* g2*] and [g1* g3* g1* g3*]
+			right01 = _mm256_permute2f128_ps(rightValues, rightValues, 0x00),
+			right23 = _mm256_permute2f128_ps(rightValues, rightValues, 0x11),
+			left02Re = _mm256_moveldup_ps(left02), left02Im = _mm256_movehdup_ps(left02),
+			left13Re = _mm256_moveldup_ps(left13), left13Im = _mm256_movehdup_ps(left13),
+			right01Re = _mm256_moveldup_ps(right01), right01Im = _mm256_movehdup_ps(right01),
+			right23Re = _mm256_moveldup_ps(right23), right23Im = _mm256_movehdup_ps(right23);
+		for(size_t ch=chStart; ch!=chEnd; ++ch)
+		{
+			const __m256
+				v = _mm256_loadu_ps(values + ch*8),
+				vSwapped = _mm256_permute_ps(v, 0xB1),
+				v01 = _mm256_permute2f128_ps(v, v, 0x00),
+				v23 = _mm256_permute2f128_ps(v, v, 0x11),
+				v01Swapped = _mm256_permute2f128_ps(vSwapped, vSwapped, 0x00),
+				v23Swapped = _mm256_permute2f128_ps(vSwapped, vSwapped, 0x11);
+			// S = Ga V
+			const __m256 s = _mm256_addsub_ps(
+				_mm256_add_ps(_mm256_mul_ps(left02Re, v01), _mm256_mul_ps(left13Re, v23)),
+				_mm256_add_ps(_mm256_mul_ps(left02Im, v01Swapped), _mm256_mul_ps(left13Im, v23Swapped)));
+			const __m256
+				sSwapped = _mm256_permute_ps(s, 0xB1),
+				s02 = _mm256_castpd_ps(_mm256_permute_pd(_mm256_castps_pd(s), 0x0)),
+				s13 = _mm256_castpd_ps(_mm256_permute_pd(_mm256_castps_pd(s), 0xF)),
+				s02Swapped = _mm256_castpd_ps(_mm256_permute_pd(_mm256_castps_pd(sSwapped), 0x0)),
+				s13Swapped = _mm256_castpd_ps(_mm256_permute_pd(_mm256_castps_pd(sSwapped), 0xF));
+			// S Gb^H
+			_mm256_storeu_ps(corrected + ch*8, _mm256_addsub_ps(
+				_mm256_add_ps(_mm256_mul_ps(right01Re, s02), _mm256_mul_ps(right23Re, s13)),
+				_mm256_add_ps(_mm256_mul_ps(right01Im, s02Swapped), _mm256_mul_ps(right23Im, s13Swapped))));
+		}
+#elif defined(__SSE3__)
+		// One row of the 2x2 complex matrix per register
+		const __m128
+			left01 = _mm_load_ps(left), left23 = _mm_load_ps(left + 4),
+			right01 = _mm_load_ps(right), right23 = _mm_load_ps(right + 4),
+			g0 = _mm_movelh_ps(left01, left01), g1 = _mm_movehl_ps(left01, left01),
+			g2 = _mm_movelh_ps(left23, left23), g3 = _mm_movehl_ps(left23, left23),
+			g0Re = _mm_moveldup_ps(g0), g0Im = _mm_movehdup_ps(g0),
+			g1Re = _mm_moveldup_ps(g1), g1Im = _mm_movehdup_ps(g1),
+			g2Re = _mm_moveldup_ps(g2), g2Im = _mm_movehdup_ps(g2),
+			g3Re = _mm_moveldup_ps(g3), g3Im = _mm_movehdup_ps(g3),
+			right01Re = _mm_moveldup_ps(right01), right01Im = _mm_movehdup_ps(right01),
+			right23Re = _mm_moveldup_ps(right23), right23Im = _mm_movehdup_ps(right23);
+		for(size_t ch=chStart; ch!=chEnd; ++ch)
+		{
+			const __m128
+				v01 = _mm_loadu_ps(values + ch*8),
+				v23 = _mm_loadu_ps(values + ch*8 + 4),
+				v01Swapped = _mm_shuffle_ps(v01, v01, 0xB1),
+				v23Swapped = _mm_shuffle_ps(v23, v23, 0xB1);
+			// S = Ga V
+			const __m128
+				sTop = _mm_addsub_ps(
+					_mm_add_ps(_mm_mul_ps(g0Re, v01), _mm_mul_ps(g1Re, v23)),
+					_mm_add_ps(_mm_mul_ps(g0Im, v01Swapped), _mm_mul_ps(g1Im, v23Swapped))),
+				sBottom = _mm_addsub_ps(
+					_mm_add_ps(_mm_mul_ps(g2Re, v01), _mm_mul_ps(g3Re, v23)),
+					_mm_add_ps(_mm_mul_ps(g2Im, v01Swapped), _mm_mul_ps(g3Im, v23Swapped))),
+				sTopSwapped = _mm_shuffle_ps(sTop, sTop, 0xB1),
+				sBottomSwapped = _mm_shuffle_ps(sBottom, sBottom, 0xB1);
+			// S Gb^H
+			_mm_storeu_ps(corrected + ch*8, _mm_addsub_ps(
+				_mm_add_ps(_mm_mul_ps(right01Re, _mm_movelh_ps(sTop, sTop)), _mm_mul_ps(right23Re, _mm_movehl_ps(sTop, sTop))),
+				_mm_add_ps(_mm_mul_ps(right01Im, _mm_movelh_ps(sTopSwapped, sTopSwapped)), _mm_mul_ps(right23Im, _mm_movehl_ps(sTopSwapped, sTopSwapped)))));
+			_mm_storeu_ps(corrected + ch*8 + 4, _mm_addsub_ps(
+				_mm_add_ps(_mm_mul_ps(right01Re, _mm_movelh_ps(sBottom, sBottom)), _mm_mul_ps(right23Re, _mm_movehl_ps(sBottom, sBottom))),
+				_mm_add_ps(_mm_mul_ps(right01Im, _mm_movelh_ps(sBottomSwapped, sBottomSwapped)), _mm_mul_ps(right23Im, _mm_movehl_ps(sBottomSwapped, sBottomSwapped)))));
+		}
+#else
+		const std::complex<float>
+			*g = reinterpret_cast<const std::complex<float>*>(left),
+			*h = reinterpret_cast<const std::complex<float>*>(right);
+		for(size_t ch=chStart; ch!=chEnd; ++ch)
+		{
+			const std::complex<float>* v = data + ch*4;
+			const std::complex<float>
+				s0 = g[0] * v[0] + g[1] * v[2],
+				s1 = g[0] * v[1] + g[1] * v[3],
+				s2 = g[2] * v[0] + g[3] * v[2],
+				s3 = g[2] * v[1] + g[3] * v[3];
+			correctedData[ch*4] = s0 * h[0] + s1 * h[2];
+			correctedData[ch*4 + 1] = s0 * h[1] + s1 * h[3];
+			correctedData[ch*4 + 2] = s2 * h[0] + s3 * h[2];
+			correctedData[ch*4 + 3] = s2 * h[1] + s3 * h[3];
+		}
+#endif
 	}
-	
-	ForwardingWriter::WriteRow(time, timeCentroid, antenna1, antenna2, u, v, w, interval, _correctedData.data(), flags, weights);
 }
@@ -1,13 +1,20 @@
 #ifndef APPLYCAL_WRITER_H
 #define APPLYCAL_WRITER_H
 
+#include "aligned_ptr.h"
 #include "forwardingwriter.h"
-#include "matrix2x2.h"
 
+#include <complex>
 #include <memory>
 #include <string>
 #include <vector>
 
+/**
+ * Applies calibration solutions from a solution file to the visibilities, i.e.
+ * replaces the visibility matrix V of baseline (a,b) by Ga V Gb^H. Solutions are
+ * applied in single precision. When the file has several intervals, the
+ * interval is selected from the time of the row.
+ */
 class ApplySolutionsWriter : public ForwardingWriter
 {
 	public:
@@ -19,10 +26,35 @@ class ApplySolutionsWriter : public ForwardingWriter
 		
 		virtual void WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights) final override;
 		
+		virtual void WriteRows(const RowBatch& batch) final override;
+	
 	private:
-		size_t _nChannels, _nSolutionAntennas, _nSolutionChannels;
+		void applySolutions(double time, size_t antenna1, size_t antenna2, const std::complex<float>* data, std::complex<float>* correctedData) const;
+		
+		size_t intervalIndex(double time) const
+		{
+			if(_nIntervals == 1)
+				return 0;
+			const double index = (time - _startTime) / _intervalDuration;
+			if(index < 0.0)
+				return 0;
+			else if(index >= double(_nIntervals))
+				return _nIntervals - 1;
+			else
+				return size_t(index);
+		}
+		
+		size_t _nChannels, _nSolutionAntennas, _nSolutionChannels, _nIntervals;
+		double _startTime, _intervalDuration;
 		std::vector<std::complex<float>> _correctedData;
-		std::vector<MC2x2> _solutions;
+		/**
+		 * Per solution, the Jones matrix G (left) and its conjugate transpose G^H (right),
+		 * both as 4 row-major complex values, indexed by
+		 * [((interval * nAntennas + antenna) * nChannels + channel) * 8 + i*2 + reim].
+		 * The channels of an antenna are contiguous, so a row reads its solutions
+		 * as one stream.
+		 */
+		aligned_ptr<float> _leftSolutions, _rightSolutions;
 };
 
 #endif
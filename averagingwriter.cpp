@@ -1,65 +1,294 @@
 #include "averagingwriter.h"
 
-#include <xmmintrin.h>
+#include "threadpool.h"
+
+#include <algorithm>
+#include <stdexcept>
+
+#include <immintrin.h>
 
 #define USE_SSE
 
-void AveragingWriter::WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights)
+namespace {
+	//! Round up to a multiple of 16 floats, i.e. to 64 bytes
+	size_t padToCacheLine(size_t floatCount)
+	{
+		return (floatCount + 15) / 16 * 16;
+	}
+}
+
+void AveragingWriter::initBuffers()
+{
+	if(isBaselineDependent() && _baselineTimeAvgFactorsPerAntennaPair.size() != _antennaCount*_antennaCount)
+		throw std::runtime_error("AveragingWriter: the number of baseline averaging factors does not match the number of antennas");
+	_baselineIndices.assign(_antennaCount*_antennaCount, 0);
+	_baselineTimeAvgFactors.clear();
+	size_t baselineCount = 0;
+	for(size_t antenna1=0; antenna1!=_antennaCount; ++antenna1)
+	{
+		for(size_t antenna2=antenna1; antenna2!=_antennaCount; ++antenna2)
+		{
+			_baselineIndices[antenna1*_antennaCount + antenna2] = baselineCount;
+			_baselineTimeAvgFactors.push_back(isBaselineDependent() ?
+				_baselineTimeAvgFactorsPerAntennaPair[antenna1*_antennaCount + antenna2] : _timeAvgFactor);
+			++baselineCount;
+		}
+	}
+
+	BaselineState emptyState;
+	emptyState.time = 0.0;
+	emptyState.timestepCount = 0;
+	emptyState.interval = 0.0;
+	_baselines.assign(baselineCount, emptyState);
+
+	_dataSectionSize = padToCacheLine(_avgChannelCount*8);
+	_weightSectionSize = padToCacheLine(_avgChannelCount*4);
+	_baselineStride = _dataSectionSize*2 + _weightSectionSize*2;
+	_arena = make_aligned<float>(baselineCount * _baselineStride, 64);
+	std::fill_n(_arena.get(), baselineCount * _baselineStride, 0.0f);
+}
+
+void AveragingWriter::WriteRows(const RowBatch& batch)
+{
+	const size_t baselineCount = _baselines.size();
+
+	// Find out which rows complete an average, and give these averages an output row
+	// in the order in which they are completed, as if the rows were added one by one
+	_pendingCounts.resize(baselineCount);
+	for(size_t baseline=0; baseline!=baselineCount; ++baseline)
+		_pendingCounts[baseline] = _baselines[baseline].timestepCount;
+	_rowBaselines.resize(batch.rowCount);
+	_outputRowOfRow.resize(batch.rowCount);
+	_baselineRowStart.assign(baselineCount+1, 0);
+	size_t outputRowCount = 0;
+	for(size_t row=0; row!=batch.rowCount; ++row)
+	{
+		const size_t baseline = baselineIndex(batch.antenna1[row], batch.antenna2[row]);
+		_rowBaselines[row] = baseline;
+		++_baselineRowStart[baseline+1];
+		++_pendingCounts[baseline];
+		if(_pendingCounts[baseline] == _baselineTimeAvgFactors[baseline])
+		{
+			_outputRowOfRow[row] = outputRowCount;
+			++outputRowCount;
+			_pendingCounts[baseline] = 0;
+		}
+	}
+
+	// Group the rows by baseline, keeping their order
+	for(size_t baseline=0; baseline!=baselineCount; ++baseline)
+		_baselineRowStart[baseline+1] += _baselineRowStart[baseline];
+	_rowOrder.resize(batch.rowCount);
+	_pendingCounts.assign(_baselineRowStart.begin(), _baselineRowStart.end()-1);
+	for(size_t row=0; row!=batch.rowCount; ++row)
+	{
+		_rowOrder[_pendingCounts[_rowBaselines[row]]] = row;
+		++_pendingCounts[_rowBaselines[row]];
+	}
+
+	_outputRows.Resize(outputRowCount, _avgChannelCount*4);
+	_outputInfo.resize(outputRowCount);
+
+	const size_t taskCount = (baselineCount + BaselinesPerTask - 1) / BaselinesPerTask;
+	_threadPool.ParallelFor(taskCount, _maxConcurrency, [&](size_t task)
+	{
+		const size_t
+			firstBaseline = task * BaselinesPerTask,
+			endBaseline = std::min<size_t>(firstBaseline + BaselinesPerTask, baselineCount);
+		for(size_t i=_baselineRowStart[firstBaseline]; i!=_baselineRowStart[endBaseline]; ++i)
+		{
+			const size_t row = _rowOrder[i];
+			addRow(_rowBaselines[row], _outputRowOfRow[row], batch.times[row], batch.antenna1[row], batch.antenna2[row], batch.intervals[row], batch.Data(row), batch.Flags(row), batch.Weights(row));
+		}
+	});
+
+	// The uvws are calculated on this thread, because the cache calculates a new
+	// timestep only once when it is asked for it by one thread at a time
+	for(size_t outputRow=0; outputRow!=outputRowCount; ++outputRow)
+	{
+		const OutputRowInfo& info = _outputInfo[outputRow];
+		double u, v, w;
+		_uvwCalculater.CalculateUVW(info.time, info.antenna1, info.antenna2, u, v, w);
+		_outputRows.SetRow(outputRow, info.time, info.time, info.antenna1, info.antenna2, u, v, w, info.interval);
+	}
+	if(isBaselineDependent() && outputRowCount != 0)
+		_writer->AddRows(outputRowCount);
+	flushOutputRows();
+}
+
+void AveragingWriter::addRow(size_t baseline, size_t outputRow, double time, size_t antenna1, size_t antenna2, double interval, const std::complex<float>* data, const bool* flags, const float *weights)
+{
+	accumulate(arenaRow(baseline), data, flags, weights);
+
+	BaselineState& state = _baselines[baseline];
+	state.time += time;
+	state.timestepCount++;
+	state.interval += interval;
+
+	if(state.timestepCount == _baselineTimeAvgFactors[baseline])
+		writeAverage(baseline, outputRow, antenna1, antenna2);
+}
+
+void AveragingWriter::accumulate(float* arenaRow, const std::complex<float>* data, const bool* flags, const float *weights) const
 {
-	Buffer &buffer = getBuffer(antenna1, antenna2);
-	size_t srcIndex = 0;
-	for(size_t ch=0; ch!=_avgChannelCount*_freqAvgFactor; ++ch)
+	float
+		*sums = arenaRow,
+		*allSums = arenaRow + _dataSectionSize,
+		*weightSums = arenaRow + _dataSectionSize*2,
+		*counts = arenaRow + _dataSectionSize*2 + _weightSectionSize;
+	const float* values = reinterpret_cast<const float*>(data);
+
+	// Note that in the vectorized loops, if one polarization is flagged, all are flagged
+	size_t dest = 0;
+#if defined(__AVX512F__) && defined(__AVX512DQ__) && defined(__AVX512VL__)
+	// Two averaged channels at a time
+	const __m512i duplicatePairWeights = _mm512_set_epi32(7, 7, 6, 6, 5, 5, 4, 4, 3, 3, 2, 2, 1, 1, 0, 0);
+	const __m256 pairOnes = _mm256_set1_ps(1.0f);
+	for(; dest+2<=_avgChannelCount; dest+=2)
 	{
-#ifndef USE_SSE
-		for(size_t p=0; p!=4; ++p)
+		__m512
+			sum = _mm512_load_ps(sums + dest*8),
+			allSum = _mm512_load_ps(allSums + dest*8);
+		__m256
+			weightSum = _mm256_load_ps(weightSums + dest*4),
+			count = _mm256_load_ps(counts + dest*4);
+		for(size_t i=0; i!=_freqAvgFactor; ++i)
 		{
-			const size_t destIndex = (ch / _freqAvgFactor) * 4 + p;
-			buffer._flaggedAndUnflaggedData[destIndex] += data[srcIndex];
-			if(!flags[srcIndex])
+			const size_t chA = dest*_freqAvgFactor + i, chB = chA + _freqAvgFactor;
+			const __m512 value = _mm512_insertf32x8(_mm512_castps256_ps512(_mm256_loadu_ps(values + chA*8)), _mm256_loadu_ps(values + chB*8), 1);
+			const __m256 weight = _mm256_insertf128_ps(_mm256_castps128_ps256(_mm_loadu_ps(weights + chA*4)), _mm_loadu_ps(weights + chB*4), 1);
+			const __mmask8 weightMask = (flags[chA*4] ? 0x00 : 0x0F) | (flags[chB*4] ? 0x00 : 0xF0);
+			const __mmask16 valueMask = (flags[chA*4] ? 0x0000 : 0x00FF) | (flags[chB*4] ? 0x0000 : 0xFF00);
+			allSum = _mm512_add_ps(allSum, value);
+			sum = _mm512_mask_add_ps(sum, valueMask, sum,
+				_mm512_mul_ps(value, _mm512_permutexvar_ps(duplicatePairWeights, _mm512_castps256_ps512(weight))));
+			weightSum = _mm256_mask_add_ps(weightSum, weightMask, weightSum, weight);
+			count = _mm256_mask_add_ps(count, weightMask, count, pairOnes);
+		}
+		_mm512_store_ps(sums + dest*8, sum);
+		_mm512_store_ps(allSums + dest*8, allSum);
+		_mm256_store_ps(weightSums + dest*4, weightSum);
+		_mm256_store_ps(counts + dest*4, count);
+	}
+#endif
+#if defined(__AVX2__)
+	const __m256i duplicateWeights = _mm256_set_epi32(3, 3, 2, 2, 1, 1, 0, 0);
+	const __m128 ones = _mm_set1_ps(1.0f);
+	for(; dest!=_avgChannelCount; ++dest)
+	{
+		__m256
+			sum = _mm256_load_ps(sums + dest*8),
+			allSum = _mm256_load_ps(allSums + dest*8);
+		__m128
+			weightSum = _mm_load_ps(weightSums + dest*4),
+			count = _mm_load_ps(counts + dest*4);
+		for(size_t ch=dest*_freqAvgFactor; ch!=(dest+1)*_freqAvgFactor; ++ch)
+		{
+			const __m256 value = _mm256_loadu_ps(values + ch*8);
+			allSum = _mm256_add_ps(allSum, value);
+			if(!flags[ch*4])
 			{
-				buffer._rowData[destIndex] += data[srcIndex] * weights[srcIndex];
-				buffer._rowWeights[destIndex] += weights[srcIndex];
-				buffer._rowCounts[destIndex]++;
+				const __m128 weight = _mm_loadu_ps(weights + ch*4);
+				sum = _mm256_add_ps(sum, _mm256_mul_ps(value, _mm256_permutevar8x32_ps(_mm256_castps128_ps256(weight), duplicateWeights)));
+				weightSum = _mm_add_ps(weightSum, weight);
+				count = _mm_add_ps(count, ones);
 			}
-			++srcIndex;
 		}
-#else
-		const size_t destIndex = (ch / _freqAvgFactor) * 4;
-		const __m128 dataValA = _mm_load_ps((float*) &data[srcIndex]);
-		const __m128 dataValB = _mm_load_ps((float*) &data[srcIndex+2]);
-		std::complex<float> *allDataPtr = &buffer._flaggedAndUnflaggedData[destIndex];
-		
-		// Perform *allDataPtr += dataVal
-		_mm_store_ps((float*) allDataPtr, _mm_add_ps(_mm_load_ps((float*) allDataPtr), dataValA));
-		_mm_store_ps((float*) (allDataPtr+2), _mm_add_ps(_mm_load_ps((float*) (allDataPtr+2)), dataValB));
-		
-		// Note that if one polarization is flagged, all are flagged
-		if(!flags[srcIndex])
+		_mm256_store_ps(sums + dest*8, sum);
+		_mm256_store_ps(allSums + dest*8, allSum);
+		_mm_store_ps(weightSums + dest*4, weightSum);
+		_mm_store_ps(counts + dest*4, count);
+	}
+#elif defined(USE_SSE)
+	const __m128 ones = _mm_set1_ps(1.0f);
+	for(; dest!=_avgChannelCount; ++dest)
+	{
+		__m128
+			sumA = _mm_load_ps(sums + dest*8),
+			sumB = _mm_load_ps(sums + dest*8 + 4),
+			allSumA = _mm_load_ps(allSums + dest*8),
+			allSumB = _mm_load_ps(allSums + dest*8 + 4),
+			weightSum = _mm_load_ps(weightSums + dest*4),
+			count = _mm_load_ps(counts + dest*4);
+		for(size_t ch=dest*_freqAvgFactor; ch!=(dest+1)*_freqAvgFactor; ++ch)
 		{
-			const __m128 weightsA = _mm_set_ps(weights[srcIndex+1], weights[srcIndex+1], weights[srcIndex], weights[srcIndex]);
-			const __m128 weightsB = _mm_set_ps(weights[srcIndex+3], weights[srcIndex+3], weights[srcIndex+2], weights[srcIndex+2]);
-			std::complex<float> *destPtr = &buffer._rowData[destIndex];
-			
-			// Perform *destPtr += dataVal * weights
-			_mm_store_ps((float*) destPtr,     _mm_add_ps(_mm_load_ps((float*) destPtr), _mm_mul_ps(dataValA, weightsA)));
-			_mm_store_ps((float*) (destPtr+2), _mm_add_ps(_mm_load_ps((float*) (destPtr+2)), _mm_mul_ps(dataValB, weightsB)));
-			
-			// Perform buf.weight += weights
-			_mm_store_ps(&buffer._rowWeights[destIndex], _mm_add_ps(_mm_load_ps(&weights[srcIndex]), _mm_load_ps(&buffer._rowWeights[destIndex])));
-			
-			buffer._rowCounts[destIndex]++;
-			buffer._rowCounts[destIndex+1]++;
-			buffer._rowCounts[destIndex+2]++;
-			buffer._rowCounts[destIndex+3]++;
+			const __m128
+				valueA = _mm_loadu_ps(values + ch*8),
+				valueB = _mm_loadu_ps(values + ch*8 + 4);
+			allSumA = _mm_add_ps(allSumA, valueA);
+			allSumB = _mm_add_ps(allSumB, valueB);
+			if(!flags[ch*4])
+			{
+				const __m128 weight = _mm_loadu_ps(weights + ch*4);
+				sumA = _mm_add_ps(sumA, _mm_mul_ps(valueA, _mm_unpacklo_ps(weight, weight)));
+				sumB = _mm_add_ps(sumB, _mm_mul_ps(valueB, _mm_unpackhi_ps(weight, weight)));
+				weightSum = _mm_add_ps(weightSum, weight);
+				count = _mm_add_ps(count, ones);
+			}
 		}
-		
-		srcIndex += 4;
+		_mm_store_ps(sums + dest*8, sumA);
+		_mm_store_ps(sums + dest*8 + 4, sumB);
+		_mm_store_ps(allSums + dest*8, allSumA);
+		_mm_store_ps(allSums + dest*8 + 4, allSumB);
+		_mm_store_ps(weightSums + dest*4, weightSum);
+		_mm_store_ps(counts + dest*4, count);
+	}
 #endif
+	for(; dest!=_avgChannelCount; ++dest)
+	{
+		for(size_t ch=dest*_freqAvgFactor; ch!=(dest+1)*_freqAvgFactor; ++ch)
+		{
+			for(size_t p=0; p!=4; ++p)
+			{
+				const size_t srcIndex = ch*4 + p, destIndex = dest*4 + p;
+				allSums[destIndex*2] += data[srcIndex].real();
+				allSums[destIndex*2 + 1] += data[srcIndex].imag();
+				if(!flags[srcIndex])
+				{
+					sums[destIndex*2] += data[srcIndex].real() * weights[srcIndex];
+					sums[destIndex*2 + 1] += data[srcIndex].imag() * weights[srcIndex];
+					weightSums[destIndex] += weights[srcIndex];
+					counts[destIndex] += 1.0f;
+				}
+			}
+		}
+	}
+}
+
+void AveragingWriter::writeAverage(size_t baseline, size_t outputRow, size_t antenna1, size_t antenna2)
+{
+	BaselineState& state = _baselines[baseline];
+	float* row = arenaRow(baseline);
+	const float
+		*sums = row,
+		*allSums = row + _dataSectionSize,
+		*weightSums = row + _dataSectionSize*2,
+		*counts = row + _dataSectionSize*2 + _weightSectionSize;
+	std::complex<float>* outputData = _outputRows.Data(outputRow);
+	bool* outputFlags = _outputRows.Flags(outputRow);
+	float* outputWeights = _outputRows.Weights(outputRow);
+	const float allCount = state.timestepCount*_freqAvgFactor;
+	for(size_t i=0; i!=_avgChannelCount*4; ++i)
+	{
+		if(counts[i] == 0.0f)
+		{
+			outputData[i] = std::complex<float>(allSums[i*2] / allCount, allSums[i*2 + 1] / allCount);
+			outputFlags[i] = true;
+		} else {
+			outputData[i] = std::complex<float>(sums[i*2] / weightSums[i], sums[i*2 + 1] / weightSums[i]);
+			outputFlags[i] = false;
+		}
+		outputWeights[i] = weightSums[i];
 	}
-	buffer._rowTime += time;
-	buffer._rowTimestepCount++;
-	buffer._interval += interval;
-	
-	if(buffer._rowTimestepCount == _timeAvgFactor)
-		writeCurrentTimestep(antenna1, antenna2);
+
+	OutputRowInfo& info = _outputInfo[outputRow];
+	info.time = state.time / state.timestepCount;
+	info.interval = state.interval;
+	info.antenna1 = antenna1;
+	info.antenna2 = antenna2;
+
+	std::fill_n(row, _baselineStride, 0.0f);
+	state.time = 0.0;
+	state.timestepCount = 0;
+	state.interval = 0.0;
 }
@@ -1,10 +1,15 @@
 #ifndef AVERAGING_MS_WRITER_H
 #define AVERAGING_MS_WRITER_H
 
+#include "aligned_ptr.h"
+#include "rowbatchbuffer.h"
 #include "writer.h"
 
 #include <iostream>
 #include <memory>
+#include <vector>
+
+class ThreadPool;
 
 class UVWCalculater
 {
@@ -12,18 +17,37 @@ class UVWCalculater
 		virtual void CalculateUVW(double date, size_t antenna1, size_t antenna2, double &u, double &v, double &w) = 0;
 };
 
+/**
+ * Averages rows in time and frequency before passing them on. The sums of all
+ * baselines are kept in one arena. The rows of a batch are averaged in parallel,
+ * with each task handling a range of baselines.
+ */
 class AveragingWriter : public Writer
 {
 	public:
-		AveragingWriter(std::unique_ptr<Writer>&& writer, size_t timeCount, size_t freqAvgFactor, UVWCalculater& uvwCalculater)
+		AveragingWriter(std::unique_ptr<Writer>&& writer, size_t timeCount, size_t freqAvgFactor, UVWCalculater& uvwCalculater, ThreadPool& threadPool, size_t maxConcurrency)
 		: _writer(std::move(writer)), _timeAvgFactor(timeCount), _freqAvgFactor(freqAvgFactor), _rowsAdded(0),
-		_originalChannelCount(0), _avgChannelCount(0), _antennaCount(0), _uvwCalculater(uvwCalculater)
+		_originalChannelCount(0), _avgChannelCount(0), _antennaCount(0), _uvwCalculater(uvwCalculater),
+		_threadPool(threadPool), _maxConcurrency(maxConcurrency),
+		_dataSectionSize(0), _weightSectionSize(0), _baselineStride(0),
+		_arena(empty_aligned<float>())
 		{
 		}
 		
 		virtual ~AveragingWriter() final override
 		{
-			destroyBuffers();
+		}
+		
+		/**
+		 * Average each baseline over its own number of timesteps, instead of over the
+		 * time averaging factor given to the constructor. Should be called before
+		 * WriteAntennae().
+		 * @param factors Time averaging factor of baseline (antenna1, antenna2) at index
+		 * antenna1*antennaCount + antenna2, for antenna1 <= antenna2.
+		 */
+		void SetBaselineTimeAvgFactors(const std::vector<size_t>& factors)
+		{
+			_baselineTimeAvgFactorsPerAntennaPair = factors;
 		}
 		
 		virtual void WriteBandInfo(const std::string &name, const std::vector<Writer::ChannelInfo> &channels, double refFreq, double totalBandwidth, bool flagRow) final override
@@ -100,6 +124,10 @@ class AveragingWriter : public Writer
 		
 		virtual void AddRows(size_t rowCount) final override
 		{
+			// With baseline-dependent averaging, the number of output rows differs per
+			// timestep, and rows are added when the averages are written
+			if(isBaselineDependent())
+				return;
 			if(_rowsAdded == 0)
 				_writer->AddRows(rowCount);
 			_rowsAdded++;
@@ -107,7 +135,28 @@ class AveragingWriter : public Writer
 				_rowsAdded=0;
 		}
 		
-		virtual void WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights) final override;
+		virtual void WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights) final override
+		{
+			RowBatch batch;
+			batch.rowCount = 1;
+			batch.valuesPerRow = _originalChannelCount*4;
+			batch.rowStride = batch.valuesPerRow;
+			batch.times = &time;
+			batch.timeCentroids = &timeCentroid;
+			batch.antenna1 = &antenna1;
+			batch.antenna2 = &antenna2;
+			batch.u = &u;
+			batch.v = &v;
+			batch.w = &w;
+			batch.intervals = &interval;
+			batch.data = data;
+			batch.flags = flags;
+			batch.weights = weights;
+			batch.sharedWeights = false;
+			WriteRows(batch);
+		}
+		
+		virtual void WriteRows(const RowBatch& batch) final override;
 		
 		virtual void WriteHistoryItem(const std::string &commandLine, const std::string &application, const std::vector<std::string> &params) final override
 		{
@@ -115,8 +164,7 @@ class AveragingWriter : public Writer
 		}
 		
 		virtual bool IsTimeAligned(size_t antenna1, size_t antenna2) final override {
-			const Buffer &buffer = getBuffer(antenna1, antenna2);
-			return buffer._rowTimestepCount==0;
+			return _baselines[baselineIndex(antenna1, antenna2)].timestepCount==0;
 		}
 		
 		virtual bool AreAntennaPositionsLocal() const final override
@@ -128,124 +176,85 @@ class AveragingWriter : public Writer
 			return _writer->CanWriteStatistics();
 		}
 	private:
-		struct Buffer
+		//! Time-averaging state of a baseline; the sums are in the arena
+		struct BaselineState
 		{
-			Buffer(size_t avgChannelCount)
-			{
-				_rowData = new std::complex<float>[avgChannelCount*4];
-				_flaggedAndUnflaggedData = new std::complex<float>[avgChannelCount*4];
-				_rowFlags = new bool[avgChannelCount*4];
-				_rowWeights = new float[avgChannelCount*4];
-				_rowCounts = new size_t[avgChannelCount*4];
-				initZero(avgChannelCount);
-			}
-			
-			~Buffer()
-			{
-				delete[] _rowData;
-				delete[] _flaggedAndUnflaggedData;
-				delete[] _rowFlags;
-				delete[] _rowWeights;
-				delete[] _rowCounts;
-			}
-			
-			void initZero(size_t avgChannelCount)
-			{
-				_rowTime = 0.0;
-				_rowTimestepCount = 0;
-				_interval = 0.0;
-				for(size_t ch=0; ch!=avgChannelCount*4; ++ch)
-				{
-					_rowData[ch] = 0.0;
-					_flaggedAndUnflaggedData[ch] = 0.0;
-					_rowFlags[ch] = false;
-					_rowWeights[ch] = 0.0;
-					_rowCounts[ch] = 0;
-				}
-			}
-			
-			double _rowTime;
-			size_t _rowTimestepCount;
-			double _interval;
-			std::complex<float> *_rowData, *_flaggedAndUnflaggedData;
-			bool *_rowFlags;
-			float *_rowWeights;
-			size_t *_rowCounts;
+			double time;
+			size_t timestepCount;
+			double interval;
 		};
 		
-		void writeCurrentTimestep(size_t antenna1, size_t antenna2)
+		//! An averaged row that is ready, except for its uvw
+		struct OutputRowInfo
 		{
-			Buffer& buffer = getBuffer(antenna1, antenna2);
-			double time = buffer._rowTime / buffer._rowTimestepCount;
-			double u, v, w;
-			_uvwCalculater.CalculateUVW(time, antenna1, antenna2, u, v, w);
-			
-			for(size_t ch=0;ch!=_avgChannelCount*4;++ch)
+			double time, interval;
+			size_t antenna1, antenna2;
+		};
+		
+		/**
+		 * Add a row to the sums of a baseline. When the baseline has
+		 * collected enough timesteps, the average is stored in output row
+		 * @p outputRow and the baseline is reset.
+		 */
+		void addRow(size_t baseline, size_t outputRow, double time, size_t antenna1, size_t antenna2, double interval, const std::complex<float>* data, const bool* flags, const float *weights);
+		
+		//! Add the channels of a row to the sums in the arena row of a baseline
+		void accumulate(float* arenaRow, const std::complex<float>* data, const bool* flags, const float *weights) const;
+		
+		void writeAverage(size_t baseline, size_t outputRow, size_t antenna1, size_t antenna2);
+		
+		//! Averaged rows are collected, and passed on as one batch per call to WriteRow(s)
+		void flushOutputRows()
+		{
+			if(_outputRows.RowCount() != 0)
 			{
-				if(buffer._rowCounts[ch]==0)
-				{
-					buffer._rowData[ch] = std::complex<float>(
-						buffer._flaggedAndUnflaggedData[ch].real() / (buffer._rowTimestepCount*_freqAvgFactor),
-						buffer._flaggedAndUnflaggedData[ch].imag() / (buffer._rowTimestepCount*_freqAvgFactor));
-					buffer._rowFlags[ch] = true;
-				} else {
-					buffer._rowData[ch] = std::complex<float>(
-						buffer._rowData[ch].real()/buffer._rowWeights[ch],
-						buffer._rowData[ch].imag()/buffer._rowWeights[ch]);
-					buffer._rowFlags[ch] = false;
-				}
+				_writer->WriteRows(_outputRows.View());
+				_outputRows.Clear();
 			}
-			
-			_writer->WriteRow(time, time, antenna1, antenna2, u, v, w, buffer._interval, buffer._rowData, buffer._rowFlags, buffer._rowWeights);
-			
-			buffer.initZero(_avgChannelCount);
 		}
 		
-		Buffer &getBuffer(size_t antenna1, size_t antenna2)
+		size_t baselineIndex(size_t antenna1, size_t antenna2) const
 		{
-			return *_buffers[antenna1*_antennaCount + antenna2];
+			return _baselineIndices[antenna1*_antennaCount + antenna2];
 		}
 		
-		void setBuffer(size_t antenna1, size_t antenna2, Buffer *buffer)
+		float* arenaRow(size_t baseline) const
 		{
-			_buffers[antenna1*_antennaCount + antenna2] = buffer;
+			return _arena.get() + baseline * _baselineStride;
 		}
 		
-		void initBuffers()
-		{
-			destroyBuffers();
-			_buffers.resize(_antennaCount*_antennaCount);
-			for(size_t antenna1=0; antenna1!=_antennaCount; ++antenna1)
-			{
-				for(size_t antenna2=0; antenna2!=antenna1; ++antenna2)
-					setBuffer(antenna1, antenna2, 0);
-				
-				for(size_t antenna2=antenna1; antenna2!=_antennaCount; ++antenna2)
-				{
-					Buffer *buffer = new Buffer(_avgChannelCount);
-					setBuffer(antenna1, antenna2, buffer);
-				}
-			}
-		}
+		void initBuffers();
 		
-		void destroyBuffers()
-		{
-			if(!_buffers.empty())
-			{
-				for(size_t antenna1=0; antenna1!=_antennaCount; ++antenna1)
-				{
-					for(size_t antenna2=antenna1; antenna2!=_antennaCount; ++antenna2)
-						delete &getBuffer(antenna1, antenna2);
-				}
-			}
-			_buffers.clear();
-		}
+		bool isBaselineDependent() const { return !_baselineTimeAvgFactorsPerAntennaPair.empty(); }
+		
+		enum { BaselinesPerTask = 32 };
 		
 		std::unique_ptr<Writer> _writer;
 		size_t _timeAvgFactor, _freqAvgFactor, _rowsAdded;
 		size_t _originalChannelCount, _avgChannelCount, _antennaCount;
 		UVWCalculater& _uvwCalculater;
-		std::vector<Buffer*> _buffers;
+		ThreadPool& _threadPool;
+		size_t _maxConcurrency;
+		
+		//! Index of baseline (antenna1, antenna2) in the arena, for antenna1 <= antenna2
+		std::vector<size_t> _baselineIndices;
+		std::vector<BaselineState> _baselines;
+		std::vector<size_t> _baselineTimeAvgFactorsPerAntennaPair;
+		//! Time averaging factor of each baseline, by index in the arena
+		std::vector<size_t> _baselineTimeAvgFactors;
+		/**
+		 * The sums of all baselines. The row of a baseline consists of four sections,
+		 * each padded to a multiple of 64 bytes: the weighted sum of the unflagged data,
+		 * the sum of all data, the sum of the weights and the number of unflagged values.
+		 * The number of floats in the sections and in a full row are stored.
+		 */
+		size_t _dataSectionSize, _weightSectionSize, _baselineStride;
+		aligned_ptr<float> _arena;
+		
+		// Scratch space of WriteRows()
+		std::vector<size_t> _pendingCounts, _rowBaselines, _outputRowOfRow, _baselineRowStart, _rowOrder;
+		std::vector<OutputRowInfo> _outputInfo;
+		RowBatchBuffer _outputRows;
 };
 
 #endif
@@ -7,24 +7,28 @@
 #include "fitswriter.h"
 #include "geometry.h"
 #include "mswriter.h"
+#include "multiwriter.h"
 #include "mwafits.h"
 #include "mwams.h"
 #include "subbandpassband.h"
 #include "progressbar.h"
 #include "threadedwriter.h"
 #include "radeccoord.h"
+#include "shardedwriter.h"
 #include "version.h"
 
 #include <thread>
 #include <functional>
 
+#include <algorithm>
 #include <fstream>
 #include <iostream>
 #include <map>
 #include <cmath>
+#include <cstdio>
 #include <complex>
 
-#include <xmmintrin.h>
+#include <immintrin.h>
 
 #include <mpi.h>
 
@@ -40,6 +44,8 @@ Cotter::Cotter() :
 	_quackInitSampleCount(4),
 	_subbandEdgeFlagWidthKHz(80.0),
 	_subbandEdgeFlagCount(2),
+	_streamingBlockSize(8),
+	_overlapChunks(true),
 	_defaultFilename(true),
 	_rfiDetection(true),
 	_collectStatistics(true),
@@ -58,6 +64,12 @@ Cotter::Cotter() :
 	_flagDCChannels(true),
 	_skipWriting(false),
 	_offlineGPUBoxFormat(false),
+	_asyncReadAhead(0),
+	_setThreadAffinity(false),
+	_useMMap(true),
+	_writeQueueSize(ThreadedWriter::DefaultMaxQueueSize),
+	_writeQueueFullCount(0),
+	_writeQueueEmptyCount(0),
 	_customRARad(0.0),
 	_customDecRad(0.0),
 	_initDurationToFlag(4.0),
@@ -68,8 +80,18 @@ Cotter::Cotter() :
 	_dyscoDistribution("TruncatedGaussian"),
 	_dyscoNormalization("AF"),
 	_dyscoDistTruncation(2.5),
+	_tileChannels(0),
+	_tileRows(0),
+	_tileSizeKB(0),
+	_shardCount(1),
+	_writeMultiMS(false),
+	_bdaFieldRadiusDeg(0.0),
+	_bdaMaxSmearing(0.01),
+	_bdaMaxTimeAvgMultiple(8),
 	_outputData(empty_aligned<std::complex<float>>()),
-	_outputWeights(empty_aligned<float>())
+	_outputWeights(empty_aligned<float>()),
+	_blockData(empty_aligned<std::complex<float>>()),
+	_uvwCache(_mwaConfig, 64)
 {
 	MPI_Comm_rank(MPI_COMM_WORLD, &_nodeRank);
 	MPI_Comm_size(MPI_COMM_WORLD, &_nNodes);
@@ -80,6 +102,7 @@ Cotter::~Cotter() { }
 void Cotter::Run(double timeRes_s, double freqRes_kHz)
 {
 	_readWatch.Start();
+	_threadPool.reset(new ThreadPool(_threadCount, _setThreadAffinity));
 	bool lockPointing = false;
 	
 	if(_metaFilename.empty())
@@ -117,16 +140,33 @@ void Cotter::Run(double timeRes_s, double freqRes_kHz)
 	}
 	_mwaConfig.CheckSetup();
 	
-	size_t timeAvgFactor = round(timeRes_s/_mwaConfig.Header().integrationTime);
-	if(timeAvgFactor == 0)
-		timeAvgFactor = 1;
+	const double channelWidthKHz = 1000.0*_mwaConfig.Header().bandwidthMHz / _mwaConfig.Header().nChannels;
+	size_t timeAvgFactor = averagingFactor(timeRes_s, _mwaConfig.Header().integrationTime);
 	timeRes_s = timeAvgFactor*_mwaConfig.Header().integrationTime;
-	size_t freqAvgFactor = round(freqRes_kHz/(1000.0*_mwaConfig.Header().bandwidthMHz / _mwaConfig.Header().nChannels));
-	if(freqAvgFactor == 0)
-		freqAvgFactor = 1;
-	freqRes_kHz = freqAvgFactor*(1000.0*_mwaConfig.Header().bandwidthMHz / _mwaConfig.Header().nChannels);
+	size_t freqAvgFactor = averagingFactor(freqRes_kHz, channelWidthKHz);
+	freqRes_kHz = freqAvgFactor*channelWidthKHz;
 	std::cout << "Output resolution: " << timeRes_s << " s / " << freqRes_kHz << " kHz (time avg: " << timeAvgFactor << "x, freq avg: " << freqAvgFactor << "x).\n";
 	
+	if(!_extraOutputs.empty())
+	{
+		if(_outputFormat == FlagsOutputFormat)
+			throw std::runtime_error("Extra outputs can not be combined with writing flag files");
+		if(!_solutionFilename.empty() && !_applySolutionsBeforeAveraging)
+			throw std::runtime_error("With extra outputs, solutions can only be applied before averaging");
+	}
+	if(!_phaseCentres.empty() && _outputFormat == FlagsOutputFormat)
+		throw std::runtime_error("Extra phase centres can not be combined with writing flag files");
+	for(const std::unique_ptr<PhaseCentreOutput>& centre : _phaseCentres)
+		std::cout << "Phase centre " << RaDecCoord::RAToString(centre->raRad) << ' ' << RaDecCoord::DecToString(centre->decRad) << " will be written to " << centre->filename << ".\n";
+	for(ExtraOutput& output : _extraOutputs)
+	{
+		output.timeAvgFactor = averagingFactor(output.timeRes_s, _mwaConfig.Header().integrationTime);
+		output.freqAvgFactor = averagingFactor(output.freqRes_kHz, channelWidthKHz);
+		std::cout << "Extra output " << output.filename << ": "
+			<< output.timeAvgFactor*_mwaConfig.Header().integrationTime << " s / " << output.freqAvgFactor*channelWidthKHz << " kHz (time avg: "
+			<< output.timeAvgFactor << "x, freq avg: " << output.freqAvgFactor << "x).\n";
+	}
+	
 	_subbandEdgeFlagCount = round(_subbandEdgeFlagWidthKHz / (1000.0*_mwaConfig.Header().bandwidthMHz / _mwaConfig.Header().nChannels));
 	
 	_quackInitSampleCount = round(_initDurationToFlag / _mwaConfig.Header().integrationTime);
@@ -149,7 +189,8 @@ void Cotter::Run(double timeRes_s, double freqRes_kHz)
 	std::cout
 		<< "Wall-clock time in reading: " << _readWatch.ToString()
 		<< " processing: " << _processWatch.ToString()
-		<< " writing: " << _writeWatch.ToString() << '\n';
+		<< " writing: " << _writeWatch.ToString() << '\n'
+		<< "Write queues were full " << _writeQueueFullCount << " times and empty " << _writeQueueEmptyCount << " times.\n";
 }
 
 void Cotter::processAllContiguousBands(size_t timeAvgFactor, size_t freqAvgFactor)
@@ -181,26 +222,20 @@ void Cotter::processAllContiguousBands(size_t timeAvgFactor, size_t freqAvgFacto
 		
 		if(_defaultFilename)
 			_outputFilename = "preprocessed.ms";
-	
-		processOneContiguousBand(_outputFilename, timeAvgFactor, freqAvgFactor);
+		
+		std::vector<std::string> extraOutputFilenames;
+		for(const ExtraOutput& output : _extraOutputs)
+			extraOutputFilenames.push_back(output.filename);
+		std::vector<std::string> phaseCentreFilenames;
+		for(const std::unique_ptr<PhaseCentreOutput>& centre : _phaseCentres)
+			phaseCentreFilenames.push_back(centre->filename);
+	
+		processOneContiguousBand(_outputFilename, extraOutputFilenames, phaseCentreFilenames, timeAvgFactor, freqAvgFactor);
 	}
 	else {
 		std::cout << "Observation's bandwidth is non-contiguous.\n";
 		
-		std::string bandFilename;
-		if(_defaultFilename)
-			bandFilename = "preprocessed.ms";
-		else
-			bandFilename = _outputFilename;
-		
-		size_t dotPos = bandFilename.find(".");
-		if(dotPos == std::string::npos)
-			throw std::runtime_error("Something is wrong with the output filename.");
-		
-		if(_outputFormat != FlagsOutputFormat)
-		{
-			bandFilename = bandFilename.substr(0, dotPos) + "\?\?\?-\?\?\?" + bandFilename.substr(dotPos);
-		}
+		const std::string outputFilename = _defaultFilename ? "preprocessed.ms" : _outputFilename;
 		
 		for(size_t bandIndex = 0; bandIndex!=contiguousSBRanges.size(); ++bandIndex)
 		{
@@ -223,85 +258,146 @@ void Cotter::processAllContiguousBands(size_t timeAvgFactor, size_t freqAvgFacto
 				}
 			}
 			
-			if(_outputFormat != FlagsOutputFormat)
-			{
-				bandFilename[dotPos] = (char) ('0' + (chStartNo/100));
-				bandFilename[dotPos+1] = (char) ('0' + ((chStartNo/10)%10));
-				bandFilename[dotPos+2] = (char) ('0' + (chStartNo%10));
-				bandFilename[dotPos+4] = (char) ('0' + (chEndNo/100));
-				bandFilename[dotPos+5] = (char) ('0' + ((chEndNo/10)%10));
-				bandFilename[dotPos+6] = (char) ('0' + (chEndNo%10));
-			}
+			const std::string bandFilename = (_outputFormat == FlagsOutputFormat) ?
+				outputFilename : insertBandNumbers(outputFilename, chStartNo, chEndNo);
+			std::vector<std::string> extraOutputFilenames;
+			for(const ExtraOutput& output : _extraOutputs)
+				extraOutputFilenames.push_back(insertBandNumbers(output.filename, chStartNo, chEndNo));
+			std::vector<std::string> phaseCentreFilenames;
+			for(const std::unique_ptr<PhaseCentreOutput>& centre : _phaseCentres)
+				phaseCentreFilenames.push_back(insertBandNumbers(centre->filename, chStartNo, chEndNo));
 			std::cout << " |=== BAND " << (bandIndex+1) << " / " << contiguousSBRanges.size() << " ===|\n";
 			std::cout << "Writing contiguous band " << (bandIndex+1) << " to " << bandFilename << ".\n";
-			processOneContiguousBand(bandFilename, timeAvgFactor, freqAvgFactor);
+			processOneContiguousBand(bandFilename, extraOutputFilenames, phaseCentreFilenames, timeAvgFactor, freqAvgFactor);
 		}
 	}
 }
 
-void Cotter::processOneContiguousBand(const std::string& outputFilename, size_t timeAvgFactor, size_t freqAvgFactor)
+void Cotter::processOneContiguousBand(const std::string& outputFilename, const std::vector<std::string>& extraOutputFilenames, const std::vector<std::string>& phaseCentreFilenames, size_t timeAvgFactor, size_t freqAvgFactor)
 {
 	const size_t nChannelsPerNode = nChannelsInCurNodeSBRange();
+	std::unique_ptr<Writer> writer;
 	switch(_outputFormat)
 	{
 		case FlagsOutputFormat:
 			std::cout << "Only flags will be outputted.\n";
-			if(freqAvgFactor != 1 || timeAvgFactor != 1)
+			if(freqAvgFactor != 1 || timeAvgFactor != 1 || _bdaFieldRadiusDeg != 0.0)
 				throw std::runtime_error("You have specified time or frequency averaging and outputting only flags: this is incompatible");
 			if(_removeFlaggedAntennae || _removeAutoCorrelations)
 				throw std::runtime_error("Can't prune flagged/auto-correlated antennas when writing flag file");
-			_writer.reset(new FlagWriter(outputFilename, _mwaConfig.HeaderExt().gpsTime, _mwaConfig.Header().nScans, _curSbEnd - _curSbStart, nodeSbStart(), nodeSbEnd(), _subbandOrder));
+			writer.reset(new FlagWriter(outputFilename, _mwaConfig.HeaderExt().gpsTime, _mwaConfig.Header().nScans, _curSbEnd - _curSbStart, nodeSbStart(), nodeSbEnd(), _subbandOrder, *_threadPool, _threadCount));
+			_outputPartFilenames.assign(1, outputFilename);
 			break;
 		case FitsOutputFormat:
-			if(_nNodes > 1)
-				throw std::runtime_error("FITS output and MPI is incompatible");
-			_writer.reset(new ThreadedWriter(std::unique_ptr<FitsWriter>(new FitsWriter(outputFilename))));
+		case MSOutputFormat:
+			if(_nNodes > 1 && !_solutionFilename.empty())
+				throw std::runtime_error("Applying solutions is not supported when the subbands are divided over MPI nodes");
+			writer = createOutputWriter(outputFilename, _outputFormat, _outputPartFilenames);
 			break;
-		case MSOutputFormat: {
-			if(_nNodes > 1)
-				throw std::runtime_error("MS output and MPI is incompatible");
-			std::unique_ptr<MSWriter> msWriter(new MSWriter(outputFilename));
-			if(_useDysco)
-				msWriter->EnableCompression(_dyscoDataBitRate, _dyscoWeightBitRate, _dyscoDistribution, _dyscoDistTruncation, _dyscoNormalization);
-			_writer.reset(new ThreadedWriter(std::move(msWriter)));
-		} break;
 	}
 	if(!_solutionFilename.empty() && !_applySolutionsBeforeAveraging)
 	{
-		_writer.reset(new ApplySolutionsWriter(std::move(_writer), _solutionFilename));
+		writer.reset(new ApplySolutionsWriter(std::move(writer), _solutionFilename));
 	}
-	if(freqAvgFactor != 1 || timeAvgFactor != 1)
+	writer = addAveraging(std::move(writer), timeAvgFactor, freqAvgFactor, *this);
+	
+	// Extra outputs get their own averaging, and are fed the same rows as the main output
+	_outputChains.assign(1, writer.get());
+	_extraOutputPartFilenames.assign(_extraOutputs.size(), std::vector<std::string>());
+	if(!_extraOutputs.empty())
 	{
-		_writer.reset(new ThreadedWriter(std::unique_ptr<AveragingWriter>(new AveragingWriter(std::move(_writer), timeAvgFactor, freqAvgFactor, *this))));
+		std::vector<std::unique_ptr<Writer>> chains;
+		chains.emplace_back(std::move(writer));
+		for(size_t i=0; i!=_extraOutputs.size(); ++i)
+		{
+			const ExtraOutput& output = _extraOutputs[i];
+			chains.emplace_back(addAveraging(
+				createOutputWriter(extraOutputFilenames[i], output.format, _extraOutputPartFilenames[i]),
+				output.timeAvgFactor, output.freqAvgFactor, *this));
+			_outputChains.push_back(chains.back().get());
+		}
+		writer.reset(new MultiWriter(std::move(chains)));
 	}
+	
 	if(!_solutionFilename.empty() && _applySolutionsBeforeAveraging)
 	{
-		_writer.reset(new ApplySolutionsWriter(std::move(_writer), _solutionFilename));
+		writer.reset(new ApplySolutionsWriter(std::move(writer), _solutionFilename));
+	}
+	_writer = std::move(writer);
+	if(_extraOutputs.empty())
+		_outputChains.assign(1, _writer.get());
+	
+	// Each extra phase centre has a writer chain like the main output, which is fed
+	// separately because its rows have their own uvws and phase rotation
+	for(size_t i=0; i!=_phaseCentres.size(); ++i)
+	{
+		PhaseCentreOutput& centre = *_phaseCentres[i];
+		centre.uvwCache.SetPhaseCentre(centre.raRad * (12.0/M_PI), centre.decRad * (180.0/M_PI));
+		writer = createOutputWriter(phaseCentreFilenames[i], _outputFormat, centre.partFilenames);
+		if(!_solutionFilename.empty() && !_applySolutionsBeforeAveraging)
+			writer.reset(new ApplySolutionsWriter(std::move(writer), _solutionFilename));
+		writer = addAveraging(std::move(writer), timeAvgFactor, freqAvgFactor, centre);
+		if(!_solutionFilename.empty() && _applySolutionsBeforeAveraging)
+			writer.reset(new ApplySolutionsWriter(std::move(writer), _solutionFilename));
+		centre.writer = std::move(writer);
+		_outputChains.push_back(centre.writer.get());
+		
+		std::swap(centre.writer, _writer);
+		writeAntennae();
+		writeSPW();
+		writeSource(centre.raRad, centre.decRad);
+		writeField(centre.raRad, centre.decRad);
+		_writer->WritePolarizationForLinearPols(false);
+		writeObservation();
+		std::swap(centre.writer, _writer);
 	}
+	
+	const double
+		raRad = _mwaConfig.Header().raHrs * (M_PI/12.0),
+		decRad = _mwaConfig.Header().decDegs * (M_PI/180.0);
 	writeAntennae();
 	writeSPW();
-	writeSource();
-	writeField();
+	writeSource(raRad, decRad);
+	writeField(raRad, decRad);
 	_writer->WritePolarizationForLinearPols(false);
 	writeObservation();
 
-	if(!_qualityStatisticsFilename.empty())
+	if(!_qualityStatisticsFilename.empty() && _nodeRank == 0)
 	{
 		std::unique_ptr<Writer> qsWriter(new MSWriter(_qualityStatisticsFilename));
 		std::swap(qsWriter, _writer);
 		writeAntennae();
 		writeSPW();
-		writeSource();
-		writeField();
+		writeSource(raRad, decRad);
+		writeField(raRad, decRad);
 		_writer->WritePolarizationForLinearPols(false);
 		writeObservation();
 		std::swap(qsWriter, _writer);
 	}
 	
 	_hduOffsetsPerGPUBox.assign(_subbandCount, 9999);
+	_uvwCache.SetPhaseCentre(_mwaConfig.Header().raHrs, _mwaConfig.Header().decDegs);
+	
+	initPerInputCorrectionTables();
 	
 	const size_t antennaCount = _mwaConfig.NAntennae();
-	size_t maxScansPerPart = _maxBufferSize / (nChannelsPerNode*(antennaCount+1)*antennaCount*2);
+	// Without RFI detection, there is no need to see a long time window at once. In that case,
+	// data are streamed through in small blocks, with a few blocks in flight so that reading,
+	// processing and writing can overlap.
+	// With RFI detection, the observation is partitioned in as few chunks as possible.
+	// If more than one chunk is needed anyway, the memory is split over two chunk
+	// buffers, such that the next chunk can be read while the current one is
+	// flagged and written.
+	const bool isStreaming = !_rfiDetection;
+	const size_t scanSize = nChannelsPerNode*(antennaCount+1)*antennaCount*2;
+	size_t chunkBufferCount;
+	if(isStreaming)
+		chunkBufferCount = 3;
+	else if(_overlapChunks && _maxBufferSize / scanSize <= _mwaConfig.Header().nScans)
+		chunkBufferCount = 2;
+	else
+		chunkBufferCount = 1;
+	size_t maxScansPerPart = _maxBufferSize / (scanSize*chunkBufferCount);
 	
 	if(maxScansPerPart<1)
 	{
@@ -311,11 +407,18 @@ void Cotter::processOneContiguousBand(const std::string& outputFilename, size_t
 	{
 		std::cout << "WARNING! This computer does not have enough memory for accurate flagging; expect non-optimal flagging accuracy.\n"; 
 	}
+	if(isStreaming && _streamingBlockSize != 0 && maxScansPerPart > _streamingBlockSize)
+		maxScansPerPart = _streamingBlockSize;
 	size_t partCount = 1 + _mwaConfig.Header().nScans / maxScansPerPart;
-	if(partCount == 1)
+	if(isStreaming)
+		std::cout << "RFI detection is disabled: will stream " << _mwaConfig.Header().nScans << " scans in " << partCount << " blocks of at most " << maxScansPerPart << " scans.\n";
+	else if(partCount == 1)
 		std::cout << "All " << _mwaConfig.Header().nScans << " scans fit in memory; no partitioning necessary.\n";
-	else
+	else {
 		std::cout << "Observation does not fit fully in memory, will partition data in " << partCount << " chunks of at least " << (_mwaConfig.Header().nScans/partCount) << " scans.\n";
+		if(chunkBufferCount == 2)
+			std::cout << "Reading of the next chunk will be overlapped with processing the current chunk.\n";
+	}
 	
 	_scanTimes.resize(_mwaConfig.Header().nScans);
 	for(size_t t=0; t!=_mwaConfig.Header().nScans; ++t)
@@ -329,177 +432,390 @@ void Cotter::processOneContiguousBand(const std::string& outputFilename, size_t
 	paramStr << "timeavg=" << timeAvgFactor << ",freqavg=" << freqAvgFactor << ",windowSize=" << (_mwaConfig.Header().nScans/partCount);
 	params.push_back(paramStr.str());
 	_writer->WriteHistoryItem(_commandLine, "Cotter MWA preprocessor", params);
+	for(const std::unique_ptr<PhaseCentreOutput>& centre : _phaseCentres)
+		centre->writer->WriteHistoryItem(_commandLine, "Cotter MWA preprocessor", params);
 	
 	_strategy.reset(new Strategy(_flagger.MakeStrategy(MWA_TELESCOPE)));
 	
-	std::vector<std::vector<std::string> >::const_iterator
-		currentFileSetPtr = _fileSets.begin();
-	createReader(*currentFileSetPtr);
-	
 	_readWatch.Pause();
 	
-	for(size_t chunkIndex = 0; chunkIndex != partCount; ++chunkIndex)
+	runChunkPipeline(partCount, chunkBufferCount);
+	
+	_writeWatch.Start();
+	
+	for(Writer* chain : _outputChains)
+		writeAlignmentScans(*chain);
+	_outputChains.clear();
+	
+	const bool writerSupportsStatistics = _writer->CanWriteStatistics();
+	
+	for(const ThreadedWriter* writerQueue : _writerQueues)
 	{
-		std::cout << "=== Processing chunk " << (chunkIndex+1) << " of " << partCount << " ===\n";
-		_readWatch.Start();
-		
-		_curChunkStart = _mwaConfig.Header().nScans*chunkIndex/partCount;
-		_curChunkEnd = _mwaConfig.Header().nScans*(chunkIndex+1)/partCount;
-		
-		// Initialize buffers
-		if(chunkIndex == 0)
+		_writeQueueFullCount += writerQueue->QueueFullCount();
+		_writeQueueEmptyCount += writerQueue->QueueEmptyCount();
+	}
+	_writerQueues.clear();
+	_writer.reset();
+	for(const std::unique_ptr<PhaseCentreOutput>& centre : _phaseCentres)
+		centre->writer.reset();
+	_reader.reset();
+	
+	// Necessary to make sure it is reinitialized in the following cont band:
+	_flagReader.reset();
+	
+	// The statistics cover all subbands of this node, so with several output
+	// files they are written to the first file.
+	if(_collectStatistics && writerSupportsStatistics) {
+		std::cout << "Writing statistics to " << _outputPartFilenames.front() << "...\n";
+		_flagger.WriteStatistics(*_statistics, _outputPartFilenames.front());
+	}
+	
+	if(_nodeRank == 0 && _collectStatistics && !_qualityStatisticsFilename.empty()) {
+		std::cout << "Writing statistics to " << _qualityStatisticsFilename << "...\n";
+		_flagger.WriteStatistics(*_statistics, _qualityStatisticsFilename);
+	}
+	
+	finishOutputFiles(outputFilename, _outputFormat, _outputPartFilenames, _mwaConfig.Header().nScans/partCount);
+	for(size_t i=0; i!=_extraOutputs.size(); ++i)
+		finishOutputFiles(extraOutputFilenames[i], _extraOutputs[i].format, _extraOutputPartFilenames[i], _mwaConfig.Header().nScans/partCount);
+	for(size_t i=0; i!=_phaseCentres.size(); ++i)
+		finishOutputFiles(phaseCentreFilenames[i], _outputFormat, _phaseCentres[i]->partFilenames, _mwaConfig.Header().nScans/partCount);
+	
+	_writeWatch.Pause();
+}
+
+std::unique_ptr<Writer> Cotter::addAveraging(std::unique_ptr<Writer> writer, size_t timeAvgFactor, size_t freqAvgFactor, UVWCalculater& uvwCalculater)
+{
+	if(freqAvgFactor != 1 || timeAvgFactor != 1 || _bdaFieldRadiusDeg != 0.0)
+	{
+		std::unique_ptr<AveragingWriter> averagingWriter(new AveragingWriter(std::move(writer), timeAvgFactor, freqAvgFactor, uvwCalculater, *_threadPool, _threadCount));
+		if(_bdaFieldRadiusDeg != 0.0)
+			averagingWriter->SetBaselineTimeAvgFactors(baselineTimeAvgFactors(timeAvgFactor));
+		std::unique_ptr<ThreadedWriter> threadedWriter(new ThreadedWriter(std::move(averagingWriter), _writeQueueSize));
+		_writerQueues.push_back(threadedWriter.get());
+		writer = std::move(threadedWriter);
+	}
+	return writer;
+}
+
+/**
+ * Called after an output has been written: joins the parts into a multi-MS when
+ * requested, and adds the MWA specific fields to the files.
+ */
+void Cotter::finishOutputFiles(const std::string& outputFilename, enum OutputFormat format, const std::vector<std::string>& partFilenames, size_t flagWindowSize)
+{
+	// Rank 0 joins the measurement sets of all nodes, after all nodes have finished writing
+	if(format == MSOutputFormat && _writeMultiMS)
+	{
+		const std::vector<std::string> allPartFilenames = outputPartFilenamesOfAllNodes(outputFilename);
+		MPI_Barrier(MPI_COMM_WORLD);
+		if(_nodeRank == 0 && allPartFilenames.size() > 1)
 		{
-			// First time: allocate the buffers
-			const size_t requiredWidthCapacity = (_mwaConfig.Header().nScans+partCount-1)/partCount;
-			for(size_t antenna1=0;antenna1!=antennaCount;++antenna1)
-			{
-				for(size_t antenna2=antenna1; antenna2!=antennaCount; ++antenna2)
-				{
-					_imageSetBuffers.emplace(
-						std::pair<size_t,size_t>(antenna1, antenna2),
-						_flagger.MakeImageSet(_curChunkEnd-_curChunkStart, nChannelsPerNode, 8, 0.0f, requiredWidthCapacity)
-					);
-				}
-			}
-		} else {
-			// Resize the buffers, but don't reallocate. I used to reallocate all buffers
-			// here, but this gave awful memory fragmentation issues, since the buffers can have slightly
-			// different sizes during each run. This led to ~2x as much memory usage.
-			for(auto& buffer : _imageSetBuffers)
-			{
-				buffer.second.ResizeWithoutReallocation(_curChunkEnd-_curChunkStart);
-				buffer.second.Set(0.0f);
-			}
+			std::cout << "Writing multi-MS " << outputFilename << " with " << allPartFilenames.size() << " parts...\n";
+			MSWriter::WriteMultiMS(outputFilename, allPartFilenames);
 		}
+		MPI_Barrier(MPI_COMM_WORLD);
+	}
+	
+	if(format == MSOutputFormat)
+	{
+		std::cout << "Writing MWA fields to measurement set...\n";
+		for(const std::string& partFilename : partFilenames)
+			writeMWAFieldsToMS(partFilename, flagWindowSize);
+	}
+	else if(format == FitsOutputFormat)
+	{
+		std::cout << "Writing MWA fields to UVFits file...\n";
+		for(const std::string& partFilename : partFilenames)
+			writeMWAFieldsToUVFits(partFilename);
+	}
+}
+
+std::string Cotter::insertBandNumbers(const std::string& filename, int chStartNo, int chEndNo)
+{
+	const size_t dotPos = filename.find(".");
+	if(dotPos == std::string::npos)
+		throw std::runtime_error("Something is wrong with the output filename.");
+	char numbers[16];
+	snprintf(numbers, sizeof numbers, "%03d-%03d", chStartNo, chEndNo);
+	return filename.substr(0, dotPos) + numbers + filename.substr(dotPos);
+}
+
+void Cotter::runChunkPipeline(size_t partCount, size_t chunkBufferCount)
+{
+	// Each chunk buffer circulates through the reader stage, the processing stage
+	// and the writer stage. With a single buffer, this is fully serial.
+	_chunks.clear();
+	_freeChunks.resize(chunkBufferCount);
+	_readChunks.resize(chunkBufferCount);
+	_processedChunks.resize(chunkBufferCount);
+	for(size_t i=0; i!=chunkBufferCount; ++i)
+	{
+		_chunks.emplace_back(new Chunk());
+		_freeChunks.write(_chunks.back().get());
+	}
+	
+	// When stages overlap, their progress bars would interleave; in that case only
+	// the overall progress is shown.
+	_showStageProgress = (chunkBufferCount == 1);
+	if(!_showStageProgress)
+		_pipelineProgressBar.reset(new ProgressBar("Reading, processing and writing"));
+	
+	_readerException = std::exception_ptr();
+	_writerException = std::exception_ptr();
+	std::exception_ptr processingException;
+	
+	std::thread readerThread(&Cotter::readerStageFunc, this, partCount);
+	std::thread writerThread(&Cotter::writerStageFunc, this);
+	try
+	{
+		Chunk* chunk;
+		while(_readChunks.read(chunk))
+		{
+			processChunk(*chunk);
+			_processedChunks.write(chunk);
+		}
+	}
+	catch(...)
+	{
+		processingException = std::current_exception();
+		// Make sure the reader does not wait for buffers that will never be released
+		_freeChunks.write_end();
+	}
+	_processedChunks.write_end();
+	writerThread.join();
+	readerThread.join();
+	
+	_pipelineProgressBar.reset();
+	_chunks.clear();
+	
+	if(_readerException)
+		std::rethrow_exception(_readerException);
+	if(processingException)
+		std::rethrow_exception(processingException);
+	if(_writerException)
+		std::rethrow_exception(_writerException);
+}
+
+void Cotter::readerStageFunc(size_t partCount)
+{
+	try
+	{
+		_readWatch.Start();
+		std::vector<std::vector<std::string> >::const_iterator
+			currentFileSetPtr = _fileSets.begin();
+		createReader(*currentFileSetPtr);
+		_readWatch.Pause();
 		
-		size_t bufferPos = 0;
-		bool continueWithNextFile;
-		do {
-			initializeReader();
-			
-			bool firstRead = (bufferPos == 0 && chunkIndex == 0);
-			
-			bool moreAvailableInCurrentFile = _reader->Read(bufferPos, _curChunkEnd-_curChunkStart);
-			
-			if(firstRead && _reader->HasStartTime())
-			{
-				std::time_t startTime = _reader->StartTime();
-				std::tm startTimeTm;
-				gmtime_r(&startTime, &startTimeTm);
-				if(startTimeTm.tm_year+1900 != _mwaConfig.Header().year ||
-					startTimeTm.tm_mon+1 != _mwaConfig.Header().month ||
-					startTimeTm.tm_mday != _mwaConfig.Header().day ||
-					startTimeTm.tm_hour != _mwaConfig.Header().refHour ||
-					startTimeTm.tm_min != _mwaConfig.Header().refMinute ||
-					startTimeTm.tm_sec != _mwaConfig.Header().refSecond)
-				{
-					std::cout << "WARNING: start time according to raw files is "
-						<< startTimeTm.tm_year+1900  << '-' << twoDigits(startTimeTm.tm_mon+1) << '-' << twoDigits(startTimeTm.tm_mday) << ' '
-						<< twoDigits(startTimeTm.tm_hour) << ':' << twoDigits(startTimeTm.tm_min) << ':' << twoDigits(startTimeTm.tm_sec)
-						<< ",\nbut meta files say "
-						<< _mwaConfig.Header().year << '-' << twoDigits(_mwaConfig.Header().month) << '-' << twoDigits(_mwaConfig.Header().day) << ' '
-						<< twoDigits(_mwaConfig.Header().refHour) << ':' << twoDigits(_mwaConfig.Header().refMinute) << ':'
-						<< twoDigits(_mwaConfig.Header().refSecond)
-						<< " !\nWill use start time from raw file, which should be most accurate.\n";
-					_mwaConfig.HeaderRW().year = startTimeTm.tm_year+1900;
-					_mwaConfig.HeaderRW().month = startTimeTm.tm_mon+1;
-					_mwaConfig.HeaderRW().day = startTimeTm.tm_mday;
-					_mwaConfig.HeaderRW().refHour = startTimeTm.tm_hour;
-					_mwaConfig.HeaderRW().refMinute = startTimeTm.tm_min;
-					_mwaConfig.HeaderRW().refSecond = startTimeTm.tm_sec;
-					_mwaConfig.HeaderRW().dateFirstScanMJD = _mwaConfig.Header().GetDateFirstScanFromFields();
-				}
-			}
-			
-			if(!moreAvailableInCurrentFile && bufferPos < (_curChunkEnd-_curChunkStart))
-			{
-				if(currentFileSetPtr != _fileSets.end())
-				{
-					// Go to the next set of GPU files and add them to the buffer
-					++currentFileSetPtr;
-					continueWithNextFile = (currentFileSetPtr!=_fileSets.end());
-					if(continueWithNextFile)
-						createReader(*currentFileSetPtr);
-				} else {
-					continueWithNextFile = false;
-				}
-			} else {
-				continueWithNextFile = false;
-			}
-		} while(continueWithNextFile);
-		
-		if(bufferPos < _curChunkEnd-_curChunkStart)
+		Chunk* chunk;
+		for(size_t chunkIndex = 0; chunkIndex != partCount && _freeChunks.read(chunk); ++chunkIndex)
 		{
-			_missingEndScans = (_curChunkEnd-_curChunkStart)- bufferPos;
-			std::cout << "Warning: header specifies " << _mwaConfig.Header().nScans << " scans, but there are only " << (bufferPos+_curChunkStart) << " in the data.\n"
-			"Last " << _missingEndScans << " scan(s) will be flagged.\n";
-		} else {
-			_missingEndScans = 0;
+			if(_showStageProgress)
+				std::cout << "=== Processing chunk " << (chunkIndex+1) << " of " << partCount << " ===\n";
+			chunk->start = _mwaConfig.Header().nScans*chunkIndex/partCount;
+			chunk->end = _mwaConfig.Header().nScans*(chunkIndex+1)/partCount;
+			readChunk(*chunk, currentFileSetPtr, (_mwaConfig.Header().nScans+partCount-1)/partCount);
+			_readChunks.write(chunk);
 		}
-		if(_curChunkEnd + _quackEndSampleCount > _mwaConfig.Header().nScans)
+	}
+	catch(...)
+	{
+		_readerException = std::current_exception();
+	}
+	_readChunks.write_end();
+}
+
+void Cotter::writerStageFunc()
+{
+	try
+	{
+		Chunk* chunk;
+		while(_processedChunks.read(chunk))
 		{
-			size_t extraSamples = (_curChunkEnd + _quackEndSampleCount) - _mwaConfig.Header().nScans;
-			_missingEndScans += extraSamples;
-			std::cout << "Flagging extra " << extraSamples << " samples at end.\n";
+			writeChunk(*chunk);
+			_freeChunks.write(chunk);
 		}
-		
-		_fullysetMask.reset(new FlagMask(_flagger.MakeFlagMask(_curChunkEnd-_curChunkStart, _reader->ChannelCount(), true)));
-		_correlatorMask.reset(new FlagMask(_flagger.MakeFlagMask(_curChunkEnd-_curChunkStart, _reader->ChannelCount(), false)));
-		flagBadCorrelatorSamples(*_correlatorMask);
-		
+	}
+	catch(...)
+	{
+		_writerException = std::current_exception();
+		_freeChunks.write_end();
+	}
+}
+
+void Cotter::readChunk(Chunk& chunk, std::vector<std::vector<std::string> >::const_iterator& currentFileSetPtr, size_t requiredWidthCapacity)
+{
+	_readWatch.Start();
+	
+	const size_t antennaCount = _mwaConfig.NAntennae();
+	const size_t nChannelsPerNode = nChannelsInCurNodeSBRange();
+	
+	// Initialize buffers
+	if(chunk.imageSetBuffers.empty())
+	{
+		// First time: allocate the buffers
 		for(size_t antenna1=0;antenna1!=antennaCount;++antenna1)
 		{
 			for(size_t antenna2=antenna1; antenna2!=antennaCount; ++antenna2)
 			{
-				_baselinesToProcess.push(std::pair<size_t,size_t>(antenna1, antenna2));
-				
-				// We will put a place holder in the flagbuffer map, so we don't have to write (and lock)
-				// during multi threaded processing.
-				_flagBuffers.emplace(
+				chunk.imageSetBuffers.emplace(
 					std::pair<size_t,size_t>(antenna1, antenna2),
-					nullptr
+					_flagger.MakeImageSet(chunk.Width(), nChannelsPerNode, 8, 0.0f, requiredWidthCapacity)
 				);
 			}
 		}
-		_baselinesToProcessCount = _baselinesToProcess.size();
+	} else {
+		// Resize the buffers, but don't reallocate. I used to reallocate all buffers
+		// here, but this gave awful memory fragmentation issues, since the buffers can have slightly
+		// different sizes during each run. This led to ~2x as much memory usage.
+		for(auto& buffer : chunk.imageSetBuffers)
+		{
+			buffer.second.ResizeWithoutReallocation(chunk.Width());
+			buffer.second.Set(0.0f);
+		}
+	}
+	
+	size_t bufferPos = 0;
+	bool continueWithNextFile;
+	do {
+		initializeReader(chunk);
 		
-		_readWatch.Pause();
-		_processWatch.Start();
+		bool firstRead = (bufferPos == 0 && chunk.start == 0);
 		
-		if(!_flagFileTemplate.empty())
+		bool moreAvailableInCurrentFile = _reader->Read(bufferPos, chunk.Width());
+		
+		if(firstRead && _reader->HasStartTime())
 		{
-			_progressBar.reset(new ProgressBar("Reading flags"));
-			if(_flagReader.get() == 0)
-				_flagReader.reset(new FlagReader(_flagFileTemplate, _hduOffsetsPerGPUBox, _subbandOrder, _curSbStart, _curSbEnd));
-			// Create the flag masks
-			for(size_t antenna1=0;antenna1!=antennaCount;++antenna1)
+			std::time_t startTime = _reader->StartTime();
+			std::tm startTimeTm;
+			gmtime_r(&startTime, &startTimeTm);
+			if(startTimeTm.tm_year+1900 != _mwaConfig.Header().year ||
+				startTimeTm.tm_mon+1 != _mwaConfig.Header().month ||
+				startTimeTm.tm_mday != _mwaConfig.Header().day ||
+				startTimeTm.tm_hour != _mwaConfig.Header().refHour ||
+				startTimeTm.tm_min != _mwaConfig.Header().refMinute ||
+				startTimeTm.tm_sec != _mwaConfig.Header().refSecond)
 			{
-				for(size_t antenna2=antenna1; antenna2!=antennaCount; ++antenna2)
-				{
-					std::unique_ptr<FlagMask>& baseline = _flagBuffers.find(std::make_pair(antenna1, antenna2))->second;
-					baseline.reset(new FlagMask(_flagger.MakeFlagMask(_curChunkEnd-_curChunkStart, _reader->ChannelCount())));
-				}
+				std::cout << "WARNING: start time according to raw files is "
+					<< startTimeTm.tm_year+1900  << '-' << twoDigits(startTimeTm.tm_mon+1) << '-' << twoDigits(startTimeTm.tm_mday) << ' '
+					<< twoDigits(startTimeTm.tm_hour) << ':' << twoDigits(startTimeTm.tm_min) << ':' << twoDigits(startTimeTm.tm_sec)
+					<< ",\nbut meta files say "
+					<< _mwaConfig.Header().year << '-' << twoDigits(_mwaConfig.Header().month) << '-' << twoDigits(_mwaConfig.Header().day) << ' '
+					<< twoDigits(_mwaConfig.Header().refHour) << ':' << twoDigits(_mwaConfig.Header().refMinute) << ':'
+					<< twoDigits(_mwaConfig.Header().refSecond)
+					<< " !\nWill use start time from raw file, which should be most accurate.\n";
+				_mwaConfig.HeaderRW().year = startTimeTm.tm_year+1900;
+				_mwaConfig.HeaderRW().month = startTimeTm.tm_mon+1;
+				_mwaConfig.HeaderRW().day = startTimeTm.tm_mday;
+				_mwaConfig.HeaderRW().refHour = startTimeTm.tm_hour;
+				_mwaConfig.HeaderRW().refMinute = startTimeTm.tm_min;
+				_mwaConfig.HeaderRW().refSecond = startTimeTm.tm_sec;
+				_mwaConfig.HeaderRW().dateFirstScanMJD = _mwaConfig.Header().GetDateFirstScanFromFields();
 			}
-			// Fill the flag masks by reading the files
-			for(size_t t=_curChunkStart; t!=_curChunkEnd; ++t)
+		}
+		
+		// The chunk keeps the reader that (last) filled it, because it knows which
+		// visibilities are conjugated, and the reader might be replaced by the time
+		// this chunk is processed.
+		chunk.reader = _reader;
+		
+		if(!moreAvailableInCurrentFile && bufferPos < chunk.Width())
+		{
+			if(currentFileSetPtr != _fileSets.end())
 			{
-				_progressBar->SetProgress(t-_curChunkStart, _curChunkEnd-_curChunkStart);
-				size_t baselineIndex = 0;
-				for(size_t antenna1=0;antenna1!=antennaCount;++antenna1)
-				{
-					for(size_t antenna2=antenna1; antenna2!=antennaCount; ++antenna2)
-					{
-						std::unique_ptr<FlagMask>& mask = _flagBuffers.find(std::make_pair(antenna1, antenna2))->second;
-						size_t stride = mask->HorizontalStride();
-						bool* bufferPos = mask->Buffer() + (t - _curChunkStart);
-						_flagReader->Read(t, baselineIndex, bufferPos, stride);
-						++baselineIndex;
-					}
-				}
+				// Go to the next set of GPU files and add them to the buffer
+				++currentFileSetPtr;
+				continueWithNextFile = (currentFileSetPtr!=_fileSets.end());
+				if(continueWithNextFile)
+					createReader(*currentFileSetPtr);
+			} else {
+				continueWithNextFile = false;
 			}
-			_progressBar.reset();
+		} else {
+			continueWithNextFile = false;
 		}
-		
+	} while(continueWithNextFile);
+	
+	if(bufferPos < chunk.Width())
+	{
+		chunk.missingEndScans = chunk.Width() - bufferPos;
+		std::cout << "Warning: header specifies " << _mwaConfig.Header().nScans << " scans, but there are only " << (bufferPos+chunk.start) << " in the data.\n"
+		"Last " << chunk.missingEndScans << " scan(s) will be flagged.\n";
+	} else {
+		chunk.missingEndScans = 0;
+	}
+	if(chunk.end + _quackEndSampleCount > _mwaConfig.Header().nScans)
+	{
+		size_t extraSamples = (chunk.end + _quackEndSampleCount) - _mwaConfig.Header().nScans;
+		chunk.missingEndScans += extraSamples;
+		std::cout << "Flagging extra " << extraSamples << " samples at end.\n";
+	}
+	
+	_readWatch.Pause();
+}
+
+void Cotter::processChunk(Chunk& chunk)
+{
+	_processWatch.Start();
+	
+	const size_t antennaCount = _mwaConfig.NAntennae();
+	const size_t nChannels = chunk.reader->ChannelCount();
+	
+	chunk.fullysetMask.reset(new FlagMask(_flagger.MakeFlagMask(chunk.Width(), nChannels, true)));
+	chunk.correlatorMask.reset(new FlagMask(_flagger.MakeFlagMask(chunk.Width(), nChannels, false)));
+	flagBadCorrelatorSamples(*chunk.correlatorMask, chunk);
+	
+	_baselinesToProcess.clear();
+	for(size_t antenna1=0;antenna1!=antennaCount;++antenna1)
+	{
+		for(size_t antenna2=antenna1; antenna2!=antennaCount; ++antenna2)
+		{
+			_baselinesToProcess.emplace_back(antenna1, antenna2);
+			
+			// We will put a place holder in the flagbuffer map, so we don't have to write (and lock)
+			// during multi threaded processing.
+			chunk.flagBuffers.emplace(
+				std::pair<size_t,size_t>(antenna1, antenna2),
+				nullptr
+			);
+		}
+	}
+	// Baselines that go through RFI detection take much longer than the others. By
+	// processing these first, the cheap baselines fill up the gaps at the end and
+	// threads are not left idle while a few expensive baselines are still running.
+	// The partition is stable, so that baselines that share an antenna stay together.
+	std::stable_partition(_baselinesToProcess.begin(), _baselinesToProcess.end(),
+		[&](const std::pair<size_t,size_t>& baseline) { return isRFIDetectionPerformed(baseline.first, baseline.second); });
+	_nextBaselineIndex = 0;
+	_processedBaselineCount = 0;
+	
+	if(!_flagFileTemplate.empty())
+	{
+		if(_showStageProgress)
+			_progressBar.reset(new ProgressBar("Reading flags"));
+		if(_flagReader.get() == 0)
+			_flagReader.reset(new FlagReader(_flagFileTemplate, _hduOffsetsPerGPUBox, _subbandOrder, nodeSbStart(), nodeSbEnd()));
+		// Create the flag masks
+		std::vector<FlagReader::Destination> destinations;
+		for(size_t antenna1=0;antenna1!=antennaCount;++antenna1)
+		{
+			for(size_t antenna2=antenna1; antenna2!=antennaCount; ++antenna2)
+			{
+				std::unique_ptr<FlagMask>& baseline = chunk.flagBuffers.find(std::make_pair(antenna1, antenna2))->second;
+				baseline.reset(new FlagMask(_flagger.MakeFlagMask(chunk.Width(), nChannels)));
+				FlagReader::Destination destination;
+				destination.buffer = baseline->Buffer();
+				destination.stride = baseline->HorizontalStride();
+				destinations.push_back(destination);
+			}
+		}
+		// Fill the flag masks by reading the files
+		_flagReader->ReadTimesteps(chunk.start, chunk.end, destinations, *_threadPool, _threadCount, _progressBar.get());
+		_progressBar.reset();
+	}
+	
+	if(_showStageProgress)
+	{
 		std::string taskDescription;
 		if(_rfiDetection)
 		{
@@ -516,99 +832,101 @@ void Cotter::processOneContiguousBand(const std::string& outputFilename, size_t
 				taskDescription = "Conjugations, subband ordering and cable length corrections";
 		}
 		_progressBar.reset(new ProgressBar(taskDescription));
+	}
+	
+	// Baselines are processed in small groups, such that pool threads can run shuffle
+	// and write tasks in between. One pool thread is left to the other stages; the
+	// waiting thread takes its place.
+	const size_t groupCount = (_baselinesToProcess.size() + ProcessBaselineGroupSize - 1) / ProcessBaselineGroupSize;
+	ThreadPool::TaskGroup taskGroup(*_threadPool, std::max<size_t>(_threadCount, 2) - 1);
+	for(size_t i=0; i!=groupCount; ++i)
+		taskGroup.Run(std::bind(&Cotter::processBaselineGroup, this, std::ref(chunk)));
+	taskGroup.Wait();
+	
+	for(std::unique_ptr<QualityStatistics>& taskStatistics : _idleTaskStatistics)
+	{
+		if(!_statistics)
+			_statistics = std::move(taskStatistics);
+		else
+			(*_statistics) += *taskStatistics;
+	}
+	_idleTaskStatistics.clear();
 		
-		std::vector<std::thread> threadGroup;
-		try
-		{
-			for(size_t i=0; i!=_threadCount; ++i)
-				threadGroup.emplace_back(std::bind(&Cotter::baselineProcessThreadFunc, this));
-			for(std::thread& t : threadGroup)
-				t.join();
-		}
-		catch(...)
-		{
-			// Apparently C++ crashes when a std::thread exits scope without a join().
-			// This ensures that an thrown exception will not cause this problem
-			for(std::thread& t : threadGroup)
-			{
-				if(t.joinable())
-					t.join();
-			}
-			throw;
-		}
-			
-		_progressBar.reset();
-		_processWatch.Pause();
-		_writeWatch.Start();
-		
-		if(_skipWriting)
-		{
+	_progressBar.reset();
+	_processWatch.Pause();
+}
+
+void Cotter::writeChunk(Chunk& chunk)
+{
+	_writeWatch.Start();
+	
+	if(_skipWriting)
+	{
+		if(_showStageProgress)
 			std::cout << "Skipping writing of visibilities.\n";
-		}
-		else {
-			_progressBar.reset(new ProgressBar("Writing"));
+	}
+	else {
+		const size_t nChannelsPerNode = nChannelsInCurNodeSBRange();
+		std::unique_ptr<ProgressBar> progressBar;
+		if(_showStageProgress)
+			progressBar.reset(new ProgressBar("Writing"));
+		_outputWeights = make_aligned<float>(nChannelsPerNode*4, 16);
+		initializeWeights(_outputWeights);
+		if(_outputFormat == FlagsOutputFormat)
+		{
 			_outputFlags.reset(new bool[nChannelsPerNode*4]);
 			_outputData = make_aligned<std::complex<float>>(nChannelsPerNode*4, 16);
-			_outputWeights = make_aligned<float>(nChannelsPerNode*4, 16);
-			for(size_t t=_curChunkStart; t!=_curChunkEnd; ++t)
+			for(size_t t=chunk.start; t!=chunk.end; ++t)
 			{
-				_progressBar->SetProgress(t-_curChunkStart, _curChunkEnd-_curChunkStart);
-				if(_outputFormat == FlagsOutputFormat)
-					processAndWriteTimestepFlagsOnly(t);
-				else
-					processAndWriteTimestep(t);
+				if(progressBar)
+					progressBar->SetProgress(t-chunk.start, chunk.Width());
+				processAndWriteTimestepFlagsOnly(chunk, t);
 			}
 			_outputData.reset();
-			_outputWeights.reset();
 			_outputFlags.reset();
-			_progressBar.reset();
-		}
-		
-		_flagBuffers.clear();
-		
-		_correlatorMask.reset();
-		_fullysetMask.reset();
-		
-		_writeWatch.Pause();
-	} // end for chunkIndex!=partCount
-	
-	_imageSetBuffers.clear();
-	
-	_writeWatch.Start();
-	
-	writeAlignmentScans();
-	
-	const bool writerSupportsStatistics = _writer->CanWriteStatistics();
-	
-	_writer.reset();
-	_reader.reset();
-	
-	// Necessary to make sure it is reinitialized in the following cont band:
-	_flagReader.reset();
-	
-	if (_nodeRank == 0)
-	{
-		if(_collectStatistics && writerSupportsStatistics) {
-			std::cout << "Writing statistics to measurement set...\n";
-			_flagger.WriteStatistics(*_statistics, outputFilename);
-		}
-		
-		if(_collectStatistics && !_qualityStatisticsFilename.empty()) {
-			std::cout << "Writing statistics to " << _qualityStatisticsFilename << "...\n";
-			_flagger.WriteStatistics(*_statistics, _qualityStatisticsFilename);
 		}
-		
-		if(_outputFormat == MSOutputFormat)
-		{
-			std::cout << "Writing MWA fields to measurement set...\n";
-			writeMWAFieldsToMS(outputFilename, _mwaConfig.Header().nScans/partCount);
-		}
-		else if(_outputFormat == FitsOutputFormat)
-		{
-			std::cout << "Writing MWA fields to UVFits file...\n";
-			writeMWAFieldsToUVFits(outputFilename);
+		else {
+			// Rows are prepared for a few timesteps at a time. Each baseline then reads a
+			// short contiguous run of samples per channel from the channel-major image sets.
+			const size_t blockSize = std::min<size_t>(WriteBlockSize, chunk.Width());
+			_outputAntenna1.clear();
+			_outputAntenna2.clear();
+			for(size_t antenna1=0; antenna1!=_mwaConfig.NAntennae(); ++antenna1)
+			{
+				for(size_t antenna2=antenna1; antenna2!=_mwaConfig.NAntennae(); ++antenna2)
+				{
+					if(outputBaseline(antenna1, antenna2))
+					{
+						_outputAntenna1.push_back(antenna1);
+						_outputAntenna2.push_back(antenna2);
+					}
+				}
+			}
+			_blockData = make_aligned<std::complex<float>>(blockSize*_outputAntenna1.size()*nChannelsPerNode*4, 16);
+			_blockFlags.reset(new bool[blockSize*_outputAntenna1.size()*nChannelsPerNode*4]);
+			for(size_t t=chunk.start; t<chunk.end; t+=blockSize)
+			{
+				if(progressBar)
+					progressBar->SetProgress(t-chunk.start, chunk.Width());
+				const size_t blockEnd = std::min(t+blockSize, chunk.end);
+				processAndWriteTimesteps(chunk, t, blockEnd, _uvwCache, *_writer);
+				// The flagged and corrected samples are shared; only the uvws and the
+				// rotation are recalculated for each extra phase centre.
+				for(const std::unique_ptr<PhaseCentreOutput>& centre : _phaseCentres)
+					processAndWriteTimesteps(chunk, t, blockEnd, centre->uvwCache, *centre->writer);
+			}
+			_blockData.reset();
+			_blockFlags.reset();
 		}
+		_outputWeights.reset();
 	}
+	if(_pipelineProgressBar)
+		_pipelineProgressBar->SetProgress(chunk.end, _mwaConfig.Header().nScans);
+	
+	chunk.flagBuffers.clear();
+	
+	chunk.correlatorMask.reset();
+	chunk.fullysetMask.reset();
 	
 	_writeWatch.Pause();
 }
@@ -616,8 +934,11 @@ void Cotter::processOneContiguousBand(const std::string& outputFilename, size_t
 void Cotter::createReader(const std::vector<std::string>& curFileset)
 {
 	_reader.reset();
-	_reader.reset(new GPUFileReader(_mwaConfig.NAntennae(), nChannelsInCurNodeSBRange(), _threadCount, _offlineGPUBoxFormat));
+	_reader.reset(new GPUFileReader(_mwaConfig.NAntennae(), nChannelsInCurNodeSBRange(), *_threadPool, _offlineGPUBoxFormat));
 	_reader->SetHDUOffsetsChangeCallback(std::bind(&Cotter::onHDUOffsetsChange, this, std::placeholders::_1));
+	_reader->SetShowProgress(_showStageProgress);
+	_reader->SetAsyncReadAhead(_asyncReadAhead);
+	_reader->SetUseMMap(_useMMap);
 	
 	
 	// Add the gpubox files in the right order
@@ -630,7 +951,7 @@ void Cotter::createReader(const std::vector<std::string>& curFileset)
 	_reader->Initialize(_mwaConfig.Header().integrationTime, _doAlign);
 }
 
-void Cotter::initializeReader()
+void Cotter::initializeReader(Chunk& chunk)
 {
 	const size_t antennaCount = _mwaConfig.NAntennae();
 	
@@ -643,7 +964,7 @@ void Cotter::initializeReader()
 	{
 		for(size_t antenna2=antenna1; antenna2!=antennaCount; ++antenna2)
 		{
-			ImageSet &imageSet = _imageSetBuffers.find(std::pair<size_t, size_t>(antenna1, antenna2))->second;
+			ImageSet &imageSet = chunk.imageSetBuffers.find(std::pair<size_t, size_t>(antenna1, antenna2))->second;
 			BaselineBuffer buffer;
 			for(size_t p=0; p!=4; ++p)
 			{
@@ -656,145 +977,203 @@ void Cotter::initializeReader()
 	}
 }
 
-void Cotter::processAndWriteTimestep(size_t timeIndex)
+void Cotter::processAndWriteTimesteps(const Chunk& chunk, size_t blockStart, size_t blockEnd, UVWCache& uvwCache, Writer& writer)
 {
-	const size_t antennaCount = _mwaConfig.NAntennae();
-	const size_t nChannels = nChannelsInCurSBRange();
-	const double dateMJD = _mwaConfig.Header().dateFirstScanMJD + timeIndex * _mwaConfig.Header().integrationTime/86400.0;
-	
-	Geometry::UVWTimestepInfo uvwInfo;
-	Geometry::PrepareTimestepUVW(uvwInfo, dateMJD, _mwaConfig.ArrayLongitudeRad(), _mwaConfig.ArrayLattitudeRad(), _mwaConfig.Header().raHrs, _mwaConfig.Header().decDegs);
+	const size_t timestepCount = blockEnd - blockStart;
 	
-	double antU[antennaCount], antV[antennaCount], antW[antennaCount];
-	for(size_t antenna=0; antenna!=antennaCount; ++antenna)
+	std::vector<double> times(timestepCount);
+	for(size_t t=0; t!=timestepCount; ++t)
 	{
-		const double
-			x = _mwaConfig.Antenna(antenna).position[0],
-			y = _mwaConfig.Antenna(antenna).position[1],
-			z = _mwaConfig.Antenna(antenna).position[2];
-		Geometry::CalcUVW(uvwInfo, x, y, z, antU[antenna],antV[antenna], antW[antenna]);
+		const double dateMJD = _mwaConfig.Header().dateFirstScanMJD + (blockStart + t) * _mwaConfig.Header().integrationTime/86400.0;
+		times[t] = dateMJD*86400.0;
 	}
-	
-	_writer->AddRows(rowsPerTimescan());
-	
-	double cosAngles[nChannels], sinAngles[nChannels];
-	
-	initializeWeights(_outputWeights);
-	for(size_t antenna1=0; antenna1!=antennaCount; ++antenna1)
+	uvwCache.Prepare(times, *_threadPool, _threadCount);
+	_blockUVWs.resize(timestepCount);
+	for(size_t t=0; t!=timestepCount; ++t)
+		_blockUVWs[t] = uvwCache.Get(times[t]);
+	
+	// Rows are filled in parallel in groups of baselines, and written in order afterwards
+	const size_t rowCount = _outputAntenna1.size();
+	const size_t groupCount = (rowCount + WriteRowGroupSize - 1) / WriteRowGroupSize;
+	_threadPool->ParallelFor(groupCount, _threadCount, [&](size_t group)
 	{
-		for(size_t antenna2=antenna1; antenna2!=antennaCount; ++antenna2)
+		const size_t rowEnd = std::min((group+1) * WriteRowGroupSize, rowCount);
+		for(size_t row=group * WriteRowGroupSize; row!=rowEnd; ++row)
+			fillOutputRow(chunk, row, blockStart, timestepCount);
+	});
+	
+	// Each timestep is passed to the writer as one batch of rows
+	const size_t valuesPerRow = nChannelsInCurNodeSBRange() * 4;
+	std::vector<double>
+		rowTimes(rowCount), rowIntervals(rowCount, _mwaConfig.Header().integrationTime),
+		rowU(rowCount), rowV(rowCount), rowW(rowCount);
+	Writer::RowBatch batch;
+	batch.rowCount = rowCount;
+	batch.valuesPerRow = valuesPerRow;
+	batch.rowStride = valuesPerRow;
+	batch.times = rowTimes.data();
+	batch.timeCentroids = rowTimes.data();
+	batch.antenna1 = _outputAntenna1.data();
+	batch.antenna2 = _outputAntenna2.data();
+	batch.u = rowU.data();
+	batch.v = rowV.data();
+	batch.w = rowW.data();
+	batch.intervals = rowIntervals.data();
+	batch.weights = _outputWeights.get();
+	batch.sharedWeights = true;
+	for(size_t t=0; t!=timestepCount; ++t)
+	{
+		const UVWCache::AntennaUVW& uvw = *_blockUVWs[t];
+		for(size_t row=0; row!=rowCount; ++row)
 		{
-			if(outputBaseline(antenna1, antenna2))
+			const size_t
+				antenna1 = _outputAntenna1[row],
+				antenna2 = _outputAntenna2[row];
+			rowTimes[row] = times[t];
+			rowU[row] = uvw.u[antenna1] - uvw.u[antenna2];
+			rowV[row] = uvw.v[antenna1] - uvw.v[antenna2];
+			rowW[row] = uvw.w[antenna1] - uvw.w[antenna2];
+		}
+		batch.data = &_blockData[t * rowCount * valuesPerRow];
+		batch.flags = &_blockFlags[t * rowCount * valuesPerRow];
+		writer.AddRows(rowsPerTimescan());
+		writer.WriteRows(batch);
+	}
+}
+
+/**
+ * Transposes the samples of one baseline for all timesteps of the current block from the
+ * channel-major image sets into rows of channel-interleaved polarizations, while
+ * applying the geometric phase delay (for w).
+ */
+void Cotter::fillOutputRow(const Chunk& chunk, size_t row, size_t blockStart, size_t timestepCount) const
+{
+	const size_t
+		antenna1 = _outputAntenna1[row],
+		antenna2 = _outputAntenna2[row],
+		nChannels = nChannelsInCurNodeSBRange(),
+		channelsPerSubband = _mwaConfig.Header().nChannels / _subbandCount,
+		channelOffset = (nodeSbStart() - _curSbStart) * channelsPerSubband,
+		rowCount = _outputAntenna1.size(),
+		bufferIndex = blockStart - chunk.start;
+	const ImageSet& imageSet = chunk.imageSetBuffers.find(std::pair<size_t, size_t>(antenna1, antenna2))->second;
+	const std::unique_ptr<FlagMask>& flagMask = chunk.flagBuffers.find(std::pair<size_t, size_t>(antenna1, antenna2))->second;
+	const size_t stride = imageSet.HorizontalStride();
+	const size_t flagStride = flagMask->HorizontalStride();
+	
+	// Rotation coefficients, indexed by [ch * WriteBlockSize + t]. Within a subband, the
+	// frequency increases linearly with channel, so the rotation of the next channel
+	// follows from multiplying with a constant phasor. The buffers are kept per thread,
+	// such that they are only allocated when the number of channels changes.
+	static thread_local std::vector<float> cosAngles, sinAngles;
+	cosAngles.resize(nChannels * WriteBlockSize);
+	sinAngles.resize(nChannels * WriteBlockSize);
+	for(size_t t=0; t!=timestepCount; ++t)
+	{
+		if(_mwaConfig.Header().geomCorrection)
+		{
+			const double w = _blockUVWs[t]->w[antenna1] - _blockUVWs[t]->w[antenna2];
+			for(size_t sbStart=0; sbStart!=nChannels; sbStart+=channelsPerSubband)
 			{
-				const ImageSet& imageSet = _imageSetBuffers.find(std::pair<size_t, size_t>(antenna1, antenna2))->second;
-				const std::unique_ptr<FlagMask>& flagMask = _flagBuffers.find(std::pair<size_t, size_t>(antenna1, antenna2))->second;
-				
-				const size_t stride = imageSet.HorizontalStride();
-				const size_t flagStride = flagMask->HorizontalStride();
-				double
-					u = antU[antenna1] - antU[antenna2],
-					v = antV[antenna1] - antV[antenna2],
-					w = antW[antenna1] - antW[antenna2];
-					
-				// Pre-calculate rotation coefficients for geometric phase delay correction
-				if(_mwaConfig.Header().geomCorrection)
+				const double
+					*frequencies = &_channelFrequenciesHz[sbStart + channelOffset],
+					startAngle = -2.0*M_PI*w*frequencies[0] / SPEED_OF_LIGHT,
+					stepAngle = (channelsPerSubband > 1) ? (-2.0*M_PI*w*(frequencies[1]-frequencies[0]) / SPEED_OF_LIGHT) : 0.0;
+				double sinAng, cosAng, sinStep, cosStep;
+				sincos(startAngle, &sinAng, &cosAng);
+				sincos(stepAngle, &sinStep, &cosStep);
+				for(size_t ch=sbStart; ch!=sbStart+channelsPerSubband; ++ch)
 				{
-					for(size_t ch=0; ch!=nChannels; ++ch)
-					{
-						double angle = -2.0*M_PI*w*_channelFrequenciesHz[ch] / SPEED_OF_LIGHT;
-						double sinAng, cosAng;
-						sincos(angle, &sinAng, &cosAng);
-						sinAngles[ch] = sinAng; cosAngles[ch] = cosAng;
-					}
+					cosAngles[ch * WriteBlockSize + t] = cosAng;
+					sinAngles[ch * WriteBlockSize + t] = sinAng;
+					const double nextCos = cosAng * cosStep - sinAng * sinStep;
+					sinAng = sinAng * cosStep + cosAng * sinStep;
+					cosAng = nextCos;
 				}
-				
-				size_t bufferIndex = timeIndex - _curChunkStart;
-	#ifndef USE_SSE
-				for(size_t p=0; p!=4; ++p)
-				{
-					const float
-						*realPtr = imageSet.ImageBuffer(p*2)+bufferIndex,
-						*imagPtr = imageSet.ImageBuffer(p*2+1)+bufferIndex;
-					const bool *flagPtr = flagMask.Buffer()+bufferIndex;
-					std::complex<float> *outDataPtr = &_outputData[p];
-					bool *outputFlagPtr = &_outputFlags[p];
-					for(size_t ch=0; ch!=nChannels; ++ch)
-					{
-						// Apply geometric phase delay (for w)
-						if(_mwaConfig.Header().geomCorrection)
-						{
-							const float rtmp = *realPtr, itmp = *imagPtr;
-							*outDataPtr = std::complex<float>(
-								cosAngles[ch] * rtmp - sinAngles[ch] * itmp,
-								sinAngles[ch] * rtmp + cosAngles[ch] * itmp
-							);
-						} else {
-							*outDataPtr = std::complex<float>(*realPtr, *imagPtr);
-						}
-						*outputFlagPtr = *flagPtr;
-						realPtr += stride;
-						imagPtr += stride;
-						flagPtr += flagStride;
-						outDataPtr += 4;
-						outputFlagPtr += 4;
-					}
-				}
-	#else
-				const float
-					*realAPtr = imageSet.ImageBuffer(0)+bufferIndex,
-					*imagAPtr = imageSet.ImageBuffer(1)+bufferIndex,
-					*realBPtr = imageSet.ImageBuffer(2)+bufferIndex,
-					*imagBPtr = imageSet.ImageBuffer(3)+bufferIndex,
-					*realCPtr = imageSet.ImageBuffer(4)+bufferIndex,
-					*imagCPtr = imageSet.ImageBuffer(5)+bufferIndex,
-					*realDPtr = imageSet.ImageBuffer(6)+bufferIndex,
-					*imagDPtr = imageSet.ImageBuffer(7)+bufferIndex;
-				const bool *flagPtr = flagMask->Buffer()+bufferIndex;
-				std::complex<float> *outDataPtr = &_outputData[0];
-				bool *outputFlagPtr = &_outputFlags[0];
-				for(size_t ch=0; ch!=nChannels; ++ch)
+			}
+		}
+		else {
+			for(size_t ch=0; ch!=nChannels; ++ch)
+			{
+				cosAngles[ch * WriteBlockSize + t] = 1.0;
+				sinAngles[ch * WriteBlockSize + t] = 0.0;
+			}
+		}
+	}
+	
+	const float *realPtrs[4], *imagPtrs[4];
+	for(size_t p=0; p!=4; ++p)
+	{
+		realPtrs[p] = imageSet.ImageBuffer(p*2) + bufferIndex;
+		imagPtrs[p] = imageSet.ImageBuffer(p*2+1) + bufferIndex;
+	}
+	std::complex<float> *outDataPtrs[WriteBlockSize];
+	bool *outFlagPtrs[WriteBlockSize];
+	for(size_t t=0; t!=timestepCount; ++t)
+	{
+		outDataPtrs[t] = &_blockData[(t * rowCount + row) * nChannels * 4];
+		outFlagPtrs[t] = &_blockFlags[(t * rowCount + row) * nChannels * 4];
+	}
+	
+	for(size_t ch=0; ch!=nChannels; ++ch)
+	{
+		const size_t offset = ch * stride;
+		const float
+			*cosPtr = &cosAngles[ch * WriteBlockSize],
+			*sinPtr = &sinAngles[ch * WriteBlockSize];
+#ifdef USE_SSE
+		if(timestepCount == 4)
+		{
+			// Rotate four timesteps of each polarization at once, and transpose the
+			// polarization x timestep matrices to get the four polarizations per timestep.
+			const __m128 cosVals = _mm_loadu_ps(cosPtr), sinVals = _mm_loadu_ps(sinPtr);
+			__m128 reals[4], imags[4];
+			for(size_t p=0; p!=4; ++p)
+			{
+				const __m128
+					r = _mm_loadu_ps(realPtrs[p] + offset),
+					i = _mm_loadu_ps(imagPtrs[p] + offset);
+				reals[p] = _mm_sub_ps(_mm_mul_ps(r, cosVals), _mm_mul_ps(i, sinVals));
+				imags[p] = _mm_add_ps(_mm_mul_ps(r, sinVals), _mm_mul_ps(i, cosVals));
+			}
+			_MM_TRANSPOSE4_PS(reals[0], reals[1], reals[2], reals[3]);
+			_MM_TRANSPOSE4_PS(imags[0], imags[1], imags[2], imags[3]);
+			for(size_t t=0; t!=4; ++t)
+			{
+				float *outPtr = reinterpret_cast<float*>(outDataPtrs[t] + ch*4);
+				_mm_store_ps(outPtr, _mm_unpacklo_ps(reals[t], imags[t]));
+				_mm_store_ps(outPtr + 4, _mm_unpackhi_ps(reals[t], imags[t]));
+			}
+		}
+		else
+#endif
+		{
+			for(size_t p=0; p!=4; ++p)
+			{
+				for(size_t t=0; t!=timestepCount; ++t)
 				{
-					// Apply geometric phase delay (for w)
-					if(_mwaConfig.Header().geomCorrection)
-					{
-						// Note that order within set_ps is reversed; for the four complex numbers,
-						// the first two compl are loaded corresponding to set_ps(imag2, real2, imag1, real1).
-						__m128 ra = _mm_set_ps(*realBPtr, *realBPtr, *realAPtr, *realAPtr);
-						__m128 rb = _mm_set_ps(*realDPtr, *realDPtr, *realCPtr, *realCPtr);
-						__m128 rgeom = _mm_set_ps(sinAngles[ch], cosAngles[ch], sinAngles[ch], cosAngles[ch]);
-						__m128 ia = _mm_set_ps(*imagBPtr, *imagBPtr, *imagAPtr, *imagAPtr);
-						__m128 ib = _mm_set_ps(*imagDPtr, *imagDPtr, *imagCPtr, *imagCPtr);
-						__m128 igeom = _mm_set_ps(cosAngles[ch], -sinAngles[ch], cosAngles[ch], -sinAngles[ch]);
-						__m128 outa = _mm_add_ps(_mm_mul_ps(ra, rgeom), _mm_mul_ps(ia, igeom));
-						__m128 outb = _mm_add_ps(_mm_mul_ps(rb, rgeom), _mm_mul_ps(ib, igeom));
-						_mm_store_ps((float*) outDataPtr, outa);
-						_mm_store_ps((float*) (outDataPtr+2), outb);
-					} else {
-						*outDataPtr = std::complex<float>(*realAPtr, *imagAPtr);
-						*(outDataPtr+1) = std::complex<float>(*realBPtr, *imagBPtr);
-						*(outDataPtr+2) = std::complex<float>(*realCPtr, *imagCPtr);
-						*(outDataPtr+3) = std::complex<float>(*realDPtr, *imagDPtr);
-					}
-					*outputFlagPtr = *flagPtr; ++outputFlagPtr;
-					*outputFlagPtr = *flagPtr; ++outputFlagPtr;
-					*outputFlagPtr = *flagPtr; ++outputFlagPtr;
-					*outputFlagPtr = *flagPtr; ++outputFlagPtr;
-					realAPtr += stride; imagAPtr += stride;
-					realBPtr += stride; imagBPtr += stride;
-					realCPtr += stride; imagCPtr += stride;
-					realDPtr += stride; imagDPtr += stride;
-					flagPtr += flagStride;
-					outDataPtr += 4;
+					const float rtmp = realPtrs[p][offset + t], itmp = imagPtrs[p][offset + t];
+					outDataPtrs[t][ch*4 + p] = std::complex<float>(
+						cosPtr[t] * rtmp - sinPtr[t] * itmp,
+						sinPtr[t] * rtmp + cosPtr[t] * itmp
+					);
 				}
-	#endif
-				
-				_writer->WriteRow(dateMJD*86400.0, dateMJD*86400.0, antenna1, antenna2, u, v, w, _mwaConfig.Header().integrationTime, _outputData.get(), _outputFlags.get(), _outputWeights.get());
 			}
 		}
+		
+		const bool *flagPtr = flagMask->Buffer() + ch * flagStride + bufferIndex;
+		for(size_t t=0; t!=timestepCount; ++t)
+		{
+			bool *outFlagPtr = outFlagPtrs[t] + ch*4;
+			outFlagPtr[0] = flagPtr[t];
+			outFlagPtr[1] = flagPtr[t];
+			outFlagPtr[2] = flagPtr[t];
+			outFlagPtr[3] = flagPtr[t];
+		}
 	}
 }
 
-void Cotter::processAndWriteTimestepFlagsOnly(size_t timeIndex)
+void Cotter::processAndWriteTimestepFlagsOnly(const Chunk& chunk, size_t timeIndex)
 {
 	const size_t antennaCount = _mwaConfig.NAntennae();
 	const size_t nChannels = nChannelsInCurNodeSBRange();
@@ -802,18 +1181,17 @@ void Cotter::processAndWriteTimestepFlagsOnly(size_t timeIndex)
 	
 	_writer->AddRows(rowsPerTimescan());
 	
-	initializeWeights(_outputWeights);
 	for(size_t antenna1=0; antenna1!=antennaCount; ++antenna1)
 	{
 		for(size_t antenna2=antenna1; antenna2!=antennaCount; ++antenna2)
 		{
 			if(outputBaseline(antenna1, antenna2))
 			{
-				const std::unique_ptr<FlagMask>& flagMask = _flagBuffers.find(std::pair<size_t, size_t>(antenna1, antenna2))->second;
+				const std::unique_ptr<FlagMask>& flagMask = chunk.flagBuffers.find(std::pair<size_t, size_t>(antenna1, antenna2))->second;
 				
 				const size_t flagStride = flagMask->HorizontalStride();
 				
-				size_t bufferIndex = timeIndex - _curChunkStart;
+				size_t bufferIndex = timeIndex - chunk.start;
 				for(size_t p=0; p!=4; ++p)
 				{
 					const bool *flagPtr = flagMask->Buffer()+bufferIndex;
@@ -834,124 +1212,102 @@ void Cotter::processAndWriteTimestepFlagsOnly(size_t timeIndex)
 
 void Cotter::CalculateUVW(double date, size_t antenna1, size_t antenna2, double &u, double &v, double &w)
 {
-	// TODO we could cache the station uvw per timestep for improved performance
-	
-	Geometry::UVWTimestepInfo uvwInfo;
-	Geometry::PrepareTimestepUVW(uvwInfo, date/86400.0, _mwaConfig.ArrayLongitudeRad(), _mwaConfig.ArrayLattitudeRad(), _mwaConfig.Header().raHrs, _mwaConfig.Header().decDegs);
-	const double
-		x1 = _mwaConfig.Antenna(antenna1).position[0],
-		y1 = _mwaConfig.Antenna(antenna1).position[1],
-		z1 = _mwaConfig.Antenna(antenna1).position[2],
-		x2 = _mwaConfig.Antenna(antenna2).position[0],
-		y2 = _mwaConfig.Antenna(antenna2).position[1],
-		z2 = _mwaConfig.Antenna(antenna2).position[2];
-	double u1, v1, w1, u2, v2, w2;
-	Geometry::CalcUVW(uvwInfo, x1, y1, z1, u1, v1, w1);
-	Geometry::CalcUVW(uvwInfo, x2, y2, z2, u2, v2, w2);
-	u = u1 - u2,
-	v = v1 - v2,
-	w = w1 - w2;
+	_uvwCache.BaselineUVW(date, antenna1, antenna2, u, v, w);
 }
 
-void Cotter::baselineProcessThreadFunc()
+void Cotter::processBaselineGroup(Chunk& chunk)
 {
-	QualityStatistics threadStatistics =
-		_flagger.MakeQualityStatistics(&_scanTimes[_curChunkStart], _curChunkEnd-_curChunkStart, &_channelFrequenciesHz[0], _channelFrequenciesHz.size(), 4, _collectHistograms);
+	// Statistics of a finished task are reused, such that at most one statistics
+	// object is made per concurrently running task
+	std::unique_ptr<QualityStatistics> taskStatistics;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		if(!_idleTaskStatistics.empty())
+		{
+			taskStatistics = std::move(_idleTaskStatistics.back());
+			_idleTaskStatistics.pop_back();
+		}
+	}
+	if(!taskStatistics)
+	{
+		// Statistics are collected for the subbands of this node
+		const size_t channelOffset = (nodeSbStart() - _curSbStart) * (_mwaConfig.Header().nChannels / _subbandCount);
+		taskStatistics.reset(new QualityStatistics(
+			_flagger.MakeQualityStatistics(&_scanTimes[chunk.start], chunk.Width(), &_channelFrequenciesHz[channelOffset], nChannelsInCurNodeSBRange(), 4, _collectHistograms)));
+	}
 	
-	std::unique_lock<std::mutex> lock(_mutex);
-	while(!_baselinesToProcess.empty())
+	const size_t baselineCount = _baselinesToProcess.size();
+	const size_t groupStart = _nextBaselineIndex.fetch_add(ProcessBaselineGroupSize);
+	const size_t groupEnd = std::min<size_t>(groupStart + ProcessBaselineGroupSize, baselineCount);
+	for(size_t index=groupStart; index<groupEnd; ++index)
 	{
-		std::pair<size_t, size_t> baseline = _baselinesToProcess.front();
-		size_t currentTaskCount = _baselinesToProcess.size();
-		_progressBar->SetProgress(_baselinesToProcessCount - currentTaskCount, _baselinesToProcessCount);
-		_baselinesToProcess.pop();
-		lock.unlock();
+		const std::pair<size_t, size_t>& baseline = _baselinesToProcess[index];
+		processBaseline(chunk, baseline.first, baseline.second, *taskStatistics);
 		
-		processBaseline(baseline.first, baseline.second, threadStatistics);
-		lock.lock();
+		const size_t processedCount = ++_processedBaselineCount;
+		// Progress is reported by one thread at a time; other threads don't wait for it
+		if(_progressBar)
+		{
+			std::unique_lock<std::mutex> progressLock(_progressMutex, std::try_to_lock);
+			if(progressLock.owns_lock())
+				_progressBar->SetProgress(processedCount, baselineCount);
+		}
 	}
 	
-	// Mutex still needs to be locked
-	if(!_statistics)
-		_statistics.reset(new QualityStatistics(threadStatistics));
-	else
-		(*_statistics) += threadStatistics;
+	std::lock_guard<std::mutex> lock(_mutex);
+	_idleTaskStatistics.emplace_back(std::move(taskStatistics));
 }
 
-void Cotter::processBaseline(size_t antenna1, size_t antenna2, QualityStatistics &statistics)
+void Cotter::processBaseline(Chunk& chunk, size_t antenna1, size_t antenna2, QualityStatistics &statistics)
 {
-	ImageSet& imageSet = _imageSetBuffers.find(std::pair<size_t,size_t>(antenna1, antenna2))->second;
-	const MWAInput
-		&input1X = _mwaConfig.AntennaXInput(antenna1),
-		&input1Y = _mwaConfig.AntennaYInput(antenna1),
-		&input2X = _mwaConfig.AntennaXInput(antenna2),
-		&input2Y = _mwaConfig.AntennaYInput(antenna2);
-		
-	// Correct conjugated baselines
-	if(_reader->IsConjugated(antenna1, antenna2, 0, 0)) {
-		correctConjugated(imageSet, 1);
-	}
-	if(_reader->IsConjugated(antenna1, antenna2, 0, 1)) {
-		correctConjugated(imageSet, 3);
-	}
-	if(_reader->IsConjugated(antenna1, antenna2, 1, 0)) {
-		correctConjugated(imageSet, 5);
-	}
-	if(_reader->IsConjugated(antenna1, antenna2, 1, 1)) {
-		correctConjugated(imageSet, 7);
-	}
-	
-	// Correct cable delay
-	correctCableLength(imageSet, 0, input2X.cableLenDelta - input1X.cableLenDelta);
-	correctCableLength(imageSet, 1, input2Y.cableLenDelta - input1X.cableLenDelta);
-	correctCableLength(imageSet, 2, input2X.cableLenDelta - input1Y.cableLenDelta);
-	correctCableLength(imageSet, 3, input2Y.cableLenDelta - input1Y.cableLenDelta);
-	
-	// Correct passband
-	for(size_t i=0; i!=8; ++i)
+	ImageSet& imageSet = chunk.imageSetBuffers.find(std::pair<size_t,size_t>(antenna1, antenna2))->second;
+	// Conjugated baselines have already been corrected by the reader
+	
+	// The cable delay and passband corrections are combined into a single complex
+	// coefficient per polarization and channel, which are applied in one pass.
+	// Both the cable delay phasor and the subband gain factorize per input, hence
+	// the coefficients follow from the per-input tables as conj(a) * b * passband.
+	const size_t nChannels = imageSet.Height();
+	std::vector<std::complex<float>> coefficients(4 * nChannels);
+	for(size_t p=0; p!=4; ++p)
 	{
-		const double* subbandGains1Ptr = (i<4) ? input1X.pfbGains : input1Y.pfbGains;
-		const double* subbandGains2Ptr = (i==0 || i==1 || i==4 || i==5) ? input2X.pfbGains : input2Y.pfbGains;
-		
-		const size_t channelsPerSubband = imageSet.Height()/(_curSbEnd - _curSbStart);
-		for(size_t sb=0; sb!=_curSbEnd - _curSbStart; ++sb)
+		const std::complex<float>
+			*rowA = inputCorrectionRow(antenna1, p/2),
+			*rowB = inputCorrectionRow(antenna2, p%2);
+		const float *passband = _channelPassbandCorrections[p].data();
+		std::complex<float> *polCoefficients = &coefficients[p * nChannels];
+		for(size_t y=0; y!=nChannels; ++y)
 		{
-			double subbandGainCorrection = 1.0 / (subbandGains1Ptr[sb+_curSbStart] * subbandGains2Ptr[sb+_curSbStart]);
-			
-			for(size_t ch=0; ch!=channelsPerSubband; ++ch)
-			{
-				float *channelPtr = imageSet.ImageBuffer(i) + (ch+sb*channelsPerSubband) * imageSet.HorizontalStride();
-				const float correctionFactor = _subbandCorrectionFactors[i/2][ch] * subbandGainCorrection;
-				for(size_t x=0; x!=imageSet.Width(); ++x)
-				{
-					*channelPtr *= correctionFactor;
-					++channelPtr;
-				}
-			}
+			const float
+				aReal = rowA[y].real(), aImag = rowA[y].imag(),
+				bReal = rowB[y].real(), bImag = rowB[y].imag();
+			polCoefficients[y] = std::complex<float>(
+				(aReal * bReal + aImag * bImag) * passband[y],
+				(aReal * bImag - aImag * bReal) * passband[y]);
 		}
 	}
+	correctBaseline(imageSet, coefficients.data());
 	
 	std::unique_ptr<FlagMask> flagMask;
 	FlagMask *correlatorMask;
 	// Perform RFI detection, if baseline is not flagged.
-	bool skipFlagging = input1X.isFlagged || input1Y.isFlagged || input2X.isFlagged || input2Y.isFlagged || _isAntennaFlaggedMap[antenna1] || _isAntennaFlaggedMap[antenna2];
-	if(skipFlagging)
+	if(isBaselineFlagged(antenna1, antenna2))
 	{
 		if(_flagFileTemplate.empty())
-			flagMask.reset(new FlagMask(*_fullysetMask));
+			flagMask.reset(new FlagMask(*chunk.fullysetMask));
 		else
-			flagMask = std::move(_flagBuffers.find(std::pair<size_t, size_t>(antenna1, antenna2))->second);
-		correlatorMask = _fullysetMask.get();
+			flagMask = std::move(chunk.flagBuffers.find(std::pair<size_t, size_t>(antenna1, antenna2))->second);
+		correlatorMask = chunk.fullysetMask.get();
 	}
 	else 
 	{
 		
 		if(!_flagFileTemplate.empty())
 		{
-			flagMask = std::move(_flagBuffers.find(std::pair<size_t, size_t>(antenna1, antenna2))->second);
+			flagMask = std::move(chunk.flagBuffers.find(std::pair<size_t, size_t>(antenna1, antenna2))->second);
 			if(antenna1 == antenna2)
 			{
-				flagMask.reset(new FlagMask(_flagger.MakeFlagMask(_curChunkEnd-_curChunkStart, _reader->ChannelCount(), false)));
+				flagMask.reset(new FlagMask(_flagger.MakeFlagMask(chunk.Width(), chunk.reader->ChannelCount(), false)));
 			}
 		}
 		else if(_rfiDetection && (antenna1 != antenna2))
@@ -962,9 +1318,9 @@ void Cotter::processBaseline(size_t antenna1, size_t antenna2, QualityStatistics
 			flagMask.reset(new FlagMask(_flagger.Run(*_strategy, imageSet)));
 		}
 		else
-			flagMask.reset(new FlagMask(_flagger.MakeFlagMask(_curChunkEnd-_curChunkStart, _reader->ChannelCount(), false)));
-		flagBadCorrelatorSamples(*flagMask);
-		correlatorMask = _correlatorMask.get();
+			flagMask.reset(new FlagMask(_flagger.MakeFlagMask(chunk.Width(), chunk.reader->ChannelCount(), false)));
+		flagBadCorrelatorSamples(*flagMask, chunk);
+		correlatorMask = chunk.correlatorMask.get();
 	}
 	
 	// Collect statistics
@@ -975,47 +1331,56 @@ void Cotter::processBaseline(size_t antenna1, size_t antenna2, QualityStatistics
 	// to allow collecting its statistics. But we want to flag it...
 	if(antenna1 == antenna2 && _flagAutos)
 	{
-		flagMask.reset(new FlagMask(*_fullysetMask));
+		flagMask.reset(new FlagMask(*chunk.fullysetMask));
 	}
 	
-	_flagBuffers.find(std::pair<size_t, size_t>(antenna1, antenna2))->second = std::move(flagMask);
-}
-
-void Cotter::correctConjugated(ImageSet& imageSet, size_t imgImageIndex) const
-{
-	float *imags = imageSet.ImageBuffer(imgImageIndex);
-	for(size_t y=0; y!=imageSet.Height(); ++y)
-	{
-		for(size_t x=0; x!=imageSet.HorizontalStride(); ++x)
-		{
-			*imags = -*imags;
-			++imags;
-		}
-	}
+	chunk.flagBuffers.find(std::pair<size_t, size_t>(antenna1, antenna2))->second = std::move(flagMask);
 }
 
-void Cotter::correctCableLength(ImageSet& imageSet, size_t polarization, double cableDelay) const
+/**
+ * Multiplies every visibility in the image set with the complex coefficient of its
+ * polarization and channel. The coefficients are ordered by polarization and then by
+ * channel. Each row of the real and imaginary images is read and written once.
+ */
+void Cotter::correctBaseline(ImageSet& imageSet, const std::complex<float>* coefficients) const
 {
-	float *reals = imageSet.ImageBuffer(polarization*2);
-	float *imags = imageSet.ImageBuffer(polarization*2+1);
-	
-	for(size_t y=0; y!=imageSet.Height(); ++y)
+	const size_t width = imageSet.Width();
+	for(size_t p=0; p!=4; ++p)
 	{
-		double angle = -2.0 * M_PI * cableDelay * _channelFrequenciesHz[y] / SPEED_OF_LIGHT;
-		double rotSinl, rotCosl;
-		sincos(angle, &rotSinl, &rotCosl);
-		float rotSin = rotSinl, rotCos = rotCosl;
-		
-		/// @todo This should use actual time step count in window
-		float *realPtr = reals + y * imageSet.HorizontalStride();
-		float *imagPtr = imags + y * imageSet.HorizontalStride();
-		for(size_t x=0; x!=imageSet.Width(); ++x)
+		float *reals = imageSet.ImageBuffer(p*2);
+		float *imags = imageSet.ImageBuffer(p*2+1);
+		for(size_t y=0; y!=imageSet.Height(); ++y)
 		{
-			float r = *realPtr;
-			*realPtr = rotCos * r - rotSin * (*imagPtr);
-			*imagPtr = rotSin * r + rotCos * (*imagPtr);
-			++realPtr;
-			++imagPtr;
+			const float
+				coefReal = coefficients[p * imageSet.Height() + y].real(),
+				coefImag = coefficients[p * imageSet.Height() + y].imag();
+			
+			float *realPtr = reals + y * imageSet.HorizontalStride();
+			float *imagPtr = imags + y * imageSet.HorizontalStride();
+			size_t x = 0;
+#if defined(__AVX512F__)
+			const __m512 cr = _mm512_set1_ps(coefReal), ci = _mm512_set1_ps(coefImag);
+			for(; x+16<=width; x+=16)
+			{
+				__m512 r = _mm512_loadu_ps(realPtr + x), i = _mm512_loadu_ps(imagPtr + x);
+				_mm512_storeu_ps(realPtr + x, _mm512_sub_ps(_mm512_mul_ps(cr, r), _mm512_mul_ps(ci, i)));
+				_mm512_storeu_ps(imagPtr + x, _mm512_add_ps(_mm512_mul_ps(ci, r), _mm512_mul_ps(cr, i)));
+			}
+#elif defined(__AVX2__)
+			const __m256 cr = _mm256_set1_ps(coefReal), ci = _mm256_set1_ps(coefImag);
+			for(; x+8<=width; x+=8)
+			{
+				__m256 r = _mm256_loadu_ps(realPtr + x), i = _mm256_loadu_ps(imagPtr + x);
+				_mm256_storeu_ps(realPtr + x, _mm256_sub_ps(_mm256_mul_ps(cr, r), _mm256_mul_ps(ci, i)));
+				_mm256_storeu_ps(imagPtr + x, _mm256_add_ps(_mm256_mul_ps(ci, r), _mm256_mul_ps(cr, i)));
+			}
+#endif
+			for(; x!=width; ++x)
+			{
+				float r = realPtr[x];
+				realPtr[x] = coefReal * r - coefImag * imagPtr[x];
+				imagPtr[x] = coefImag * r + coefReal * imagPtr[x];
+			}
 		}
 	}
 }
@@ -1079,16 +1444,22 @@ void Cotter::writeAntennae()
 
 void Cotter::writeSPW()
 {
-	const size_t nCurChannels = nChannelsInCurSBRange();
+	// The flag writer writes files for the full band, but otherwise each node only
+	// writes its own subbands.
+	const bool isFullBand = (_outputFormat == FlagsOutputFormat);
+	const size_t
+		nCurChannels = isFullBand ? nChannelsInCurSBRange() : nChannelsInCurNodeSBRange(),
+		channelOffset = isFullBand ? 0 : (nodeSbStart() - _curSbStart) * (_mwaConfig.Header().nChannels / _subbandCount);
+	const double* channelFrequenciesHz = &_channelFrequenciesHz[channelOffset];
 	std::vector<MSWriter::ChannelInfo> channels(nCurChannels);
 	std::ostringstream str;
-	double centreFrequencyMHz = 0.0000005 * (_channelFrequenciesHz[nCurChannels/2-1] + _channelFrequenciesHz[nCurChannels/2]);
+	double centreFrequencyMHz = 0.0000005 * (channelFrequenciesHz[nCurChannels/2-1] + channelFrequenciesHz[nCurChannels/2]);
 	str << "MWA_BAND_" << (round(centreFrequencyMHz*10.0)/10.0);
 	const double chWidth = _mwaConfig.Header().bandwidthMHz * 1000000.0 / _mwaConfig.Header().nChannels;
 	for(size_t ch=0;ch!=nCurChannels;++ch)
 	{
 		MSWriter::ChannelInfo &channel = channels[ch];
-		channel.chanFreq = _channelFrequenciesHz[ch];
+		channel.chanFreq = channelFrequenciesHz[ch];
 		channel.chanWidth = chWidth;
 		channel.effectiveBW = chWidth;
 		channel.resolution = chWidth;
@@ -1101,7 +1472,7 @@ void Cotter::writeSPW()
 	);
 }
 
-void Cotter::writeSource()
+void Cotter::writeSource(double raRad, double decRad)
 {
 	const MWAHeader &header = _mwaConfig.Header();
 	MSWriter::SourceInfo source;
@@ -1113,14 +1484,14 @@ void Cotter::writeSource()
 	source.name = header.fieldName;
 	source.calibrationGroup = 0;
 	source.code = "";
-	source.directionRA = header.raHrs * (M_PI/12.0);
-	source.directionDec = header.decDegs * (M_PI/180.0);
+	source.directionRA = raRad;
+	source.directionDec = decRad;
 	source.properMotion[0] = 0.0;
 	source.properMotion[1] = 0.0;
 	_writer->WriteSource(source);
 }
 
-void Cotter::writeField()
+void Cotter::writeField(double raRad, double decRad)
 {
 	const MWAHeader &header = _mwaConfig.Header();
 	MSWriter::FieldInfo field;
@@ -1128,8 +1499,8 @@ void Cotter::writeField()
 	field.code = std::string();
 	field.time = header.GetStartDateMJD() * 86400.0;
 	field.numPoly = 0;
-	field.delayDirRA = header.raHrs * (M_PI/12.0);
-	field.delayDirDec = header.decDegs * (M_PI/180.0);
+	field.delayDirRA = raRad;
+	field.delayDirDec = decRad;
 	field.phaseDirRA = field.delayDirRA;
 	field.phaseDirDec = field.delayDirDec;
 	field.referenceDirRA = field.delayDirRA;
@@ -1258,11 +1629,46 @@ void Cotter::initPerInputSubbandGains()
 	}
 }
 
-void Cotter::flagBadCorrelatorSamples(FlagMask &flagMask) const
+void Cotter::initPerInputCorrectionTables()
+{
+	const size_t
+		nChannels = nChannelsInCurNodeSBRange(),
+		nInputs = _mwaConfig.NAntennae() * 2,
+		channelsPerSubband = _mwaConfig.Header().nChannels / _subbandCount,
+		channelOffset = (nodeSbStart() - _curSbStart) * channelsPerSubband;
+	
+	_inputCorrections.resize(nInputs * nChannels);
+	for(size_t antenna=0; antenna!=_mwaConfig.NAntennae(); ++antenna)
+	{
+		for(size_t pol=0; pol!=2; ++pol)
+		{
+			const MWAInput& input = (pol == 0) ? _mwaConfig.AntennaXInput(antenna) : _mwaConfig.AntennaYInput(antenna);
+			std::complex<float> *row = &_inputCorrections[(antenna*2 + pol) * nChannels];
+			for(size_t y=0; y!=nChannels; ++y)
+			{
+				const double
+					angle = -2.0 * M_PI * input.cableLenDelta * _channelFrequenciesHz[y + channelOffset] / SPEED_OF_LIGHT,
+					gainCorrection = 1.0 / input.pfbGains[nodeSbStart() + y / channelsPerSubband];
+				double rotSin, rotCos;
+				sincos(angle, &rotSin, &rotCos);
+				row[y] = std::complex<float>(rotCos * gainCorrection, rotSin * gainCorrection);
+			}
+		}
+	}
+	
+	for(size_t p=0; p!=4; ++p)
+	{
+		_channelPassbandCorrections[p].resize(nChannels);
+		for(size_t y=0; y!=nChannels; ++y)
+			_channelPassbandCorrections[p][y] = _subbandCorrectionFactors[p][y % channelsPerSubband];
+	}
+}
+
+void Cotter::flagBadCorrelatorSamples(FlagMask &flagMask, const Chunk& chunk) const
 {
 	// Flag MWA side and centre channels
 	const size_t
-		scanCount = _curChunkEnd - _curChunkStart,
+		scanCount = chunk.Width(),
 		curSBCount = _curSbEnd - _curSbStart,
 		chPerSb = flagMask.Height() / curSBCount;
 	for(size_t sb=0; sb!=curSBCount; ++sb)
@@ -1313,12 +1719,12 @@ void Cotter::flagBadCorrelatorSamples(FlagMask &flagMask) const
 	}
 	
 	// Flag first samples
-	if(_quackInitSampleCount >= _curChunkStart)
+	if(_quackInitSampleCount >= chunk.start)
 	{
 		for(size_t ch=0; ch!=flagMask.Height(); ++ch)
 		{
 			bool *channelPtr = flagMask.Buffer() + ch*flagMask.HorizontalStride();
-			const size_t count = std::min(_quackInitSampleCount - _curChunkStart, flagMask.Width());
+			const size_t count = std::min(_quackInitSampleCount - chunk.start, flagMask.Width());
 			for(size_t x=0; x!=count; ++x)
 			{
 				*channelPtr = true;
@@ -1330,8 +1736,8 @@ void Cotter::flagBadCorrelatorSamples(FlagMask &flagMask) const
 	// If samples are missing at the end, flag them.
 	for(size_t ch=0; ch!=flagMask.Height(); ++ch)
 	{
-		bool *channelPtr = flagMask.Buffer() + ch*flagMask.HorizontalStride() + scanCount - _missingEndScans;
-		for(size_t t=scanCount - _missingEndScans; t!=scanCount; ++t)
+		bool *channelPtr = flagMask.Buffer() + ch*flagMask.HorizontalStride() + scanCount - chunk.missingEndScans;
+		for(size_t t=scanCount - chunk.missingEndScans; t!=scanCount; ++t)
 		{
 			*channelPtr = true;
 			++channelPtr;
@@ -1395,11 +1801,11 @@ void Cotter::initializeSbOrder()
 	}
 }
 
-void Cotter::writeAlignmentScans()
+void Cotter::writeAlignmentScans(Writer& writer)
 {
-	if(!_writer->IsTimeAligned(0, 0))
+	if(!writer.IsTimeAligned(0, 0))
 	{
-		const size_t nChannels = nChannelsInCurSBRange();
+		const size_t nChannels = nChannelsInCurNodeSBRange();
 		const size_t antennaCount = _mwaConfig.NAntennae();
 		std::cout << "Nr of timesteps did not match averaging size, last averaged sample will be downweighted" << std::flush;
 		size_t timeIndex = _mwaConfig.Header().nScans;
@@ -1413,9 +1819,9 @@ void Cotter::writeAlignmentScans()
 			_outputFlags[ch] = true;
 			_outputWeights[ch] = 0.0;
 		}
-		while(!_writer->IsTimeAligned(0, 0))
+		while(!writer.IsTimeAligned(0, 0))
 		{
-			_writer->AddRows(rowsPerTimescan());
+			writer.AddRows(rowsPerTimescan());
 			const double dateMJD = _mwaConfig.Header().dateFirstScanMJD + timeIndex * _mwaConfig.Header().integrationTime/86400.0;
 			for(size_t antenna1=0;antenna1!=antennaCount;++antenna1)
 			{
@@ -1423,7 +1829,7 @@ void Cotter::writeAlignmentScans()
 				{
 					if(outputBaseline(antenna1, antenna2))
 					{
-						_writer->WriteRow(dateMJD*86400.0, dateMJD*86400.0, antenna1, antenna2, 0.0, 0.0, 0.0, _mwaConfig.Header().integrationTime, _outputData.get(), _outputFlags.get(), _outputWeights.get());
+						writer.WriteRow(dateMJD*86400.0, dateMJD*86400.0, antenna1, antenna2, 0.0, 0.0, 0.0, _mwaConfig.Header().integrationTime, _outputData.get(), _outputFlags.get(), _outputWeights.get());
 					}
 				}
 			}
@@ -1437,6 +1843,166 @@ void Cotter::writeAlignmentScans()
 	}
 }
 
+/**
+ * Averaging a fringe with rate r over an interval dt reduces its amplitude by
+ * 1 - sinc(pi r dt), which is approximately (pi r dt)^2 / 6. The fringe rate
+ * of a baseline of length L at the edge of a field with radius theta is at most
+ * omega_earth * L / lambda * sin(theta), which is used at the highest frequency.
+ * Each baseline is averaged over the normal time averaging times the largest power of
+ * two that keeps the smearing within the limit, such that the averages of all
+ * baselines end on the same timestep as those of the auto-correlations.
+ */
+std::vector<size_t> Cotter::baselineTimeAvgFactors(size_t timeAvgFactor) const
+{
+	const double
+		earthRotationRate = 7.2921150e-5, // rad/s
+		maxFrequency = *std::max_element(_channelFrequenciesHz.begin(), _channelFrequenciesHz.end()),
+		baseInterval = timeAvgFactor * _mwaConfig.Header().integrationTime,
+		maxFringeCycles = sqrt(6.0 * _bdaMaxSmearing) / M_PI;
+	const size_t antennaCount = _mwaConfig.NAntennae();
+	std::vector<size_t> factors(antennaCount*antennaCount, timeAvgFactor);
+	std::map<size_t, size_t> baselineCountPerMultiple;
+	double outputRowFraction = 0.0;
+	for(size_t antenna1=0; antenna1!=antennaCount; ++antenna1)
+	{
+		const double* position1 = _mwaConfig.Antenna(antenna1).position;
+		for(size_t antenna2=antenna1; antenna2!=antennaCount; ++antenna2)
+		{
+			const double* position2 = _mwaConfig.Antenna(antenna2).position;
+			const double
+				dx = position1[0] - position2[0],
+				dy = position1[1] - position2[1],
+				dz = position1[2] - position2[2],
+				length = sqrt(dx*dx + dy*dy + dz*dz),
+				fringeRate = earthRotationRate * length * maxFrequency / SPEED_OF_LIGHT * sin(_bdaFieldRadiusDeg * (M_PI/180.0));
+			size_t multiple = 1;
+			while(multiple*2 <= _bdaMaxTimeAvgMultiple && fringeRate * baseInterval * (multiple*2) <= maxFringeCycles)
+				multiple *= 2;
+			factors[antenna1*antennaCount + antenna2] = timeAvgFactor * multiple;
+			++baselineCountPerMultiple[multiple];
+			outputRowFraction += 1.0 / multiple;
+		}
+	}
+	std::cout << "Baseline-dependent averaging over a field radius of " << _bdaFieldRadiusDeg << " deg:";
+	for(const std::pair<const size_t, size_t>& count : baselineCountPerMultiple)
+		std::cout << ' ' << count.second << " baselines " << (timeAvgFactor*count.first) << "x,";
+	std::cout << " output has " << round(outputRowFraction * 1000.0 / (antennaCount*(antennaCount+1)/2))/10.0 << "% of the rows.\n";
+	return factors;
+}
+
+std::unique_ptr<Writer> Cotter::makeFileWriter(const std::string& filename, enum OutputFormat format) const
+{
+	if(format == FitsOutputFormat)
+		return std::unique_ptr<Writer>(new FitsWriter(filename));
+	
+	std::unique_ptr<MSWriter> msWriter(new MSWriter(filename));
+	if(_useDysco)
+		msWriter->EnableCompression(_dyscoDataBitRate, _dyscoWeightBitRate, _dyscoDistribution, _dyscoDistTruncation, _dyscoNormalization);
+	if(_tileSizeKB != 0 || _tileRows != 0)
+		msWriter->EnableTiling(_tileChannels, _tileRows, _tileSizeKB == 0 ? size_t(MSWriter::DefaultTileSizeKB) : _tileSizeKB);
+	return std::move(msWriter);
+}
+
+/**
+ * Returns the subband ranges [first, second) of the output files that hold
+ * the subbands [sbStart, sbEnd). The subbands are divided over shards in the
+ * same way as they are divided over nodes.
+ */
+std::vector<std::pair<size_t, size_t>> Cotter::outputPartSubbands(size_t sbStart, size_t sbEnd) const
+{
+	const size_t partCount = std::max<size_t>(1, std::min(_shardCount, sbEnd - sbStart));
+	std::vector<std::pair<size_t, size_t>> parts(partCount);
+	for(size_t part=0; part!=partCount; ++part)
+	{
+		parts[part].first = subbandPartStart(sbStart, sbEnd, part, partCount);
+		parts[part].second = subbandPartStart(sbStart, sbEnd, part + 1, partCount);
+	}
+	return parts;
+}
+
+/**
+ * When the output is divided over several files, each file is named after the
+ * output file, followed by its range of coarse channel numbers.
+ */
+std::string Cotter::outputPartFilename(const std::string& outputFilename, size_t sbStart, size_t sbEnd) const
+{
+	if(_nNodes == 1 && _shardCount <= 1)
+		return outputFilename;
+	size_t dotPos = outputFilename.rfind('.');
+	if(dotPos == std::string::npos)
+		dotPos = outputFilename.size();
+	char numbers[16];
+	snprintf(numbers, sizeof numbers, "_%03d-%03d",
+		_mwaConfig.HeaderExt().subbandNumbers[sbStart], _mwaConfig.HeaderExt().subbandNumbers[sbEnd-1]);
+	return outputFilename.substr(0, dotPos) + numbers + outputFilename.substr(dotPos);
+}
+
+std::vector<std::string> Cotter::outputPartFilenamesOfAllNodes(const std::string& outputFilename) const
+{
+	std::vector<std::string> filenames;
+	for(int node=0; node!=_nNodes; ++node)
+	{
+		const size_t
+			sbStart = subbandPartStart(_curSbStart, _curSbEnd, node, _nNodes),
+			sbEnd = subbandPartStart(_curSbStart, _curSbEnd, node + 1, _nNodes);
+		for(const std::pair<size_t, size_t>& part : outputPartSubbands(sbStart, sbEnd))
+			filenames.emplace_back(outputPartFilename(outputFilename, part.first, part.second));
+	}
+	return filenames;
+}
+
+/**
+ * Creates the writer for the subbands of this node. These are written to one file, or
+ * with several shards, to several files that are written in parallel.
+ */
+std::unique_ptr<Writer> Cotter::createOutputWriter(const std::string& outputFilename, enum OutputFormat format, std::vector<std::string>& partFilenames)
+{
+	const size_t sbStart = nodeSbStart(), sbEnd = nodeSbEnd();
+	const std::vector<std::pair<size_t, size_t>> parts = outputPartSubbands(sbStart, sbEnd);
+	
+	if(_writeMultiMS && format == MSOutputFormat)
+	{
+		// The parts of a multi-MS should have the same shape; check this before processing
+		for(int node=0; node!=_nNodes; ++node)
+		{
+			const size_t
+				nodeStart = subbandPartStart(_curSbStart, _curSbEnd, node, _nNodes),
+				nodeEnd = subbandPartStart(_curSbStart, _curSbEnd, node + 1, _nNodes);
+			for(const std::pair<size_t, size_t>& part : outputPartSubbands(nodeStart, nodeEnd))
+			{
+				if(part.second - part.first != parts.front().second - parts.front().first)
+					throw std::runtime_error("A multi-MS can only be written when all parts have the same number of subbands");
+			}
+		}
+	}
+	
+	partFilenames.clear();
+	std::vector<size_t> subbandBoundaries;
+	std::vector<std::unique_ptr<Writer>> shards;
+	for(const std::pair<size_t, size_t>& part : parts)
+	{
+		partFilenames.emplace_back(outputPartFilename(outputFilename, part.first, part.second));
+		if(_nNodes > 1 || parts.size() > 1)
+			std::cout << "Subbands " << part.first << "-" << (part.second-1) << " will be written to " << partFilenames.back() << ".\n";
+		subbandBoundaries.push_back(part.first - sbStart);
+		shards.emplace_back(makeFileWriter(partFilenames.back(), format));
+	}
+	subbandBoundaries.push_back(sbEnd - sbStart);
+	
+	if(shards.size() == 1)
+	{
+		std::unique_ptr<ThreadedWriter> threadedWriter(new ThreadedWriter(std::move(shards.front()), _writeQueueSize));
+		_writerQueues.push_back(threadedWriter.get());
+		return std::move(threadedWriter);
+	}
+	else {
+		std::unique_ptr<ShardedWriter> shardedWriter(new ShardedWriter(std::move(shards), subbandBoundaries, _writeQueueSize));
+		for(size_t i=0; i!=shardedWriter->ShardCount(); ++i)
+			_writerQueues.push_back(&shardedWriter->Shard(i));
+		return std::move(shardedWriter);
+	}
+}
+
 void Cotter::writeMWAFieldsToMS(const std::string& outputFilename, size_t flagWindowSize)
 {
 	MWAMS mwaMs(outputFilename);
@@ -1506,11 +2072,9 @@ void Cotter::onHDUOffsetsChange(const std::vector<int>& newHDUOffsets)
 	}
 	
 	if(isChanged) {
-		if(_doAlign)
-			_writer->SetOffsetsPerGPUBox(_hduOffsetsPerGPUBox);
-		else {
-			std::vector<int> zeros(newHDUOffsets.size(), 0);
-			_writer->SetOffsetsPerGPUBox(zeros);
-		}
+		const std::vector<int> offsets = _doAlign ? _hduOffsetsPerGPUBox : std::vector<int>(newHDUOffsets.size(), 0);
+		_writer->SetOffsetsPerGPUBox(offsets);
+		for(const std::unique_ptr<PhaseCentreOutput>& centre : _phaseCentres)
+			centre->writer->SetOffsetsPerGPUBox(offsets);
 	}
 }
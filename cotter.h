@@ -4,15 +4,21 @@
 #include "aligned_ptr.h"
 #include "averagingwriter.h"
 #include "gpufilereader.h"
+#include "lane.h"
 #include "mwaconfig.h"
 #include "stopwatch.h"
 #include "progressbar.h"
+#include "threadpool.h"
+#include "uvwcache.h"
 
 #include <aoflagger.h>
 
+#include <atomic>
+#include <cmath>
+#include <complex>
+#include <exception>
 #include <memory>
 #include <vector>
-#include <queue>
 #include <set>
 #include <string>
 
@@ -26,6 +32,7 @@ namespace aoflagger {
 
 class GPUFileReader;
 class MSWriter;
+class ThreadedWriter;
 
 class Cotter : private UVWCalculater
 {
@@ -39,8 +46,25 @@ class Cotter : private UVWCalculater
 		
 		void SetOutputFilename(const std::string& outputFilename) { _outputFilename = outputFilename; _defaultFilename = false; }
 		void SetOutputFormat(enum OutputFormat format) { _outputFormat = format; }
+		/**
+		 * Also write the data to another MS or UVFits file, with its own averaging. All
+		 * outputs are written from the same flagged and corrected data.
+		 */
+		void AddExtraOutput(const std::string& filename, enum OutputFormat format, double timeRes_s, double freqRes_kHz)
+		{
+			ExtraOutput output;
+			output.filename = filename;
+			output.format = format;
+			output.timeRes_s = timeRes_s;
+			output.freqRes_kHz = freqRes_kHz;
+			output.timeAvgFactor = 1;
+			output.freqAvgFactor = 1;
+			_extraOutputs.push_back(output);
+		}
 		void SetFileSets(const std::vector<std::vector<std::string> >& fileSets) { _fileSets = fileSets; }
 		void SetThreadCount(size_t threadCount) { _threadCount = threadCount; }
+		void SetThreadAffinity(bool setThreadAffinity) { _setThreadAffinity = setThreadAffinity; }
+		void SetWriteQueueSize(size_t writeQueueSize) { _writeQueueSize = writeQueueSize; }
 		void SetRFIDetection(bool performRFIDetection) { _rfiDetection = performRFIDetection; }
 		void SetCollectStatistics(bool collectStatistics) { _collectStatistics = collectStatistics; }
 		void SetCollectHistograms(bool collectHistograms) { _collectHistograms = collectHistograms; }
@@ -50,6 +74,8 @@ class Cotter : private UVWCalculater
 		void SetHeaderFilename(const char *filename) { _headerFilename = filename; }
 		void SetInstrConfigFilename(const char *filename) { _instrConfigFilename = filename; }
 		void SetMaxBufferSize(const size_t bufferSizeInSamples) { _maxBufferSize = bufferSizeInSamples; }
+		void SetStreamingBlockSize(size_t blockSizeInScans) { _streamingBlockSize = blockSizeInScans; }
+		void SetOverlapChunks(bool overlapChunks) { _overlapChunks = overlapChunks; }
 		void SetDisableGeometricCorrections(bool disableCorrections) { _disableGeometricCorrections = disableCorrections; }
 		void SetOverridePhaseCentre(long double newRARad, long double newDecRad)
 		{
@@ -61,6 +87,15 @@ class Cotter : private UVWCalculater
 		{
 			_usePointingCentre = usePointingCentre;
 		}
+		/**
+		 * Also write the data phased towards the given direction to the given file.
+		 * Reading, flagging and corrections are shared with the main output; only the
+		 * uvws and the phase rotation are calculated per phase centre.
+		 */
+		void AddPhaseCentre(long double raRad, long double decRad, const std::string& filename)
+		{
+			_phaseCentres.emplace_back(new PhaseCentreOutput(_mwaConfig, raRad, decRad, filename));
+		}
 		void SetDoAlign(bool doAlign) { _doAlign = doAlign; }
 		void SetDoFlagMissingSubbands(bool doFlagMissingSubbands) { _doFlagMissingSubbands = doFlagMissingSubbands; }
 		void SetSubbandCount(size_t subbandCount) { _subbandCount = subbandCount; }
@@ -82,7 +117,16 @@ class Cotter : private UVWCalculater
 		void FlagSubband(size_t sbIndex) { _flaggedSubbands.insert(sbIndex); }
 		void SetSubbandEdgeFlagWidth(double edgeFlagWidth) { _subbandEdgeFlagWidthKHz = edgeFlagWidth; }
 		void SetOfflineGPUBoxFormat(bool offlineFormat) { _offlineGPUBoxFormat = offlineFormat; }
+		void SetAsyncReadAhead(size_t hduCount) { _asyncReadAhead = hduCount; }
+		void SetUseMMap(bool useMMap) { _useMMap = useMMap; }
 		void SetUseDysco(bool useDysco) { _useDysco = useDysco; }
+		void SetTileShape(size_t tileChannels, size_t tileRows) { _tileChannels = tileChannels; _tileRows = tileRows; }
+		void SetTileSize(size_t tileSizeKB) { _tileSizeKB = tileSizeKB; }
+		void SetShardCount(size_t shardCount) { _shardCount = shardCount; }
+		void SetWriteMultiMS(bool writeMultiMS) { _writeMultiMS = writeMultiMS; }
+		void SetBDAFieldRadius(double fieldRadiusDeg) { _bdaFieldRadiusDeg = fieldRadiusDeg; }
+		void SetBDAMaxSmearing(double maxSmearing) { _bdaMaxSmearing = maxSmearing; }
+		void SetBDAMaxTimeAvg(size_t maxTimeAvgMultiple) { _bdaMaxTimeAvgMultiple = maxTimeAvgMultiple; }
 		void SetAdvancedDyscoOptions(size_t dataBitRate, size_t weightBitRate, const std::string& distribution, double distTruncation, const std::string& normalization)
 		{
 			_dyscoDataBitRate = dataBitRate;
@@ -101,13 +145,17 @@ class Cotter : private UVWCalculater
 		//! Abstract disk file writer
 		std::unique_ptr<Writer> _writer;
 		//! Disk file reader
-		std::unique_ptr<GPUFileReader> _reader;
+		std::shared_ptr<GPUFileReader> _reader;
 		//! Inputs telescope and outputs flagging strategy, as well as managing stats and some classes
 		aoflagger::AOFlagger _flagger;
 		//! Algorithm to perform on data
 		std::unique_ptr<aoflagger::Strategy> _strategy;
 		//! Gain adjust for each coarse channel
 		std::vector<double> _subbandCorrectionFactors[4];
+		//! Cable delay phasor divided by the subband gain, per input (antenna*2 + pol) and channel of the current band
+		std::vector<std::complex<float>> _inputCorrections;
+		//! The subband passband correction of each polarization, expanded over the channels of the current band
+		std::vector<float> _channelPassbandCorrections[4];
 		//! Override to flag all correlations using antenna
 		std::unique_ptr<bool[]> _isAntennaFlaggedMap;
 		//! Antennas not flagged by one of the overrides
@@ -134,10 +182,10 @@ class Cotter : private UVWCalculater
 		double _subbandEdgeFlagWidthKHz;
 		//! Number of samples to flag at edges of coarse channels
 		size_t _subbandEdgeFlagCount;
-		//! Missing last time steps for some channels; number of end time steps to be flagged
-		size_t _missingEndScans;
-		//! Time steps are broken into chunks to reduce memory requirements where neccessary
-		size_t _curChunkStart, _curChunkEnd;
+		//! Maximum number of time steps per chunk when streaming without RFI detection
+		size_t _streamingBlockSize;
+		//! Split memory over two chunks when partitioning, to read the next chunk while processing the current one
+		bool _overlapChunks;
 		//! Coarse channels/subbands areFlag edges of coarse channels broken up into contiguous sections
 		size_t _curSbStart, _curSbEnd;
 		//! MPI index and size
@@ -177,27 +225,69 @@ class Cotter : private UVWCalculater
 		std::vector<size_t> _userFlaggedAntennae;
 		std::set<size_t> _flaggedSubbands;
 		
-		//! The data to be processed, ordered by correlation output/baseline
-		std::map<std::pair<size_t, size_t>, aoflagger::ImageSet> _imageSetBuffers;
-		// This unique_ptr is necessary because FlagMask was not properly nullable in aoflagger 2.11
-		// (due to a bug). Once aoflagger 2.12 is rolled out, it would be neater to remove the unique_ptr wrapper.
-		std::map<std::pair<size_t, size_t>, std::unique_ptr<aoflagger::FlagMask>> _flagBuffers;
+		/**
+		 * Time steps are broken into chunks to reduce memory requirements where neccessary.
+		 * A chunk holds the data and flags of one such range of time steps, and is passed
+		 * from the reading stage to the processing stage and on to the writing stage.
+		 */
+		struct Chunk
+		{
+			//! Time step range of this chunk
+			size_t start, end;
+			//! Missing last time steps for some channels; number of end time steps to be flagged
+			size_t missingEndScans;
+			//! The reader that filled this chunk; needed to know which correlations are conjugated
+			std::shared_ptr<GPUFileReader> reader;
+			//! The data to be processed, ordered by correlation output/baseline
+			std::map<std::pair<size_t, size_t>, aoflagger::ImageSet> imageSetBuffers;
+			// This unique_ptr is necessary because FlagMask was not properly nullable in aoflagger 2.11
+			// (due to a bug). Once aoflagger 2.12 is rolled out, it would be neater to remove the unique_ptr wrapper.
+			std::map<std::pair<size_t, size_t>, std::unique_ptr<aoflagger::FlagMask>> flagBuffers;
+			std::unique_ptr<aoflagger::FlagMask> correlatorMask, fullysetMask;
+			
+			size_t Width() const { return end - start; }
+		};
+		std::vector<std::unique_ptr<Chunk>> _chunks;
+		//! Chunks cycle through these lanes: free -> read -> processed -> free
+		ao::lane<Chunk*> _freeChunks, _readChunks, _processedChunks;
+		std::exception_ptr _readerException, _writerException;
+		//! Whether each stage shows its own progress bar, which is only done when stages don't overlap
+		bool _showStageProgress;
+		std::unique_ptr<ProgressBar> _pipelineProgressBar;
 		std::vector<double> _channelFrequenciesHz;
 		std::vector<double> _scanTimes;
-		std::queue<std::pair<size_t,size_t> > _baselinesToProcess;
+		//! Baselines of the current chunk, ordered from most to least expensive
+		std::vector<std::pair<size_t,size_t> > _baselinesToProcess;
+		//! Index into _baselinesToProcess of the next baseline that is to be processed by a thread
+		std::atomic<size_t> _nextBaselineIndex;
+		std::atomic<size_t> _processedBaselineCount;
 		std::unique_ptr<ProgressBar> _progressBar;
-		size_t _baselinesToProcessCount;
+		std::mutex _progressMutex;
 		std::vector<size_t> _subbandOrder;
 		std::vector<int> _hduOffsetsPerGPUBox;
 		std::unique_ptr<class FlagReader> _flagReader;
 		
 		std::mutex _mutex;
+		//! Worker threads shared by the reading and processing stages
+		std::unique_ptr<ThreadPool> _threadPool;
 		std::unique_ptr<aoflagger::QualityStatistics> _statistics;
-		std::unique_ptr<aoflagger::FlagMask> _correlatorMask, _fullysetMask;
+		//! Statistics of the processing tasks that are not running, to be reused by the next task
+		std::vector<std::unique_ptr<aoflagger::QualityStatistics>> _idleTaskStatistics;
 		
 		bool _disableGeometricCorrections, _removeFlaggedAntennae, _removeAutoCorrelations, _flagAutos;
 		bool _overridePhaseCentre, _doAlign, _doFlagMissingSubbands, _applySBGains, _flagDCChannels, _skipWriting;
 		bool _offlineGPUBoxFormat;
+		//! Nr of HDUs each per-file I/O thread may read ahead; zero reads all files on a single thread
+		size_t _asyncReadAhead;
+		//! Bind each worker thread of the pool to a CPU
+		bool _setThreadAffinity;
+		//! Read gpubox files through memory maps when possible, instead of through cfitsio
+		bool _useMMap;
+		//! Max nr of bytes that each threaded writer may queue
+		size_t _writeQueueSize;
+		//! Queues of the writers of the current band, of which the wait counts are reported
+		std::vector<const ThreadedWriter*> _writerQueues;
+		size_t _writeQueueFullCount, _writeQueueEmptyCount;
 		long double _customRARad, _customDecRad;
 		double _initDurationToFlag, _endDurationToFlag;
 		
@@ -207,36 +297,131 @@ class Cotter : private UVWCalculater
 		std::string _dyscoDistribution;
 		std::string _dyscoNormalization;
 		double _dyscoDistTruncation;
+		//! Tiled storage is used when either a tile shape or a tile size is given
+		size_t _tileChannels, _tileRows, _tileSizeKB;
+		//! Nr of output files over which the subbands of a node are divided
+		size_t _shardCount;
+		//! Whether to join the measurement sets of all shards and nodes into a multi-MS
+		bool _writeMultiMS;
+		//! The files that this node writes the current band to
+		std::vector<std::string> _outputPartFilenames;
+		
+		struct ExtraOutput
+		{
+			std::string filename;
+			enum OutputFormat format;
+			double timeRes_s, freqRes_kHz;
+			size_t timeAvgFactor, freqAvgFactor;
+		};
+		std::vector<ExtraOutput> _extraOutputs;
+		//! Per extra output, the files that this node writes the current band to
+		std::vector<std::vector<std::string>> _extraOutputPartFilenames;
+		/**
+		 * The writer chain of each output, which are all fed by _writer. Each chain
+		 * is padded separately when the number of timesteps does not match its averaging.
+		 */
+		std::vector<Writer*> _outputChains;
+		
+		/**
+		 * An output with its own phase centre, which gets the same rows as the main output
+		 * but with its own uvws and w-term rotation.
+		 */
+		class PhaseCentreOutput : public UVWCalculater
+		{
+			public:
+				PhaseCentreOutput(const MWAConfig& mwaConfig, long double raRad_, long double decRad_, const std::string& filename_) :
+					raRad(raRad_), decRad(decRad_), filename(filename_), uvwCache(mwaConfig, 64)
+				{ }
+				
+				virtual void CalculateUVW(double date, size_t antenna1, size_t antenna2, double &u, double &v, double &w) final override
+				{
+					uvwCache.BaselineUVW(date, antenna1, antenna2, u, v, w);
+				}
+				
+				long double raRad, decRad;
+				std::string filename;
+				UVWCache uvwCache;
+				std::unique_ptr<Writer> writer;
+				//! The files that this node writes the current band to
+				std::vector<std::string> partFilenames;
+		};
+		std::vector<std::unique_ptr<PhaseCentreOutput>> _phaseCentres;
+		/**
+		 * Baseline-dependent averaging, which is enabled by a nonzero field radius: the
+		 * max fraction of amplitude lost by time smearing at the edge of the field, and the
+		 * max time averaging of short baselines as multiple of the normal time averaging
+		 */
+		double _bdaFieldRadiusDeg, _bdaMaxSmearing;
+		size_t _bdaMaxTimeAvgMultiple;
 		
 		std::unique_ptr<bool[]> _outputFlags;
 		aligned_ptr<std::complex<float>> _outputData;
 		aligned_ptr<float> _outputWeights;
 		
+		//! Number of baselines that one processing task takes at a time
+		enum { ProcessBaselineGroupSize = 8 };
+		//! Max number of timesteps that are prepared for writing together
+		enum { WriteBlockSize = 4 };
+		//! Number of baselines per task when preparing the rows of a timestep block
+		enum { WriteRowGroupSize = 16 };
+		//! Antennas of the baselines in the order in which they are written
+		std::vector<size_t> _outputAntenna1, _outputAntenna2;
+		//! Rows of the current timestep block, indexed by [((t * nRows) + row) * nChannels * 4 + ch * 4 + p]
+		aligned_ptr<std::complex<float>> _blockData;
+		std::unique_ptr<bool[]> _blockFlags;
+		//! Antenna uvws per timestep towards the main phase centre, shared by the row preparation and the averaging writer
+		UVWCache _uvwCache;
+		//! Antenna uvws of the timesteps in the current block
+		std::vector<std::shared_ptr<const UVWCache::AntennaUVW>> _blockUVWs;
+		
 		void processAllContiguousBands(size_t timeAvgFactor, size_t freqAvgFactor);
-		void processOneContiguousBand(const std::string& outputFilename, size_t timeAvgFactor, size_t freqAvgFactor);
+		void processOneContiguousBand(const std::string& outputFilename, const std::vector<std::string>& extraOutputFilenames, const std::vector<std::string>& phaseCentreFilenames, size_t timeAvgFactor, size_t freqAvgFactor);
+		std::unique_ptr<Writer> addAveraging(std::unique_ptr<Writer> writer, size_t timeAvgFactor, size_t freqAvgFactor, UVWCalculater& uvwCalculater);
+		void finishOutputFiles(const std::string& outputFilename, enum OutputFormat format, const std::vector<std::string>& partFilenames, size_t flagWindowSize);
+		
+		static size_t averagingFactor(double resolution, double inputResolution)
+		{
+			const size_t factor = round(resolution / inputResolution);
+			return factor == 0 ? 1 : factor;
+		}
+		
+		static std::string insertBandNumbers(const std::string& filename, int chStartNo, int chEndNo);
+		std::vector<size_t> baselineTimeAvgFactors(size_t timeAvgFactor) const;
 		void createReader(const std::vector<std::string> &curFileset);
-		void initializeReader();
-		void processAndWriteTimestep(size_t timeIndex);
-		void processAndWriteTimestepFlagsOnly(size_t timeIndex);
-		void baselineProcessThreadFunc();
-		void processBaseline(size_t antenna1, size_t antenna2, aoflagger::QualityStatistics &statistics);
-		void correctConjugated(aoflagger::ImageSet& imageSet, size_t imageIndex) const;
-		void correctCableLength(aoflagger::ImageSet& imageSet, size_t polarization, double cableDelay) const;
+		void runChunkPipeline(size_t partCount, size_t chunkBufferCount);
+		void readerStageFunc(size_t partCount);
+		void writerStageFunc();
+		void readChunk(Chunk& chunk, std::vector<std::vector<std::string> >::const_iterator& currentFileSetPtr, size_t requiredWidthCapacity);
+		void processChunk(Chunk& chunk);
+		void writeChunk(Chunk& chunk);
+		void initializeReader(Chunk& chunk);
+		void processAndWriteTimesteps(const Chunk& chunk, size_t blockStart, size_t blockEnd, UVWCache& uvwCache, Writer& writer);
+		void fillOutputRow(const Chunk& chunk, size_t row, size_t blockStart, size_t timestepCount) const;
+		void processAndWriteTimestepFlagsOnly(const Chunk& chunk, size_t timeIndex);
+		void processBaselineGroup(Chunk& chunk);
+		void processBaseline(Chunk& chunk, size_t antenna1, size_t antenna2, aoflagger::QualityStatistics &statistics);
+		void correctBaseline(aoflagger::ImageSet& imageSet, const std::complex<float>* coefficients) const;
 		void writeAntennae();
 		void writeSPW();
-		void writeSource();
-		void writeField();
+		void writeSource(double raRad, double decRad);
+		void writeField(double raRad, double decRad);
 		void writeObservation();
 		void initPerInputSubbandGains();
+		void initPerInputCorrectionTables();
 		void readSubbandPassbandFile();
 		void initializeSubbandPassband();
-		void flagBadCorrelatorSamples(aoflagger::FlagMask &flagMask) const;
+		void flagBadCorrelatorSamples(aoflagger::FlagMask &flagMask, const Chunk& chunk) const;
 		void initializeWeights(aligned_ptr<float>& outputWeights);
 		void initializeSbOrder();
-		void writeAlignmentScans();
+		void writeAlignmentScans(Writer& writer);
 		void writeMWAFieldsToMS(const std::string& outputFilename, size_t flagWindowSize);
 		void writeMWAFieldsToUVFits(const std::string& outputFilename);
 		void onHDUOffsetsChange(const std::vector<int>& newHDUOffsets);
+		std::unique_ptr<Writer> makeFileWriter(const std::string& filename, enum OutputFormat format) const;
+		std::vector<std::pair<size_t, size_t>> outputPartSubbands(size_t sbStart, size_t sbEnd) const;
+		std::string outputPartFilename(const std::string& outputFilename, size_t sbStart, size_t sbEnd) const;
+		std::vector<std::string> outputPartFilenamesOfAllNodes(const std::string& outputFilename) const;
+		std::unique_ptr<Writer> createOutputWriter(const std::string& outputFilename, enum OutputFormat format, std::vector<std::string>& partFilenames);
 		size_t rowsPerTimescan() const
 		{
 			if(_removeFlaggedAntennae && _removeAutoCorrelations)
@@ -248,6 +433,18 @@ class Cotter : private UVWCalculater
 			else
 				return _mwaConfig.NAntennae()*(_mwaConfig.NAntennae()+1)/2;
 		}
+		bool isBaselineFlagged(size_t antenna1, size_t antenna2) const
+		{
+			return
+				_mwaConfig.AntennaXInput(antenna1).isFlagged || _mwaConfig.AntennaYInput(antenna1).isFlagged ||
+				_mwaConfig.AntennaXInput(antenna2).isFlagged || _mwaConfig.AntennaYInput(antenna2).isFlagged ||
+				_isAntennaFlaggedMap[antenna1] || _isAntennaFlaggedMap[antenna2];
+		}
+		//! Whether the AOFlagger strategy is run on this baseline, which is by far the most expensive step
+		bool isRFIDetectionPerformed(size_t antenna1, size_t antenna2) const
+		{
+			return _rfiDetection && _flagFileTemplate.empty() && antenna1 != antenna2 && !isBaselineFlagged(antenna1, antenna2);
+		}
 		bool outputBaseline(size_t antenna1, size_t antenna2) const
 		{
 			bool output = true;
@@ -268,13 +465,21 @@ class Cotter : private UVWCalculater
 			return false;
 		}
 		
+		/**
+		 * Returns the first subband of the index'th of count parts, when
+		 * dividing the subbands [start, end) as evenly as possible.
+		 */
+		static size_t subbandPartStart(size_t start, size_t end, size_t index, size_t count)
+		{
+			return (end - start) * index / count + start;
+		}
 		size_t nodeSbStart() const
 		{
-			return (_curSbEnd - _curSbStart) * _nodeRank / _nNodes + _curSbStart;
+			return subbandPartStart(_curSbStart, _curSbEnd, _nodeRank, _nNodes);
 		}
 		size_t nodeSbEnd() const
 		{
-			return (_curSbEnd - _curSbStart) * (_nodeRank + 1) / _nNodes + _curSbStart;
+			return subbandPartStart(_curSbStart, _curSbEnd, _nodeRank + 1, _nNodes);
 		}
 		
 		/**
@@ -288,6 +493,11 @@ class Cotter : private UVWCalculater
 		}
 		
 		
+		const std::complex<float>* inputCorrectionRow(size_t antenna, size_t pol) const
+		{
+			return &_inputCorrections[(antenna*2 + pol) * nChannelsInCurNodeSBRange()];
+		}
+		
 		size_t nChannelsInCurSBRange() const
 		{
 			const size_t nFineChannels = _mwaConfig.Header().nChannels / _subbandCount;
@@ -1,12 +1,84 @@
 #include "fitswriter.h"
 
+#include <algorithm>
 #include <cstdio>
+#include <cstring>
+#include <iostream>
+
+#include <stdint.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
 
 #include <star/pal.h>
 
 #define VLIGHT 299792458.0  // speed of light in m/s
 
-FitsWriter::FitsWriter(const std::string& filename) : _nRowsWritten(0), _groupHeadersInitialized(false)
+namespace {
+	/**
+	 * Write the visibilities of a row in UVFITS order: (real, imag, weight) for XX,
+	 * YY, XY and YX per channel. The weights of flagged visibilities are made negative.
+	 */
+	void interleaveVisibilities(float* dest, const std::complex<float>* data, const bool* flags, const float* weights, size_t channelCount)
+	{
+		size_t ch = 0;
+#if defined(__SSE2__)
+		const __m128i zero = _mm_setzero_si128();
+		for(; ch!=channelCount; ++ch)
+		{
+			const float* values = reinterpret_cast<const float*>(data + ch*4);
+			// [XXr XXi XYr XYi] and [YXr YXi YYr YYi]
+			const __m128 first = _mm_loadu_ps(values), second = _mm_loadu_ps(values + 4);
+			// Turn the four flags into sign bits, and flip the signs of the flagged weights
+			uint32_t flagBytes;
+			std::memcpy(&flagBytes, flags + ch*4, 4);
+			__m128i flagLanes = _mm_unpacklo_epi8(_mm_cvtsi32_si128(flagBytes), zero);
+			flagLanes = _mm_unpacklo_epi16(flagLanes, zero);
+			const __m128 weight = _mm_xor_ps(_mm_loadu_ps(weights + ch*4), _mm_castsi128_ps(_mm_slli_epi32(flagLanes, 31)));
+			
+			const __m128
+				// [wXX wXX YYr YYr]
+				a = _mm_shuffle_ps(weight, second, _MM_SHUFFLE(2,2,0,0)),
+				// [YYi YYi wYY wYY]
+				b = _mm_shuffle_ps(second, weight, _MM_SHUFFLE(3,3,3,3)),
+				// [wXY wXY YXr YXr]
+				c = _mm_shuffle_ps(weight, second, _MM_SHUFFLE(0,0,1,1)),
+				// [YXi YXi wYX wYX]
+				d = _mm_shuffle_ps(second, weight, _MM_SHUFFLE(2,2,1,1));
+			float* channelDest = dest + ch*12;
+			// [XXr XXi wXX YYr]
+			_mm_storeu_ps(channelDest, _mm_shuffle_ps(first, a, _MM_SHUFFLE(2,0,1,0)));
+			// [YYi wYY XYr XYi]
+			_mm_storeu_ps(channelDest + 4, _mm_shuffle_ps(b, first, _MM_SHUFFLE(3,2,2,0)));
+			// [wXY YXr YXi wYX]
+			_mm_storeu_ps(channelDest + 8, _mm_shuffle_ps(c, d, _MM_SHUFFLE(2,0,2,0)));
+		}
+#endif
+		for(; ch!=channelCount; ++ch)
+		{
+			const std::complex<float>* channelData = data + ch*4;
+			const bool* channelFlags = flags + ch*4;
+			const float* channelWeights = weights + ch*4;
+			float* channelDest = dest + ch*12;
+			// Input is XX, XY, YX, YY; output is XX, YY, XY, YX
+			const size_t polOrder[4] = { 0, 3, 1, 2 };
+			for(size_t p=0; p!=4; ++p)
+			{
+				const size_t inputPol = polOrder[p];
+				channelDest[p*3] = channelData[inputPol].real();
+				channelDest[p*3 + 1] = channelData[inputPol].imag();
+				channelDest[p*3 + 2] = channelFlags[inputPol] ? -channelWeights[inputPol] : channelWeights[inputPol];
+			}
+		}
+	}
+}
+
+FitsWriter::FitsWriter(const std::string& filename) :
+	_nRowsWritten(0),
+	_groupHeadersInitialized(false),
+	_stagedRowCount(0),
+	_stagingCapacity(0)
 {
 	/** If the file already exists, remove it */
 	FILE *fp = std::fopen(filename.c_str(), "r");
@@ -22,6 +94,12 @@ FitsWriter::FitsWriter(const std::string& filename) : _nRowsWritten(0), _groupHe
 
 FitsWriter::~FitsWriter()
 {
+	try {
+		writeStagedRows();
+	} catch(std::exception& e) {
+		std::cerr << "Error while writing the last rows: " << e.what() << '\n';
+	}
+	
 	setKeywordToInt("GCOUNT", _nRowsWritten);
 	
 	writeAntennaTable();
@@ -190,74 +268,51 @@ void FitsWriter::WriteHistoryItem(const std::string &commandLine, const std::str
 void FitsWriter::AddRows(size_t count)
 {
 	if(!_groupHeadersInitialized)
+	{
 		initGroupHeader();
+		_stagingCapacity = std::max<size_t>(1, StagingBufferSize / (groupSize() * sizeof(float)));
+		_stagingBuffer.resize(_stagingCapacity * groupSize());
+	}
 }
 
-void FitsWriter::WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights)
+void FitsWriter::WriteRows(const RowBatch& batch)
 {
-	const size_t nGroupParameters = 5;
-	
-	// 3 dimensions (real,imag,weight), 4 pol, nch
-	const size_t nElements = 3 * 4 * _bandInfo.channels.size();
-	
-	// TODO might be efficient to declare this outside function
-	std::vector<float> rowData(nElements + nGroupParameters); 
+	for(size_t row=0; row!=batch.rowCount; ++row)
+	{
+		writeRow(batch.times[row], batch.timeCentroids[row], batch.antenna1[row], batch.antenna2[row],
+			batch.u[row], batch.v[row], batch.w[row], batch.intervals[row],
+			batch.Data(row), batch.Flags(row), batch.Weights(row));
+	}
+}
 
+void FitsWriter::writeRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights)
+{
+	if(_stagedRowCount == _stagingCapacity)
+		writeStagedRows();
+	
+	float *rowData = &_stagingBuffer[_stagedRowCount * groupSize()];
 	rowData[0] = u / VLIGHT;
 	rowData[1] = v / VLIGHT;
 	rowData[2] = w / VLIGHT;
 	rowData[3] = baselineIndex(antenna1+1, antenna2+1);
 	double zeroTimeLevel = timeZeroLevel();
 	rowData[4] = time / (60.0*60.0*24.0) + 2400000.5 - zeroTimeLevel;
+	
+	interleaveVisibilities(rowData + nGroupParameters, data, flags, weights, _bandInfo.channels.size());
+	++_stagedRowCount;
+}
 
-	float *rowDataPtr = &rowData[5];
-	const float *weightPtr = weights;
-	const bool *flagPtr = flags;
-	const std::complex<float> *dataPtr = data;
-	for(size_t ch=0; ch != _bandInfo.channels.size(); ++ch)
+void FitsWriter::writeStagedRows()
+{
+	if(_stagedRowCount != 0)
 	{
-		const std::complex<float> xx = *dataPtr; ++dataPtr;
-		const std::complex<float> xy = *dataPtr; ++dataPtr;
-		const std::complex<float> yx = *dataPtr; ++dataPtr;
-		const std::complex<float> yy = *dataPtr; ++dataPtr;
-		const float weightXX = (*flagPtr) ? -(*weightPtr) : (*weightPtr); ++ weightPtr; ++flagPtr;
-		const float weightXY = (*flagPtr) ? -(*weightPtr) : (*weightPtr); ++ weightPtr; ++flagPtr;
-		const float weightYX = (*flagPtr) ? -(*weightPtr) : (*weightPtr); ++ weightPtr; ++flagPtr;
-		const float weightYY = (*flagPtr) ? -(*weightPtr) : (*weightPtr); ++ weightPtr; ++flagPtr;
-		
-		*rowDataPtr = xx.real();
-		++rowDataPtr;
-		*rowDataPtr = xx.imag();
-		++rowDataPtr;
-		*rowDataPtr = weightXX;
-		++rowDataPtr;
-		
-		*rowDataPtr = yy.real();
-		++rowDataPtr;
-		*rowDataPtr = yy.imag();
-		++rowDataPtr;
-		*rowDataPtr = weightYY;
-		++rowDataPtr;
-		
-		*rowDataPtr = xy.real();
-		++rowDataPtr;
-		*rowDataPtr = xy.imag();
-		++rowDataPtr;
-		*rowDataPtr = weightXY;
-		++rowDataPtr;
-		
-		*rowDataPtr = yx.real();
-		++rowDataPtr;
-		*rowDataPtr = yx.imag();
-		++rowDataPtr;
-		*rowDataPtr = weightYX;
-		++rowDataPtr;
+		// The groups are consecutive in the file, so they are written with one call
+		int status = 0;
+		fits_write_grppar_flt(_fptr, _nRowsWritten + 1, 1, _stagedRowCount * groupSize(), &_stagingBuffer[0], &status);
+		checkStatus(status);
+		_nRowsWritten += _stagedRowCount;
+		_stagedRowCount = 0;
 	}
-	
-	int status = 0;
-	++_nRowsWritten;
-	fits_write_grppar_flt(_fptr, _nRowsWritten, 1 ,nElements + nGroupParameters, &rowData[0], &status);
-	checkStatus(status);
 }
 
 void FitsWriter::writeAntennaTable()
@@ -31,10 +31,20 @@ class FitsWriter : public Writer, private FitsUser
 		}
 		
 		virtual void AddRows(size_t count) final override;
-		virtual void WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights) final override;
+		virtual void WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights) final override
+		{
+			writeRow(time, timeCentroid, antenna1, antenna2, u, v, w, interval, data, flags, weights);
+		}
+		virtual void WriteRows(const RowBatch& batch) final override;
 		virtual bool AreAntennaPositionsLocal() const final override { return true; }
 		
 	private:
+		/**
+		 * Add a row to the staging buffer. The buffer is written to the file
+		 * when it is full.
+		 */
+		void writeRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights);
+		void writeStagedRows();
 		void initGroupHeader();
 		void writeAntennaTable();
 		
@@ -98,6 +108,15 @@ class FitsWriter : public Writer, private FitsUser
 		size_t _nRowsWritten;
 		bool _groupHeadersInitialized;
 		
+		//! Groups (u,v,w,baseline,date followed by the visibilities) that are not yet written
+		std::vector<float> _stagingBuffer;
+		size_t _stagedRowCount, _stagingCapacity;
+		
+		enum { nGroupParameters = 5, StagingBufferSize = 16*1024*1024 };
+		
+		//! Number of floats in a group, including the group parameters
+		size_t groupSize() const { return nGroupParameters + 3 * 4 * _bandInfo.channels.size(); }
+		
 		struct {
 			std::string name;
 			std::vector<ChannelInfo> channels;
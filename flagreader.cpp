@@ -0,0 +1,150 @@
+#include "flagreader.h"
+#include "progressbar.h"
+#include "threadpool.h"
+
+#include <algorithm>
+#include <cstring>
+
+namespace {
+	/**
+	 * Transposes an 8x8 bit matrix. Byte i of the input holds the packed flags of
+	 * timestep i, with channel c in bit 7-c, as FITS stores bits. In the result,
+	 * byte 7-c holds the flags of channel c, with timestep i in bit i.
+	 */
+	inline uint64_t transposeBits(uint64_t x)
+	{
+		uint64_t t;
+		t = (x ^ (x >> 7)) & 0x00AA00AA00AA00AAULL;
+		x = x ^ t ^ (t << 7);
+		t = (x ^ (x >> 14)) & 0x0000CCCC0000CCCCULL;
+		x = x ^ t ^ (t << 14);
+		t = (x ^ (x >> 28)) & 0x00000000F0F0F0F0ULL;
+		x = x ^ t ^ (t << 28);
+		return x;
+	}
+	
+	/**
+	 * Maps a byte to eight bools, such that bool i is bit i of the byte
+	 * (on a little-endian machine).
+	 */
+	struct BitUnpackTable
+	{
+		BitUnpackTable()
+		{
+			for(size_t value=0; value!=256; ++value)
+			{
+				values[value] = 0;
+				for(size_t bit=0; bit!=8; ++bit)
+				{
+					if(value & (1 << bit))
+						values[value] |= uint64_t(1) << (bit * 8);
+				}
+			}
+		}
+		uint64_t values[256];
+	};
+	
+	const BitUnpackTable bitUnpackTable;
+}
+
+void FlagReader::ReadTimesteps(size_t timeStart, size_t timeEnd, const std::vector<Destination>& destinations, ThreadPool& threadPool, size_t maxConcurrency, ProgressBar* progressBar)
+{
+	if(!_canReadInBulk)
+	{
+		for(size_t t=timeStart; t!=timeEnd; ++t)
+		{
+			for(size_t baseline=0; baseline!=destinations.size(); ++baseline)
+				Read(t, baseline, destinations[baseline].buffer + (t - timeStart), destinations[baseline].stride);
+		}
+		return;
+	}
+	
+	const size_t rowBytes = (_channelsPerGPUBox + 7) / 8;
+	_packedRows.resize(_files.size());
+	for(size_t blockStart=timeStart; blockStart<timeEnd; blockStart+=TimestepsPerBlock)
+	{
+		if(progressBar)
+			progressBar->SetProgress(blockStart - timeStart, timeEnd - timeStart);
+		const size_t blockEnd = std::min<size_t>(blockStart + TimestepsPerBlock, timeEnd);
+		
+		auto readFile = [&](size_t fileIndex)
+		{
+			std::vector<unsigned char>& packedRows = _packedRows[fileIndex];
+			packedRows.assign((blockEnd - blockStart) * _baselineCount * rowBytes, 0);
+			// Timesteps before the offset of the file are not stored, and are left unflagged
+			const long long
+				offset = _hduOffsets[_subbandToGPUBoxFileIndex[fileIndex + _sbStart]],
+				firstTime = std::max<long long>(blockStart, offset),
+				firstRow = (firstTime - offset) * _baselineCount,
+				endRow = std::min<long long>((blockEnd - offset) * _baselineCount, _rowCounts[fileIndex]);
+			if(endRow > firstRow)
+			{
+				int status = 0;
+				fits_read_tblbytes(_files[fileIndex], firstRow + 1, 1, (endRow - firstRow) * rowBytes,
+					&packedRows[(firstTime - blockStart) * _baselineCount * rowBytes], &status);
+				checkStatus(status);
+			}
+		};
+		// A fitsfile can only be used from another thread when cfitsio is reentrant
+		if(fits_is_reentrant())
+			threadPool.ParallelFor(_files.size(), maxConcurrency, readFile);
+		else {
+			for(size_t fileIndex=0; fileIndex!=_files.size(); ++fileIndex)
+				readFile(fileIndex);
+		}
+		
+		const size_t taskCount = (destinations.size() + BaselinesPerTask - 1) / BaselinesPerTask;
+		threadPool.ParallelFor(taskCount, maxConcurrency, [&](size_t task)
+		{
+			const size_t end = std::min<size_t>((task + 1) * BaselinesPerTask, destinations.size());
+			for(size_t baseline=task * BaselinesPerTask; baseline!=end; ++baseline)
+			{
+				Destination destination = destinations[baseline];
+				destination.buffer += blockStart - timeStart;
+				unpackBaseline(baseline, blockStart, blockEnd, destination);
+			}
+		});
+	}
+}
+
+void FlagReader::unpackBaseline(size_t baseline, size_t blockStart, size_t blockEnd, const Destination& destination) const
+{
+	const size_t
+		rowBytes = (_channelsPerGPUBox + 7) / 8,
+		timestepBytes = _baselineCount * rowBytes,
+		timestepCount = blockEnd - blockStart,
+		stride = destination.stride;
+	for(size_t fileIndex=0; fileIndex!=_files.size(); ++fileIndex)
+	{
+		const unsigned char* rowPtr = &_packedRows[fileIndex][baseline * rowBytes];
+		bool* fileBuffer = destination.buffer + fileIndex * _channelsPerGPUBox * stride;
+		size_t t = 0;
+		// Eight timesteps at a time: the bits of eight channels by eight timesteps are
+		// transposed, after which each channel has a byte with its eight timesteps that is
+		// unpacked into eight consecutive bools.
+		for(; t + 8 <= timestepCount; t += 8)
+		{
+			for(size_t byteIndex=0; byteIndex!=rowBytes; ++byteIndex)
+			{
+				uint64_t matrix = 0;
+				for(size_t i=0; i!=8; ++i)
+					matrix |= uint64_t(rowPtr[(t + i) * timestepBytes + byteIndex]) << (i * 8);
+				matrix = transposeBits(matrix);
+				const size_t
+					chStart = byteIndex * 8,
+					chEnd = std::min<size_t>(chStart + 8, _channelsPerGPUBox);
+				for(size_t ch=chStart; ch!=chEnd; ++ch)
+				{
+					const unsigned char timeBits = matrix >> ((7 - (ch - chStart)) * 8);
+					memcpy(fileBuffer + ch * stride + t, &bitUnpackTable.values[timeBits], 8);
+				}
+			}
+		}
+		for(; t!=timestepCount; ++t)
+		{
+			const unsigned char* timestepRow = rowPtr + t * timestepBytes;
+			for(size_t ch=0; ch!=_channelsPerGPUBox; ++ch)
+				fileBuffer[ch * stride + t] = (timestepRow[ch / 8] >> (7 - ch % 8)) & 1;
+		}
+	}
+}
@@ -5,14 +5,29 @@
 
 #include <fitsio.h>
 
+#include <stdint.h>
+
 #include <string>
 #include <vector>
 #include <stdexcept>
 #include <cmath>
 
+class ProgressBar;
+class ThreadPool;
+
 class FlagReader : private FitsUser
 {
 public:
+	/**
+	 * Where to store the flags of one baseline: the flag of channel ch at
+	 * timestep t is stored at buffer[ch * stride + t - timeStart].
+	 */
+	struct Destination
+	{
+		bool* buffer;
+		size_t stride;
+	};
+	
 	FlagReader(const std::string& templateName, const std::vector<int>& hduOffsetsPerGPUBox, const std::vector<size_t>& subbandToGPUBoxFileIndex, size_t sbStart, size_t sbEnd)
 		:
 		_hduOffsets(hduOffsetsPerGPUBox),
@@ -20,7 +35,9 @@ public:
 		_colNums(sbEnd - sbStart),
 		_subbandToGPUBoxFileIndex(subbandToGPUBoxFileIndex),
 		_sbStart(sbStart),
-		_sbEnd(sbEnd)
+		_sbEnd(sbEnd),
+		_rowCounts(sbEnd - sbStart),
+		_canReadInBulk(true)
 	{
 		size_t numberPos = templateName.find("%%");
 		if(numberPos == std::string::npos)
@@ -62,6 +79,18 @@ public:
 			checkStatus(status);
 			fits_get_colnum(_files[fileIndex], CASESEN, const_cast<char*>("FLAGS"), &_colNums[fileIndex], &status);
 			checkStatus(status);
+			
+			// Files written by Cotter only have the FLAGS column, with the bits of a row
+			// packed in whole bytes, and can be read in bulk.
+			int fieldCount;
+			long rowWidth, rowCount;
+			fits_read_key(_files[fileIndex], TINT, "TFIELDS", &fieldCount, 0 /*comment*/, &status);
+			fits_read_key(_files[fileIndex], TLONG, "NAXIS1", &rowWidth, 0 /*comment*/, &status);
+			fits_read_key(_files[fileIndex], TLONG, "NAXIS2", &rowCount, 0 /*comment*/, &status);
+			checkStatus(status);
+			if(fieldCount != 1 || size_t(rowWidth) != (_channelsPerGPUBox + 7) / 8)
+				_canReadInBulk = false;
+			_rowCounts[fileIndex] = rowCount;
 		}
 	}
 	
@@ -95,6 +124,16 @@ public:
 		}
 	}
 	
+	/**
+	 * Read the flags of all baselines for the timesteps [timeStart, timeEnd). Instead of
+	 * reading row by row, the rows of a block of timesteps are read with one call per flag
+	 * file, with the files read in parallel, after which the bits are unpacked and
+	 * transposed into the destination buffers.
+	 * @param destinations One destination per baseline, in the order of the flag files.
+	 * @param progressBar If not null, it is updated after every block of timesteps.
+	 */
+	void ReadTimesteps(size_t timeStart, size_t timeEnd, const std::vector<Destination>& destinations, ThreadPool& threadPool, size_t maxConcurrency, ProgressBar* progressBar);
+	
 	size_t ChannelsPerGPUBox() const { return _channelsPerGPUBox; }
 	size_t AntennaCount() const { return _antennaCount; }
 	size_t ScanCount() const { return _scanCount; }
@@ -106,6 +145,14 @@ private:
 	const std::vector<size_t> _subbandToGPUBoxFileIndex;
 	size_t _channelsPerGPUBox, _antennaCount, _baselineCount, _scanCount;
 	size_t _sbStart, _sbEnd;
+	//! Nr of rows in the flag table of each file
+	std::vector<size_t> _rowCounts;
+	bool _canReadInBulk;
+	//! Packed rows of the current block of timesteps, per file
+	std::vector<std::vector<unsigned char>> _packedRows;
+	enum { TimestepsPerBlock = 64, BaselinesPerTask = 64 };
+	
+	void unpackBaseline(size_t baseline, size_t blockStart, size_t blockEnd, const Destination& destination) const;
 };
 
 #endif
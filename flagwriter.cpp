@@ -1,15 +1,43 @@
 #include "flagwriter.h"
 
+#include <algorithm>
 #include <stdexcept>
 #include <cstdio>
 
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#include "threadpool.h"
 #include "version.h"
 
+namespace {
+	//! Reverses the order of the bits in a byte
+	struct BitReverseTable
+	{
+		BitReverseTable()
+		{
+			for(size_t value=0; value!=256; ++value)
+			{
+				values[value] = 0;
+				for(size_t bit=0; bit!=8; ++bit)
+				{
+					if(value & (1 << bit))
+						values[value] |= 0x80 >> bit;
+				}
+			}
+		}
+		unsigned char values[256];
+	};
+	
+	const BitReverseTable bitReverseTable;
+}
+
 const uint16_t
 	FlagWriter::VERSION_MINOR = 0,
 	FlagWriter::VERSION_MAJOR = 1;
 
-FlagWriter::FlagWriter(const std::string &filename, int gpsTime, size_t timestepCount, size_t nSb, size_t nodeSbStart, size_t nodeSbEnd, const std::vector<size_t>& subbandToGPUBoxFileIndex) :
+FlagWriter::FlagWriter(const std::string &filename, int gpsTime, size_t timestepCount, size_t nSb, size_t nodeSbStart, size_t nodeSbEnd, const std::vector<size_t>& subbandToGPUBoxFileIndex, ThreadPool& threadPool, size_t maxConcurrency) :
 	_timestepCount(timestepCount),
 	_antennaCount(0),
 	_channelCount(0),
@@ -21,9 +49,15 @@ FlagWriter::FlagWriter(const std::string &filename, int gpsTime, size_t timestep
 	_nodeSbStart(nodeSbStart),
 	_nodeSbEnd(nodeSbEnd),
 	_nSb(nSb),
+	_rowBytes(0),
+	_blockStartRow(0),
+	_blockRowCount(0),
 	_gpsTime(gpsTime),
 	_files(nodeSbEnd - nodeSbStart),
-	_subbandToGPUBoxFileIndex(subbandToGPUBoxFileIndex)
+	_subbandToGPUBoxFileIndex(subbandToGPUBoxFileIndex),
+	_packedRows(nodeSbEnd - nodeSbStart),
+	_threadPool(threadPool),
+	_maxConcurrency(maxConcurrency)
 {
 	if(_nodeSbEnd - _nodeSbStart == 0)
 		throw std::runtime_error("Flagwriter was initialized with zero gpuboxes");
@@ -53,6 +87,11 @@ FlagWriter::FlagWriter(const std::string &filename, int gpsTime, size_t timestep
 
 FlagWriter::~FlagWriter()
 {
+	try {
+		writeBlock();
+	} catch(std::exception& e) {
+		std::cerr << "Error while writing the last flags: " << e.what() << '\n';
+	}
 	for(std::vector<fitsfile*>::iterator i=_files.begin(); i!=_files.end(); ++i)
 	{
 		int status = 0;
@@ -108,10 +147,11 @@ void FlagWriter::setStride()
 	_channelsPerGPUBox = _channelCount / _nSb;
 	
 	// we assume we write only one polarization here
-//	_rowStride = (_channelsPerGPUBox + 7) / 8;
+	_rowBytes = (_channelsPerGPUBox + 7) / 8;
 	
-	_singlePolBuffer.resize(_channelsPerGPUBox);
-//	_packBuffer.resize(_rowStride);
+	_blockRowCount = _antennaCount * (_antennaCount+1) / 2 * TimestepsPerBlock;
+	for(std::vector<unsigned char>& packedRows : _packedRows)
+		packedRows.resize(_blockRowCount * _rowBytes);
 }
 
 void FlagWriter::SetOffsetsPerGPUBox(const std::vector<int>& offsets)
@@ -121,34 +161,107 @@ void FlagWriter::SetOffsetsPerGPUBox(const std::vector<int>& offsets)
 	_hduOffsets = offsets;
 }
 
-void FlagWriter::writeRow(size_t antenna1, size_t antenna2, const bool* flags)
+void FlagWriter::writeRows(const bool* flags, size_t rowCount, size_t rowStride)
 {
-	++_rowsWritten;
-	const size_t baselineCount = _antennaCount * (_antennaCount+1) / 2;
-	for(size_t subband=_nodeSbStart; subband != _nodeSbEnd; ++subband)
+	const size_t fileValues = _channelsPerGPUBox * _polarizationCount;
+	while(rowCount != 0)
 	{
-		std::vector<unsigned char>::iterator singlePolIter = _singlePolBuffer.begin();
-		for(size_t i=0; i!=_channelsPerGPUBox; ++i)
+		if(_rowsWritten == _blockStartRow + _blockRowCount)
+			writeBlock();
+		const size_t
+			blockRow = _rowsWritten - _blockStartRow,
+			segmentRows = std::min(rowCount, _blockRowCount - blockRow);
+		auto packFile = [&](size_t fileIndex)
 		{
-			*singlePolIter = *flags ? 1 : 0;
-			++flags;
-			
-			for(size_t p=1; p!=_polarizationCount; ++p)
+			unsigned char* packedRow = &_packedRows[fileIndex][blockRow * _rowBytes];
+			const bool* rowFlags = flags + fileIndex * fileValues;
+			for(size_t row=0; row!=segmentRows; ++row)
 			{
-				*singlePolIter |= *flags ? 1 : 0;
-				++flags;
+				packRow(rowFlags, packedRow);
+				packedRow += _rowBytes;
+				rowFlags += rowStride;
 			}
-			++singlePolIter;
+		};
+		if(segmentRows < MinRowsForParallelPacking)
+		{
+			for(size_t fileIndex=0; fileIndex!=_files.size(); ++fileIndex)
+				packFile(fileIndex);
 		}
-		
-		int status = 0;
-		int offset = _hduOffsets[_subbandToGPUBoxFileIndex[subband]];
-		if(_rowsWritten > offset * baselineCount + 1)
+		else {
+			_threadPool.ParallelFor(_files.size(), _maxConcurrency, packFile);
+		}
+		_rowsWritten += segmentRows;
+		flags += segmentRows * rowStride;
+		rowCount -= segmentRows;
+	}
+}
+
+void FlagWriter::packRow(const bool* flags, unsigned char* packedRow) const
+{
+	size_t ch = 0;
+#if defined(__SSE2__)
+	if(_polarizationCount == 4)
+	{
+		const __m128i zero = _mm_setzero_si128();
+		for(; ch+8<=_channelsPerGPUBox; ch+=8)
+		{
+			// Each 32-bit lane holds the four polarizations of a channel, and
+			// compares equal to zero when none of them is flagged
+			const __m128i
+				first = _mm_loadu_si128(reinterpret_cast<const __m128i*>(flags + ch*4)),
+				second = _mm_loadu_si128(reinterpret_cast<const __m128i*>(flags + ch*4 + 16));
+			const int unflaggedBits =
+				_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(first, zero))) |
+				(_mm_movemask_ps(_mm_castsi128_ps(_mm_cmpeq_epi32(second, zero))) << 4);
+			// FITS stores the first element of a bit column in the most significant bit
+			packedRow[ch/8] = bitReverseTable.values[~unflaggedBits & 0xFF];
+		}
+	}
+#endif
+	for(; ch<_channelsPerGPUBox; ch+=8)
+	{
+		const size_t chEnd = std::min<size_t>(ch+8, _channelsPerGPUBox);
+		unsigned char packed = 0;
+		for(size_t c=ch; c!=chEnd; ++c)
+		{
+			bool isFlagged = false;
+			for(size_t p=0; p!=_polarizationCount; ++p)
+				isFlagged = isFlagged || flags[c*_polarizationCount + p];
+			if(isFlagged)
+				packed |= 0x80 >> (c - ch);
+		}
+		packedRow[ch/8] = packed;
+	}
+}
+
+void FlagWriter::writeBlock()
+{
+	const long long
+		baselineCount = _antennaCount * (_antennaCount+1) / 2,
+		blockStart = _blockStartRow,
+		blockEnd = _rowsWritten;
+	if(blockEnd == blockStart)
+		return;
+	auto writeFile = [&](size_t fileIndex)
+	{
+		// The file of a gpubox with an offset starts that many timesteps later
+		const long long
+			offsetRows = _hduOffsets[_subbandToGPUBoxFileIndex[fileIndex + _nodeSbStart]] * baselineCount,
+			firstRow = std::max(blockStart, offsetRows);
+		if(blockEnd > firstRow)
 		{
-			size_t unalignedRow = _rowsWritten - offset * baselineCount;
-			ffpcl(_files[subband-_nodeSbStart], TBIT, 1 /*colnum*/, unalignedRow /*firstrow*/,
-				1 /*firstelem*/, _channelsPerGPUBox /*nelements*/, &_singlePolBuffer[0], &status);
+			int status = 0;
+			fits_write_tblbytes(_files[fileIndex], firstRow - offsetRows + 1 /*firstrow*/, 1 /*firstchar*/,
+				(blockEnd - firstRow) * _rowBytes, &_packedRows[fileIndex][(firstRow - blockStart) * _rowBytes], &status);
 			checkStatus(status);
 		}
+	};
+	// A fitsfile can only be used from another thread when cfitsio is reentrant
+	if(fits_is_reentrant())
+		_threadPool.ParallelFor(_files.size(), _maxConcurrency, writeFile);
+	else {
+		for(size_t fileIndex=0; fileIndex!=_files.size(); ++fileIndex)
+			writeFile(fileIndex);
 	}
+	_blockStartRow = _rowsWritten;
 }
@@ -9,10 +9,17 @@
 #include <iostream>
 #include <fitsio.h>
 
+class ThreadPool;
+
+/**
+ * Writes the flags to one .mwaf file per gpubox. The polarizations are combined
+ * and packed into bits as rows come in, and the packed rows of a block of timesteps
+ * are written with a single call per file, with the files written in parallel.
+ */
 class FlagWriter : public Writer, private FitsUser
 {
 	public:
-		FlagWriter(const std::string &filename, int gpsTime, size_t timestepCount, size_t nSb, size_t nodeSbStart, size_t nodeSbEnd, const std::vector<size_t>& subbandToGPUBoxFileIndex);
+		FlagWriter(const std::string &filename, int gpsTime, size_t timestepCount, size_t nSb, size_t nodeSbStart, size_t nodeSbEnd, const std::vector<size_t>& subbandToGPUBoxFileIndex, ThreadPool& threadPool, size_t maxConcurrency);
 		
 		~FlagWriter();
 		
@@ -55,7 +62,12 @@ class FlagWriter : public Writer, private FitsUser
 		
 		void WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights)
 		{
-			writeRow(antenna1, antenna2, flags);
+			writeRows(flags, 1, 0);
+		}
+		
+		void WriteRows(const RowBatch& batch) override final
+		{
+			writeRows(batch.flags, batch.rowCount, batch.rowStride);
 		}
 		
 		void WriteHistoryItem(const std::string &commandLine, const std::string &application, const std::vector<std::string> &params)
@@ -70,7 +82,18 @@ class FlagWriter : public Writer, private FitsUser
 		virtual void SetOffsetsPerGPUBox(const std::vector<int>& offsets);
 	private:
 		void writeHeader();
-		void writeRow(size_t antenna1, size_t antenna2, const bool* flags);
+		/**
+		 * Pack the rows into the block buffers, and write the block when it is full.
+		 * @param rowStride Distance between the flags of two consecutive rows.
+		 */
+		void writeRows(const bool* flags, size_t rowCount, size_t rowStride);
+		/**
+		 * OR the polarizations of a gpubox's part of a row together and pack
+		 * the result into bits, in the order of a FITS bit column.
+		 */
+		void packRow(const bool* flags, unsigned char* packedRow) const;
+		//! Write the rows of the current block to the files
+		void writeBlock();
 		void setStride();
 		struct Header
 		{
@@ -91,15 +114,22 @@ class FlagWriter : public Writer, private FitsUser
 		size_t _timestepCount, _antennaCount, _channelCount, _channelsPerGPUBox, _polarizationCount;
 		//size_t _rowStride;
 		size_t _rowsAdded, _rowsWritten, _nodeSbStart, _nodeSbEnd, _nSb;
+		//! Bytes per packed row, first row of the current block and number of rows in a block
+		size_t _rowBytes, _blockStartRow, _blockRowCount;
 		int _gpsTime;
 		std::vector<fitsfile*> _files;
 		
 		const static uint16_t VERSION_MINOR, VERSION_MAJOR;
 		
 		std::vector<size_t> _subbandToGPUBoxFileIndex;
-		std::vector<unsigned char> _singlePolBuffer;
 		std::vector<int> _hduOffsets;
-		//std::vector<unsigned char> _packBuffer;
+		//! The packed rows of the current block, one buffer per file
+		std::vector<std::vector<unsigned char>> _packedRows;
+		
+		ThreadPool& _threadPool;
+		size_t _maxConcurrency;
+		
+		enum { TimestepsPerBlock = 8, MinRowsForParallelPacking = 64 };
 };
 
 #endif
@@ -66,6 +66,11 @@ class ForwardingWriter : public Writer
 			_writer->WriteRow(time, timeCentroid, antenna1, antenna2, u, v, w, interval, data, flags, weights);
 		}
 		
+		virtual void WriteRows(const RowBatch& batch) override
+		{
+			_writer->WriteRows(batch);
+		}
+		
 		virtual void WriteHistoryItem(const std::string &commandLine, const std::string &application, const std::vector<std::string> &params) override
 		{
 			_writer->WriteHistoryItem(commandLine, application, params);
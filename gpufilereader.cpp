@@ -1,18 +1,34 @@
 #include "gpufilereader.h"
 #include "progressbar.h"
 
+#include <algorithm>
 #include <complex>
+#include <cstdint>
+#include <cstring>
 #include <iostream>
+#include <memory>
+#include <mutex>
 #include <sstream>
 #include <stdexcept>
 #include <thread>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifdef __SSSE3__
+#include <tmmintrin.h>
+#define USE_SSE
+#endif
+
 void GPUFileReader::openFiles()
 {
 	int status = 0;
 	bool hasWarnedAboutDifferentTimes = false;
 	_hasStartTime = false;
 	std::vector<long> startTimePerFile(_filenames.size());
+	_mappedFiles.assign(_filenames.size(), MappedFile());
 	for(size_t i=0; i!=_filenames.size(); ++i)
 	{
 		const std::string &curFilename = _filenames[i];
@@ -47,6 +63,9 @@ void GPUFileReader::openFiles()
 				_hasStartTime = true;
 			}
 			startTimePerFile[i] = thisFileTime;
+			
+			if(_useMMap)
+				mapFile(i);
 			if(_startTime != thisFileTime)
 			{
 				if(!hasWarnedAboutDifferentTimes || thisFileTime > _startTime)
@@ -72,6 +91,8 @@ void GPUFileReader::openFiles()
 		}
 	}
 	_isOpen = true;
+	if(_asyncReadAhead != 0 && !fits_is_reentrant())
+		std::cout << "WARNING: cfitsio was not compiled to be thread safe; GPU files will be read sequentially.\n";
 	_hduOffsetsPerFile.resize(_filenames.size());
 	for(size_t i=0; i!=_filenames.size(); ++i)
 	{
@@ -105,6 +126,7 @@ void GPUFileReader::closeFiles()
 		}
 	}
 	_fitsFiles.clear();
+	unmapFiles();
 	_isOpen = false;
 }
 
@@ -116,22 +138,22 @@ bool GPUFileReader::Read(size_t &bufferPos, size_t bufferLength) {
 	const size_t nPol = 4;
 	const size_t nBaselines = (_nAntenna + 1) * _nAntenna / 2;
 	const size_t gpuMatrixSizePerFile = _nChannelsInTotal * nBaselines * nPol / _filenames.size(); // cuda matrix length per file
+	
+	// Reading the files in parallel requires cfitsio to be thread safe, which is
+	// only the case when it was compiled with --enable-reentrant
+	const bool isAsync = _asyncReadAhead != 0 && _filenames.size() > 1 && fits_is_reentrant();
+	// In async mode, each I/O thread can be ahead of the shuffle tasks by _asyncReadAhead HDUs
+	const size_t gpuMatrixBufferCount = isAsync ? _threadCount + _asyncReadAhead * _filenames.size() : _threadCount;
 
-	_shuffleTasks.clear();
-	_availableGPUMatrixBuffers.clear();
-	std::vector<std::vector<std::complex<float> > > gpuMatrixBuffers(_threadCount);
-	std::vector<std::thread> threadGroup;
+	_availableGPUMatrixBuffers.resize(gpuMatrixBufferCount);
+	std::vector<std::vector<std::complex<float> > > gpuMatrixBuffers(gpuMatrixBufferCount);
+	// Each HDU, or block of mapped timesteps, is shuffled as a separate task, such that
+	// pool threads are only claimed while there is something to shuffle and can run
+	// the tasks of the other stages in between.
+	ThreadPool::TaskGroup shuffleGroup(_threadPool, _threadCount);
 	
 	try
 	{
-		
-		for(size_t i=0; i!=_threadCount; ++i)
-		{
-			gpuMatrixBuffers[i].resize(gpuMatrixSizePerFile);
-			_availableGPUMatrixBuffers.write(&gpuMatrixBuffers[i][0]);
-			threadGroup.emplace_back(&GPUFileReader::shuffleThreadFunc, this);
-		}
-
 		if(!_isOpen)
 		{
 			openFiles();
@@ -140,93 +162,78 @@ bool GPUFileReader::Read(size_t &bufferPos, size_t bufferLength) {
 			findStopHDU();
 		}
 		
+		// Intermediate buffers are only necessary when not all data can be read from memory maps
+		bool isFullyMapped = true;
+		for(size_t iFile = 0; iFile != _filenames.size(); ++iFile)
+		{
+			if(!_filenames[iFile].empty())
+			{
+				const MappedFile &mapped = _mappedFiles[iFile];
+				isFullyMapped = isFullyMapped && mapped.data != nullptr;
+				for(size_t hdu=_currentHDU; hdu<=mapped.hdus.size(); ++hdu)
+					isFullyMapped = isFullyMapped && mapped.hdus[hdu-1].isMappable;
+			}
+		}
+		if(!isFullyMapped)
+		{
+			for(size_t i=0; i!=gpuMatrixBufferCount; ++i)
+			{
+				gpuMatrixBuffers[i].resize(gpuMatrixSizePerFile);
+				_availableGPUMatrixBuffers.write(&gpuMatrixBuffers[i][0]);
+			}
+		}
 		initMapping();
 
-		ProgressBar progressBar("Reading GPU files");
+		std::unique_ptr<ProgressBar> progressBar;
+		if(_showProgress)
+			progressBar.reset(new ProgressBar("Reading GPU files"));
 		
-		size_t endingBufferPos = bufferLength;
-		bool moreAvailable = false;
-		for (size_t iFile = 0; iFile != _filenames.size(); ++iFile) {
-			if(!_filenames[iFile].empty())
-			{
-				size_t
-					fileBufferPos = bufferPos,
-					fileHDU = _currentHDU;
-				
-				if(_doAlign)
+		std::vector<size_t> endingBufferPosPerFile(_filenames.size(), bufferLength);
+		std::vector<char> moreAvailablePerFile(_filenames.size(), false);
+		if(isAsync)
+		{
+			std::vector<std::exception_ptr> exceptionPerFile(_filenames.size());
+			std::vector<std::thread> ioThreadGroup;
+			for (size_t iFile = 0; iFile != _filenames.size(); ++iFile) {
+				if(!_filenames[iFile].empty())
 				{
-					// These statements will align a file with the times given in the individual gpubox fits files.
-					if(_hduOffsetsPerFile[iFile] <= (int) bufferPos)
-						fileBufferPos = bufferPos - _hduOffsetsPerFile[iFile];
-					else {
-						fileHDU += _hduOffsetsPerFile[iFile] - bufferPos;
-						fileBufferPos = bufferPos;
-					}
+					ioThreadGroup.emplace_back([&, iFile]() {
+						try {
+							bool moreAvailable;
+							readFile(iFile, bufferPos, bufferLength, progressBar.get(), shuffleGroup, endingBufferPosPerFile[iFile], moreAvailable);
+							moreAvailablePerFile[iFile] = moreAvailable;
+						} catch(...) {
+							exceptionPerFile[iFile] = std::current_exception();
+						}
+					});
 				}
-				size_t fileStopHDU = _fitsHDUCounts[iFile];
-				size_t hdusAvailable = fileStopHDU - fileHDU + 1;
-				if(endingBufferPos > bufferPos + hdusAvailable) endingBufferPos = bufferPos + hdusAvailable;
-				
-				while (fileHDU <= fileStopHDU && fileBufferPos < bufferLength)
+			}
+			for(std::thread& t : ioThreadGroup)
+				t.join();
+			for(const std::exception_ptr& e : exceptionPerFile)
+			{
+				if(e)
+					std::rethrow_exception(e);
+			}
+		}
+		else {
+			for (size_t iFile = 0; iFile != _filenames.size(); ++iFile) {
+				if(!_filenames[iFile].empty())
 				{
-					progressBar.SetProgress(fileHDU + iFile*fileStopHDU, fileStopHDU*_filenames.size());
-
-					fitsfile *fptr = _fitsFiles[iFile];
-
-					int status = 0, hduType = 0;
-					fits_movabs_hdu(fptr, fileHDU, &hduType, &status);
-					checkStatus(status);
-					if (hduType == BINARY_TBL) {
-						throw std::runtime_error("GPU file seems not to contain image headers; format not understood.");
-					}
-					else {
-
-						long fpixel = 1;
-						float nullval = 0;
-						int anynull = 0x0;
-						long naxes[2];
-
-						fits_get_img_size(fptr, 2, naxes, &status);
-						checkStatus(status);
-
-						size_t channelsInFile = naxes[1];
-						size_t baselTimesPolInFile = naxes[0];
-
-						if(_nChannelsInTotal != (channelsInFile*_filenames.size())) {
-							std::stringstream s;
-							s << "Number of GPU files (" << _filenames.size() << ") in time range x row count of image chunk in file (" << channelsInFile << ") != "
-							<< "total channels count (" << _nChannelsInTotal << "): are the FITS files the dimension you expected them to be?";
-							throw std::runtime_error(s.str());
-						}
-						// Test the first axis; note that we assert the number of floats, not complex, hence the factor of two.
-						if(baselTimesPolInFile != nBaselines * nPol * 2) {
-							std::stringstream s;
-							s << "Unexpected number of visibilities in axis of GPU file. Expected=" << (nBaselines*nPol*2) << ", actual=" << baselTimesPolInFile;
-							throw std::runtime_error(s.str()); // If we don't join our threads, they will go out of scope, crash, and that will not be good
-						}
-
-						std::complex<float> *matrixPtr = 0;
-						_availableGPUMatrixBuffers.read(matrixPtr);
-						fits_read_img(fptr, TFLOAT, fpixel, channelsInFile * baselTimesPolInFile, &nullval, (float *) matrixPtr, &anynull, &status);
-						checkStatus(status);
-						
-						ShuffleTask shuffleTask;
-						shuffleTask.iFile = iFile;
-						shuffleTask.channelsInFile = channelsInFile;
-						shuffleTask.fileBufferPos = fileBufferPos;
-						shuffleTask.gpuMatrix = matrixPtr;
-						_shuffleTasks.write(shuffleTask);
-					}
-					++fileHDU;
-					++fileBufferPos;
+					bool moreAvailable;
+					readFile(iFile, bufferPos, bufferLength, progressBar.get(), shuffleGroup, endingBufferPosPerFile[iFile], moreAvailable);
+					moreAvailablePerFile[iFile] = moreAvailable;
 				}
-				if(fileHDU <= fileStopHDU)
-					moreAvailable = true;
 			}
 		}
-		_shuffleTasks.write_end();
-		for(std::thread& t : threadGroup)
-			t.join();
+		shuffleGroup.Wait();
+		
+		size_t endingBufferPos = bufferLength;
+		bool moreAvailable = false;
+		for (size_t iFile = 0; iFile != _filenames.size(); ++iFile) {
+			endingBufferPos = std::min(endingBufferPos, endingBufferPosPerFile[iFile]);
+			moreAvailable = moreAvailable || moreAvailablePerFile[iFile];
+		}
 		
 		_currentHDU += endingBufferPos - bufferPos;
 		bufferPos = endingBufferPos;
@@ -237,75 +244,372 @@ bool GPUFileReader::Read(size_t &bufferPos, size_t bufferLength) {
 	}
 	catch(...)
 	{
-		// Apparently C++ crashes when a std::thread exits scope without a join().
-		// This ensures that an thrown exception will not cause this problem
-		_shuffleTasks.write_end();
-		for(std::thread& t : threadGroup)
-		{
-			if(t.joinable())
-				t.join();
-		}
+		// Make sure the shuffle tasks finish before the buffers go out of scope
+		try {
+			shuffleGroup.Wait();
+		} catch(...) { }
 		throw;
 	}
 }
 
-void GPUFileReader::shuffleThreadFunc()
+/**
+ * Reads the HDUs of a single file that fall within the buffer, and adds a shuffle
+ * task for them to the shuffle group. Each file has its own fitsfile handle, so that several files can
+ * be read concurrently.
+ */
+void GPUFileReader::readFile(size_t iFile, size_t bufferPos, size_t bufferLength, ProgressBar* progressBar, ThreadPool::TaskGroup& shuffleGroup, size_t& endingBufferPos, bool& moreAvailable)
 {
-	ShuffleTask task;
-	while(_shuffleTasks.read(task))
+	const size_t nPol = 4;
+	const size_t nBaselines = (_nAntenna + 1) * _nAntenna / 2;
+	
+	size_t
+		fileBufferPos = bufferPos,
+		fileHDU = _currentHDU;
+	
+	if(_doAlign)
 	{
-		shuffleBuffer(task.iFile, task.channelsInFile, task.fileBufferPos, task.gpuMatrix);
+		// These statements will align a file with the times given in the individual gpubox fits files.
+		if(_hduOffsetsPerFile[iFile] <= (int) bufferPos)
+			fileBufferPos = bufferPos - _hduOffsetsPerFile[iFile];
+		else {
+			fileHDU += _hduOffsetsPerFile[iFile] - bufferPos;
+			fileBufferPos = bufferPos;
+		}
+	}
+	size_t fileStopHDU = _fitsHDUCounts[iFile];
+	size_t hdusAvailable = fileStopHDU - fileHDU + 1;
+	endingBufferPos = bufferLength;
+	if(endingBufferPos > bufferPos + hdusAvailable) endingBufferPos = bufferPos + hdusAvailable;
+	
+	// Consecutive memory mapped timesteps are combined in a single task, so that they
+	// can be transposed together
+	ShuffleTask mappedTask;
+	mappedTask.timestepCount = 0;
+	
+	while (fileHDU <= fileStopHDU && fileBufferPos < bufferLength)
+	{
+		if(progressBar)
+		{
+			std::lock_guard<std::mutex> lock(_progressMutex);
+			progressBar->SetProgress(fileHDU + iFile*fileStopHDU, fileStopHDU*_filenames.size());
+		}
+
+		const MappedFile::HDU *mappedHDU = nullptr;
+		if(_mappedFiles[iFile].data != nullptr && _mappedFiles[iFile].hdus[fileHDU-1].isMappable)
+			mappedHDU = &_mappedFiles[iFile].hdus[fileHDU-1];
+		
+		fitsfile *fptr = _fitsFiles[iFile];
+		
+		int status = 0;
+		size_t channelsInFile, baselTimesPolInFile;
+		if(mappedHDU != nullptr)
+		{
+			channelsInFile = mappedHDU->channelsInFile;
+			baselTimesPolInFile = mappedHDU->baselTimesPolInFile;
+		}
+		else {
+			int hduType = 0;
+			fits_movabs_hdu(fptr, fileHDU, &hduType, &status);
+			checkStatus(status);
+			if (hduType == BINARY_TBL) {
+				throw std::runtime_error("GPU file seems not to contain image headers; format not understood.");
+			}
+			long naxes[2];
+			fits_get_img_size(fptr, 2, naxes, &status);
+			checkStatus(status);
+
+			channelsInFile = naxes[1];
+			baselTimesPolInFile = naxes[0];
+		}
+
+		if(_nChannelsInTotal != (channelsInFile*_filenames.size())) {
+			std::stringstream s;
+			s << "Number of GPU files (" << _filenames.size() << ") in time range x row count of image chunk in file (" << channelsInFile << ") != "
+			<< "total channels count (" << _nChannelsInTotal << "): are the FITS files the dimension you expected them to be?";
+			throw std::runtime_error(s.str());
+		}
+		// Test the first axis; note that we assert the number of floats, not complex, hence the factor of two.
+		if(baselTimesPolInFile != nBaselines * nPol * 2) {
+			std::stringstream s;
+			s << "Unexpected number of visibilities in axis of GPU file. Expected=" << (nBaselines*nPol*2) << ", actual=" << baselTimesPolInFile;
+			throw std::runtime_error(s.str()); // If we don't join our threads, they will go out of scope, crash, and that will not be good
+		}
+
+		if(mappedHDU != nullptr)
+		{
+			// Zero copy: the shuffle tasks read straight from the mapped pages
+			if(mappedTask.timestepCount == 0)
+			{
+				mappedTask.iFile = iFile;
+				mappedTask.channelsInFile = channelsInFile;
+				mappedTask.fileBufferPos = fileBufferPos;
+				mappedTask.gpuMatrix = nullptr;
+			}
+			mappedTask.mappedData[mappedTask.timestepCount] = reinterpret_cast<const float*>(_mappedFiles[iFile].data + mappedHDU->dataOffset);
+			++mappedTask.timestepCount;
+			if(mappedTask.timestepCount == MaxTimestepsPerTask)
+			{
+				shuffleGroup.Run(std::bind(&GPUFileReader::runShuffleTask, this, mappedTask));
+				mappedTask.timestepCount = 0;
+			}
+		}
+		else {
+			if(mappedTask.timestepCount != 0)
+			{
+				shuffleGroup.Run(std::bind(&GPUFileReader::runShuffleTask, this, mappedTask));
+				mappedTask.timestepCount = 0;
+			}
+			
+			ShuffleTask shuffleTask;
+			shuffleTask.iFile = iFile;
+			shuffleTask.channelsInFile = channelsInFile;
+			shuffleTask.fileBufferPos = fileBufferPos;
+			shuffleTask.timestepCount = 1;
+			long fpixel = 1;
+			float nullval = 0;
+			int anynull = 0x0;
+			std::complex<float> *matrixPtr = 0;
+			_availableGPUMatrixBuffers.read(matrixPtr);
+			fits_read_img(fptr, TFLOAT, fpixel, channelsInFile * baselTimesPolInFile, &nullval, (float *) matrixPtr, &anynull, &status);
+			if(status != 0)
+				_availableGPUMatrixBuffers.write(matrixPtr);
+			checkStatus(status);
+			shuffleTask.gpuMatrix = matrixPtr;
+			shuffleGroup.Run(std::bind(&GPUFileReader::runShuffleTask, this, shuffleTask));
+		}
+		++fileHDU;
+		++fileBufferPos;
+	}
+	if(mappedTask.timestepCount != 0)
+		shuffleGroup.Run(std::bind(&GPUFileReader::runShuffleTask, this, mappedTask));
+	moreAvailable = (fileHDU <= fileStopHDU);
+}
+
+void GPUFileReader::runShuffleTask(const ShuffleTask& task)
+{
+	if(task.gpuMatrix == nullptr)
+		shuffleBuffer<true>(task.iFile, task.channelsInFile, task.fileBufferPos, task.mappedData, task.timestepCount);
+	else {
+		const float *data = reinterpret_cast<const float*>(task.gpuMatrix);
+		shuffleBuffer<false>(task.iFile, task.channelsInFile, task.fileBufferPos, &data, 1);
 		_availableGPUMatrixBuffers.write(task.gpuMatrix);
 	}
 }
 
-void GPUFileReader::shuffleBuffer(size_t iFile, size_t channelsInFile, size_t fileBufferPos, const std::complex<float> *gpuMatrix)
+namespace {
+	/**
+	 * Load a float that is stored in either native (little endian) or
+	 * FITS (big endian) byte order.
+	 */
+	template<bool IsBigEndian>
+	inline float loadFloat(const float *ptr)
+	{
+		if(IsBigEndian)
+		{
+			uint32_t value;
+			std::memcpy(&value, ptr, sizeof(float));
+			value = __builtin_bswap32(value);
+			float result;
+			std::memcpy(&result, &value, sizeof(float));
+			return result;
+		}
+		else {
+			return *ptr;
+		}
+	}
+	
+#ifdef USE_SSE
+	/**
+	 * Load four floats, that are stored in either native or FITS byte order.
+	 */
+	template<bool IsBigEndian>
+	inline __m128 loadFloats(const float *ptr)
+	{
+		__m128 values = _mm_loadu_ps(ptr);
+		if(IsBigEndian)
+		{
+			const __m128i byteOrder = _mm_set_epi8(12, 13, 14, 15, 8, 9, 10, 11, 4, 5, 6, 7, 0, 1, 2, 3);
+			values = _mm_castsi128_ps(_mm_shuffle_epi8(_mm_castps_si128(values), byteOrder));
+		}
+		return values;
+	}
+#endif
+}
+
+/**
+ * Transposes the data of one file for one or more consecutive timesteps into
+ * the destination buffers. The GPU matrices are ordered by channel, correlation
+ * and polarization, whereas the destination has a plane per correlation,
+ * polarization and real/imaginary part, in which time moves fastest.
+ * Correlations are processed in tiles, to keep the part of the GPU matrices
+ * that is being read in cache. Four timesteps are transposed together with SSE,
+ * such that each destination store writes four consecutive values.
+ */
+template<bool IsBigEndian>
+void GPUFileReader::shuffleBuffer(size_t iFile, size_t channelsInFile, size_t fileBufferPos, const float* const* timestepData, size_t timestepCount)
 {
 	const size_t nPol = 4;
 	const size_t nBaselines = (_nAntenna + 1) * _nAntenna / 2;
+	// Strides in floats, not complex values
+	const size_t correlationStride = nPol * 2;
+	const size_t channelStride = nBaselines * correlationStride;
+	const size_t channelStart = iFile * channelsInFile;
+	const size_t correlationTileSize = 16;
 	
-	/** Note that the following antenna indices do not refer to the actual
-	* antennae indices, but to correlator input indices. These need to be
-	* mapped to the actual antenna indices. */
-	size_t correlationIndex = 0;
-	for(size_t antenna1=0; antenna1!=_nAntenna; ++antenna1)
+	// Because the station indices in the GPU file are reversed compared to the destination,
+	// the polarization order of XY and YX is changed too.
+	const size_t destPol[4] = { 0, 2, 1, 3 };
+	
+	for(size_t tileStart=0; tileStart < nBaselines; tileStart += correlationTileSize)
 	{
-		for(size_t antenna2=0; antenna2<=antenna1; ++antenna2)
+		const size_t tileEnd = std::min(tileStart + correlationTileSize, nBaselines);
+		for(size_t ch=0; ch!=channelsInFile; ++ch)
 		{
-			size_t channelStart = iFile * channelsInFile;
-			size_t channelEnd = (iFile+1) * channelsInFile;
-			size_t index = correlationIndex * nPol;
-			// Because possibly antenna2 <= antenna1 in the GPU file, and Casa MS expects it the other way
-			// around, we change the order and take the complex conjugates later.
-			BaselineBuffer &buffer = getMappedBuffer(antenna2, antenna1);
-			size_t destChanIndex = fileBufferPos + channelStart * _bufferSize;
-			for(size_t ch=channelStart; ch!=channelEnd; ++ch)
+			const size_t destIndex = fileBufferPos + (channelStart + ch) * _bufferSize;
+			for(size_t correlationIndex=tileStart; correlationIndex!=tileEnd; ++correlationIndex)
 			{
-				const std::complex<float> *dataPtr = &gpuMatrix[index];
-				
-				*(buffer.real[0] + destChanIndex) = dataPtr->real();
-				*(buffer.imag[0] + destChanIndex) = dataPtr->imag();
-				++dataPtr;
-				
-				*(buffer.real[2] + destChanIndex) = dataPtr->real();
-				*(buffer.imag[2] + destChanIndex) = dataPtr->imag();
-				++dataPtr;
-				
-				*(buffer.real[1] + destChanIndex) = dataPtr->real();
-				*(buffer.imag[1] + destChanIndex) = dataPtr->imag();
-				++dataPtr;
-				
-				*(buffer.real[3] + destChanIndex) = dataPtr->real();
-				*(buffer.imag[3] + destChanIndex) = dataPtr->imag();
-
-				index += nBaselines * nPol;
-				destChanIndex += _bufferSize;
+				const ShuffleDestination &dest = _shuffleDestinations[correlationIndex];
+				const BaselineBuffer &buffer = *dest.buffer;
+				const size_t sourceIndex = ch * channelStride + correlationIndex * correlationStride;
+#ifdef USE_SSE
+				if(timestepCount == 4)
+				{
+					// Each register holds two complex values of one timestep
+					__m128
+						a0 = loadFloats<IsBigEndian>(timestepData[0] + sourceIndex),
+						a1 = loadFloats<IsBigEndian>(timestepData[1] + sourceIndex),
+						a2 = loadFloats<IsBigEndian>(timestepData[2] + sourceIndex),
+						a3 = loadFloats<IsBigEndian>(timestepData[3] + sourceIndex),
+						b0 = loadFloats<IsBigEndian>(timestepData[0] + sourceIndex + 4),
+						b1 = loadFloats<IsBigEndian>(timestepData[1] + sourceIndex + 4),
+						b2 = loadFloats<IsBigEndian>(timestepData[2] + sourceIndex + 4),
+						b3 = loadFloats<IsBigEndian>(timestepData[3] + sourceIndex + 4);
+					// After transposing, each register holds the real or imaginary values
+					// of one polarization for the four timesteps
+					_MM_TRANSPOSE4_PS(a0, a1, a2, a3);
+					_MM_TRANSPOSE4_PS(b0, b1, b2, b3);
+					_mm_storeu_ps(buffer.real[destPol[0]] + destIndex, a0);
+					_mm_storeu_ps(buffer.imag[destPol[0]] + destIndex, _mm_mul_ps(a1, _mm_set1_ps(dest.imagSign[destPol[0]])));
+					_mm_storeu_ps(buffer.real[destPol[1]] + destIndex, a2);
+					_mm_storeu_ps(buffer.imag[destPol[1]] + destIndex, _mm_mul_ps(a3, _mm_set1_ps(dest.imagSign[destPol[1]])));
+					_mm_storeu_ps(buffer.real[destPol[2]] + destIndex, b0);
+					_mm_storeu_ps(buffer.imag[destPol[2]] + destIndex, _mm_mul_ps(b1, _mm_set1_ps(dest.imagSign[destPol[2]])));
+					_mm_storeu_ps(buffer.real[destPol[3]] + destIndex, b2);
+					_mm_storeu_ps(buffer.imag[destPol[3]] + destIndex, _mm_mul_ps(b3, _mm_set1_ps(dest.imagSign[destPol[3]])));
+					continue;
+				}
+#endif
+				for(size_t t=0; t!=timestepCount; ++t)
+				{
+					const float *dataPtr = timestepData[t] + sourceIndex;
+					for(size_t p=0; p!=nPol; ++p)
+					{
+						const size_t pol = destPol[p];
+						*(buffer.real[pol] + destIndex + t) = loadFloat<IsBigEndian>(dataPtr);
+						*(buffer.imag[pol] + destIndex + t) = loadFloat<IsBigEndian>(dataPtr+1) * dest.imagSign[pol];
+						dataPtr += 2;
+					}
+				}
 			}
-			++correlationIndex;
 		}
 	}
 }
 
+/**
+ * Memory maps a gpubox file and determines the location of the data of each HDU.
+ * If the file can not be used directly (e.g. because it is compressed), it is left
+ * unmapped and will be read with cfitsio.
+ */
+void GPUFileReader::mapFile(size_t iFile)
+{
+	MappedFile &mapped = _mappedFiles[iFile];
+	int fd = open(_filenames[iFile].c_str(), O_RDONLY);
+	if(fd < 0)
+		return;
+	struct stat fileStat;
+	if(fstat(fd, &fileStat) != 0 || fileStat.st_size == 0)
+	{
+		close(fd);
+		return;
+	}
+	const size_t fileSize = fileStat.st_size;
+	void *addr = mmap(nullptr, fileSize, PROT_READ, MAP_SHARED, fd, 0);
+	close(fd);
+	if(addr == MAP_FAILED)
+		return;
+	madvise(addr, fileSize, MADV_SEQUENTIAL);
+	mapped.data = reinterpret_cast<const char*>(addr);
+	mapped.size = fileSize;
+	
+	fitsfile *fptr = _fitsFiles[iFile];
+	const size_t hduCount = _fitsHDUCounts[iFile];
+	mapped.hdus.resize(hduCount);
+	size_t mappableCount = 0;
+	for(size_t hdu=1; hdu<=hduCount; ++hdu)
+	{
+		MappedFile::HDU &info = mapped.hdus[hdu-1];
+		info.isMappable = false;
+		int status = 0, hduType = 0;
+		fits_movabs_hdu(fptr, hdu, &hduType, &status);
+		checkStatus(status);
+		if(hduType != IMAGE_HDU)
+			continue;
+		
+		int bitpix;
+		long naxes[2] = {0, 0};
+		LONGLONG headStart, dataStart, dataEnd;
+		fits_get_img_type(fptr, &bitpix, &status);
+		fits_get_img_size(fptr, 2, naxes, &status);
+		fits_get_hduaddrll(fptr, &headStart, &dataStart, &dataEnd, &status);
+		checkStatus(status);
+		
+		// Scaled values can not be used directly
+		bool isScaled = false;
+		const char *scaleKeywords[2] = { "BSCALE", "BZERO" };
+		const double unscaledValues[2] = { 1.0, 0.0 };
+		for(size_t k=0; k!=2; ++k)
+		{
+			double value;
+			int keyStatus = 0;
+			fits_read_key(fptr, TDOUBLE, scaleKeywords[k], &value, 0, &keyStatus);
+			if(keyStatus == 0 && value != unscaledValues[k])
+				isScaled = true;
+		}
+		
+		// If the raw bytes at the header position do not form a FITS header, the file
+		// is compressed or otherwise transformed by cfitsio, and can not be mapped.
+		const char *headerStart = hdu==1 ? "SIMPLE  " : "XTENSION";
+		const size_t dataSize = size_t(naxes[0]) * size_t(naxes[1]) * sizeof(float);
+		info.isMappable =
+			bitpix == FLOAT_IMG && !isScaled &&
+			size_t(headStart) + 8 <= fileSize &&
+			std::memcmp(mapped.data + headStart, headerStart, 8) == 0 &&
+			size_t(dataStart) + dataSize <= fileSize;
+		if(info.isMappable)
+		{
+			info.dataOffset = dataStart;
+			info.channelsInFile = naxes[1];
+			info.baselTimesPolInFile = naxes[0];
+			++mappableCount;
+		}
+	}
+	if(mappableCount == 0)
+	{
+		munmap(addr, fileSize);
+		mapped = MappedFile();
+	}
+}
+
+void GPUFileReader::unmapFiles()
+{
+	for(MappedFile &mapped : _mappedFiles)
+	{
+		if(mapped.data != nullptr)
+			munmap(const_cast<char*>(mapped.data), mapped.size);
+	}
+	_mappedFiles.clear();
+}
+
 // Check the number of HDUs in each file. Only extract the amount of time
 // that there is actually data for in all files.
 void GPUFileReader::findStopHDU()
@@ -343,6 +647,8 @@ void GPUFileReader::initMapping()
 {
 	initializePFBMapping();
 	_isConjugated.resize(_nAntenna*_nAntenna*4);
+	// Conjugation per mapped buffer, indexed as getMappedBuffer() with 4 pols
+	std::vector<bool> isMappedConjugated(_nAntenna*_nAntenna*4);
 	for(size_t a1 = 0; a1 != _nAntenna; ++a1) {
 		for(size_t a2 = a1; a2 != _nAntenna; ++a2) {
 			for(size_t p1 = 0; p1 != 2; ++p1) {
@@ -366,6 +672,7 @@ void GPUFileReader::initMapping()
 						(actualOut1 < actualOut2 && sourceIndex1 < sourceIndex2) ||
 						(actualOut1 > actualOut2 && sourceIndex1 > sourceIndex2);
 					
+					isMappedConjugated[(_nAntenna*a1 + a2)*4 + p1 * 2 + p2] = isConjugated;
 					if(actA1 <= actA2)
 					{
 						size_t conjIndex = (actA1 * 2 + actP1) * _nAntenna * 2 + (actA2 * 2 + actP2);
@@ -382,6 +689,21 @@ void GPUFileReader::initMapping()
 			}
 		}
 	}
+	
+	// Store the destination of each correlation, in the order of the GPU files
+	_shuffleDestinations.resize((_nAntenna + 1) * _nAntenna / 2);
+	size_t correlationIndex = 0;
+	for(size_t antenna1=0; antenna1!=_nAntenna; ++antenna1)
+	{
+		for(size_t antenna2=0; antenna2<=antenna1; ++antenna2)
+		{
+			ShuffleDestination &dest = _shuffleDestinations[correlationIndex];
+			dest.buffer = &getMappedBuffer(antenna2, antenna1);
+			for(size_t p=0; p!=4; ++p)
+				dest.imagSign[p] = isMappedConjugated[(_nAntenna*antenna2 + antenna1)*4 + p] ? -1.0f : 1.0f;
+			++correlationIndex;
+		}
+	}
 }
 
 void GPUFileReader::initializePFBMapping()
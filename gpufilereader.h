@@ -1,8 +1,10 @@
 #include "baselinebuffer.h"
 #include "fitsuser.h"
 #include "lane.h"
+#include "threadpool.h"
 
 #include <functional>
+#include <mutex>
 #include <string>
 #include <vector>
 #include <ctime>
@@ -31,14 +33,17 @@
  * is the index that is moving fastest.
  * station2 is the non-conjugated station within a baseline.
  * 
+ * While reading, the visibilities are transposed into the destination buffers,
+ * and conjugated where necessary. Hence, the data in the destination buffers
+ * need no further conjugation.
+ * 
  * @author André Offringa
  */
 class GPUFileReader : private FitsUser
 {
 	public:
-		GPUFileReader(size_t nAntenna, size_t nChannelsInTotal, size_t threadCount, bool offlineFormat) :
-			_shuffleTasks(threadCount),
-			_availableGPUMatrixBuffers(threadCount),
+		GPUFileReader(size_t nAntenna, size_t nChannelsInTotal, ThreadPool& threadPool, bool offlineFormat) :
+			_availableGPUMatrixBuffers(threadPool.ThreadCount()),
 			_isOpen(false),
 			_nAntenna(nAntenna),
 			_nChannelsInTotal(nChannelsInTotal),
@@ -47,10 +52,14 @@ class GPUFileReader : private FitsUser
 			_stopHDU(0),
 			_startTime(0),
 			_hasStartTime(false),
-			_threadCount(threadCount),
+			_threadPool(threadPool),
+			_threadCount(threadPool.ThreadCount()),
 			_integrationTime(0.0),
 			_doAlign(true),
-			_offlineFormat(offlineFormat)
+			_offlineFormat(offlineFormat),
+			_showProgress(true),
+			_asyncReadAhead(0),
+			_useMMap(true)
 		{ }
 		~GPUFileReader() { closeFiles(); }
 		
@@ -87,6 +96,10 @@ class GPUFileReader : private FitsUser
 		}
 		
 		bool Read(size_t &bufferPos, size_t bufferLength);
+		/**
+		 * Whether the given correlation is conjugated in the GPU files. This conjugation
+		 * is already corrected for in the data returned by Read().
+		 */
 		bool IsConjugated(size_t ant1, size_t ant2, size_t pol1, size_t pol2) const
 		{
 			return _isConjugated[(ant1 * 2 + pol1) * _nAntenna * 2 + (ant2 * 2 + pol2)];
@@ -94,31 +107,83 @@ class GPUFileReader : private FitsUser
 		std::time_t StartTime() const { return _startTime; }
 		bool HasStartTime() const { return _hasStartTime; }
 		
+		void SetShowProgress(bool showProgress) { _showProgress = showProgress; }
+		/**
+		 * When set to a non-zero value, each file is read by its own I/O thread, and
+		 * each of those threads can read up to this many HDUs ahead of the shuffling.
+		 * Zero means all files are read sequentially by a single thread.
+		 */
+		void SetAsyncReadAhead(size_t hduCount) { _asyncReadAhead = hduCount; }
+		/**
+		 * When enabled (the default), files with plain, uncompressed float image HDUs are
+		 * memory mapped, and the shuffling reads the big-endian data directly from the
+		 * mapped pages. Other files are read with cfitsio.
+		 */
+		void SetUseMMap(bool useMMap) { _useMMap = useMMap; }
+		
 		void SetHDUOffsetsChangeCallback(std::function<void(const std::vector<int>&)> onHDUOffsetsChange)
 		{
 			_onHDUOffsetsChange = onHDUOffsetsChange;
 		}
 	private:
+		//! Max nr of consecutive timesteps of one file that are shuffled at once
+		static const size_t MaxTimestepsPerTask = 4;
 		struct ShuffleTask
 		{
 			size_t iFile, channelsInFile, fileBufferPos;
+			//! Number of consecutive timesteps, starting at fileBufferPos, in this task
+			size_t timestepCount;
+			//! Buffer from _availableGPUMatrixBuffers (holding one timestep), or null when the data are memory mapped
 			std::complex<float> *gpuMatrix;
+			//! Big-endian data inside a memory mapped file, for each timestep; used when gpuMatrix is null
+			const float *mappedData[MaxTimestepsPerTask];
+		};
+		/**
+		 * Destination of a correlation in the GPU files: the buffer to which it is
+		 * written, and the sign of its imaginary values per polarization,
+		 * which is negative when it is conjugated.
+		 */
+		struct ShuffleDestination
+		{
+			BaselineBuffer *buffer;
+			float imagSign[4];
+		};
+		/**
+		 * A gpubox file that is memory mapped. For each HDU, the offset to its
+		 * data and its dimensions are determined when opening the file, so that
+		 * reading does not need cfitsio.
+		 */
+		struct MappedFile
+		{
+			MappedFile() : data(nullptr), size(0) { }
+			const char *data;
+			size_t size;
+			struct HDU
+			{
+				//! False if this HDU is not a plain float image and needs to be read with cfitsio
+				bool isMappable;
+				size_t dataOffset, channelsInFile, baselTimesPolInFile;
+			};
+			std::vector<HDU> hdus;
 		};
-		ao::lane<ShuffleTask> _shuffleTasks;
 		ao::lane<std::complex<float> *> _availableGPUMatrixBuffers;
 		
 		const static int single_pfb_output_to_input[64];
 		std::vector<int> pfb_output_to_input;
 		
-		GPUFileReader(const GPUFileReader &) : _shuffleTasks(0), _availableGPUMatrixBuffers(0) { }
+		GPUFileReader(const GPUFileReader &source) : _availableGPUMatrixBuffers(0), _threadPool(source._threadPool) { }
 		void operator=(const GPUFileReader &) { }
 		void openFiles();
 		void closeFiles();
 		void findStopHDU();
 		void initMapping();
 		void initializePFBMapping();
-		void shuffleThreadFunc();
-		void shuffleBuffer(size_t iFile, size_t channelsInFile, size_t fileBufferPos, const std::complex<float> *gpuMatrix);
+		void readFile(size_t iFile, size_t bufferPos, size_t bufferLength, class ProgressBar* progressBar, ThreadPool::TaskGroup& shuffleGroup, size_t& endingBufferPos, bool& moreAvailable);
+		void runShuffleTask(const ShuffleTask& task);
+		template<bool IsBigEndian>
+		void shuffleBuffer(size_t iFile, size_t channelsInFile, size_t fileBufferPos, const float* const* timestepData, size_t timestepCount);
+		void mapFile(size_t iFile);
+		void unmapFiles();
 		BaselineBuffer &getBuffer(size_t antenna1, size_t antenna2)
 		{
 			return _buffers[_nAntenna*antenna1 + antenna2];
@@ -133,16 +198,24 @@ class GPUFileReader : private FitsUser
 		std::vector<std::string> _filenames;
 		std::vector<size_t> _fitsHDUCounts;
 		std::vector<fitsfile *> _fitsFiles;
+		std::vector<MappedFile> _mappedFiles;
 		
 		std::vector<BaselineBuffer> _buffers;
 		std::vector<BaselineBuffer> _mappedBuffers;
+		//! Indexed by the correlation index in the GPU files
+		std::vector<ShuffleDestination> _shuffleDestinations;
 		std::vector<size_t> _corrInputToOutput;
 		std::vector<bool> _isConjugated;
 		std::time_t _startTime;
 		bool _hasStartTime;
+		ThreadPool& _threadPool;
+		//! Number of shuffle tasks that may run at the same time
 		size_t _threadCount;
 		std::vector<int> _hduOffsetsPerFile;
 		double _integrationTime;
-		bool _doAlign, _offlineFormat;
+		bool _doAlign, _offlineFormat, _showProgress;
+		size_t _asyncReadAhead;
+		bool _useMMap;
+		std::mutex _progressMutex;
 		std::function<void(const std::vector<int>&)> _onHDUOffsetsChange;
 };
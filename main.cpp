@@ -73,11 +73,30 @@ void usage()
 	"  -mem <percentage>  Use at most the given percentage of memory.\n"
 	"  -absmem <gb>       Use at most the given amount of memory, specified in gigabytes.\n"
 	"  -j <ncpus>         Number of CPUs to use. Default is to use all.\n"
+	"  -affinity          Bind each worker thread to a CPU.\n"
+	"  -asyncread <n>     Read each GPU box file with its own I/O thread, reading up to n HDUs ahead per file.\n"
+	"                     Requires a thread-safe cfitsio library. Default is 0, i.e. read all files sequentially.\n"
+	"  -nommap            Always read GPU box files through cfitsio, instead of memory mapping them.\n"
+	"  -writequeue <mb>   Max amount of rows, in megabytes, that is queued for each writer thread. Default is 256.\n"
 	"  -timeres <s>       Average nr of sec of timesteps together before writing to measurement set.\n"
 	"  -freqres <kHz>     Average kHz bandwidth of channels together before writing to measurement set.\n"
 	"                     When averaging: flagging, collecting statistics and cable length fixes are done\n"
 	"                     at highest resolution. UVW positions are recalculated for new timesteps.\n"
+	"  -extra-output <file> <timeres> <freqres>\n"
+	"                     Also write the data to the given file, averaged to the given time (s) and frequency\n"
+	"                     (kHz) resolution, where 0 means no averaging. Can be given several times.\n"
+	"  -bda <deg>         Baseline-dependent averaging: average short baselines over more timesteps, as\n"
+	"                     long as time smearing within the given field radius stays below the limit.\n"
+	"                     Frequency averaging is not baseline dependent.\n"
+	"  -bda-smearing <f>  Max fraction of amplitude lost by baseline-dependent averaging. Default is 0.01.\n"
+	"  -bda-maxavg <n>    Max time averaging of short baselines, as multiple of the time resolution.\n"
+	"                     Default is 8. Multiples are powers of two.\n"
 	"  -norfi             Disable RFI detection.\n"
+	"  -streamblock <n>   Without RFI detection, stream the data in blocks of at most n timesteps\n"
+	"                     (default: 8).\n"
+	"  -nooverlap         When the observation does not fit in memory, do not read the next chunk while\n"
+	"                     processing the current one. This makes chunks twice as large, which improves\n"
+	"                     flagging accuracy, but is slower.\n"
 	"  -nostats           Disable collecting statistics (default for uvfits file output).\n"
 	"  -nogeom            Disable geometric corrections.\n"
 	"  -noalign           Do not align GPU boxes according to the time in their header.\n"
@@ -91,6 +110,9 @@ void usage()
 	"  -noflagdcchannels  Do not flag the centre channel of each sub-band.\n"
 	"  -centre <ra> <dec> Set alternative phase centre, e.g. -centre 00h00m00.0s 00d00m00.0s.\n"
 	"  -usepcentre        Centre on pointing centre.\n"
+	"  -extra-centre <ra> <dec> <file>\n"
+	"                     Also write the data phased towards the given direction to the given file, which\n"
+	"                     is in the same format as the main output. Can be given several times.\n"
 	"  -sbcount <count>   Read/processes the first given number of sub-bands.\n"
 	"  -sbstart <number>  Number of first GPU box. Default: 1.\n"
 	"  -sbpassband <file> Read the sub-band passband from given file instead of using default passband.\n"
@@ -115,6 +137,15 @@ void usage()
 	"  -use-dysco         Compress the Measurement Set using Dysco.\n"
 	"  -dysco-config <data bits> <weight bits> <distribution> <truncation> <normalization>\n"
 	"                     Set advanced Dysco options.\n"
+	"  -tilesize <kb>     Store DATA, FLAG and WEIGHT_SPECTRUM in tiles of about the given size. Tiles span\n"
+	"                     all channels and a whole number of tiles fits in a timestep, or vice versa.\n"
+	"  -tileshape <nchan>,<nrows>\n"
+	"                     Store DATA, FLAG and WEIGHT_SPECTRUM in tiles of the given shape.\n"
+	"  -shards <n>        Divide the subbands over n output files, which are written in parallel.\n"
+	"                     Their names are the output name followed by the range of coarse channel numbers.\n"
+	"                     When run with MPI, each node writes its own subbands to such files.\n"
+	"  -multims           With -shards or MPI, join the measurement sets into a multi-MS with the output\n"
+	"                     name. Each part then lists the spectral windows of all parts.\n"
 	"  -version           Output version and exit.\n"
 	"\n"
 	"The filenames of the input gpu files should end in '...nn_mm.fits', where nn >= 1 is the\n"
@@ -246,6 +277,24 @@ int cotterMain(int argc, const char* const* argv)
 				++argi;
 				nCPUs = atoi(argv[argi]);
 			}
+			else if(param == "affinity")
+			{
+				cotter.SetThreadAffinity(true);
+			}
+			else if(param == "nommap")
+			{
+				cotter.SetUseMMap(false);
+			}
+			else if(param == "writequeue")
+			{
+				++argi;
+				cotter.SetWriteQueueSize(atof(argv[argi]) * 1024.0 * 1024.0);
+			}
+			else if(param == "asyncread")
+			{
+				++argi;
+				cotter.SetAsyncReadAhead(atoi(argv[argi]));
+			}
 			else if(param == "mem")
 			{
 				++argi;
@@ -264,6 +313,15 @@ int cotterMain(int argc, const char* const* argv)
 			{
 				cotter.SetRFIDetection(false);
 			}
+			else if(param == "nooverlap")
+			{
+				cotter.SetOverlapChunks(false);
+			}
+			else if(param == "streamblock")
+			{
+				++argi;
+				cotter.SetStreamingBlockSize(atoi(argv[argi]));
+			}
 			else if(param == "nostats")
 			{
 				cotter.SetCollectStatistics(false);
@@ -322,6 +380,29 @@ int cotterMain(int argc, const char* const* argv)
 				++argi;
 				freqRes = atof(argv[argi]);
 			}
+			else if(param == "extra-output")
+			{
+				const std::string filename = argv[argi+1];
+				if(isMWAFlagFile(filename))
+					throw std::runtime_error("An extra output can not be a flag file");
+				cotter.AddExtraOutput(filename, isFitsFile(filename) ? Cotter::FitsOutputFormat : Cotter::MSOutputFormat, atof(argv[argi+2]), atof(argv[argi+3]));
+				argi += 3;
+			}
+			else if(param == "bda")
+			{
+				++argi;
+				cotter.SetBDAFieldRadius(atof(argv[argi]));
+			}
+			else if(param == "bda-smearing")
+			{
+				++argi;
+				cotter.SetBDAMaxSmearing(atof(argv[argi]));
+			}
+			else if(param == "bda-maxavg")
+			{
+				++argi;
+				cotter.SetBDAMaxTimeAvg(atoi(argv[argi]));
+			}
 			else if(param == "centre")
 			{
 				++argi;
@@ -330,6 +411,13 @@ int cotterMain(int argc, const char* const* argv)
 				long double centreDec = RaDecCoord::ParseDec(argv[argi]);
 				cotter.SetOverridePhaseCentre(centreRA, centreDec);
 			}
+			else if(param == "extra-centre")
+			{
+				long double centreRA = RaDecCoord::ParseRA(argv[argi+1]);
+				long double centreDec = RaDecCoord::ParseDec(argv[argi+2]);
+				cotter.AddPhaseCentre(centreRA, centreDec, argv[argi+3]);
+				argi += 3;
+			}
 			else if(param == "usepcentre")
 			{
 				cotter.SetUsePointingCentre(true);
@@ -429,6 +517,29 @@ int cotterMain(int argc, const char* const* argv)
 			{
 				cotter.SetUseDysco(true);
 			}
+			else if(param == "shards")
+			{
+				++argi;
+				cotter.SetShardCount(atoi(argv[argi]));
+			}
+			else if(param == "multims")
+			{
+				cotter.SetWriteMultiMS(true);
+			}
+			else if(param == "tilesize")
+			{
+				++argi;
+				cotter.SetTileSize(atoi(argv[argi]));
+			}
+			else if(param == "tileshape")
+			{
+				++argi;
+				std::string shapeStr(argv[argi]);
+				size_t commaPos = shapeStr.find(',');
+				if(commaPos == std::string::npos)
+					throw std::runtime_error("Tile shape should be given as <nchan>,<nrows>");
+				cotter.SetTileShape(atoi(shapeStr.substr(0, commaPos).c_str()), atoi(shapeStr.substr(commaPos+1).c_str()));
+			}
 			else if(param == "dysco-config")
 			{
 				cotter.SetAdvancedDyscoOptions(atoi(argv[argi+1]), atoi(argv[argi+2]), argv[argi+3], atof(argv[argi+4]), argv[argi+5]);
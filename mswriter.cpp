@@ -3,18 +3,25 @@
 #include <casacore/ms/MeasurementSets/MeasurementSet.h>
 
 #include <casacore/tables/DataMan/DataManager.h>
+#include <casacore/tables/DataMan/TiledColumnStMan.h>
 #include <casacore/tables/Tables/ArrayColumn.h>
 #include <casacore/tables/Tables/ArrColDesc.h>
 #include <casacore/tables/Tables/ScalarColumn.h>
 #include <casacore/tables/Tables/SetupNewTab.h>
 #include <casacore/tables/Tables/TableRecord.h>
 
+#include <casacore/casa/Arrays/Slicer.h>
+#include <casacore/casa/Containers/Block.h>
+
 #include <casacore/casa/Containers/Record.h>
 
 #include <casacore/measures/TableMeasures/TableMeasDesc.h>
 
 #include <casacore/measures/Measures/MFrequency.h>
 
+#include <algorithm>
+#include <iostream>
+
 using namespace casacore;
 
 class MSWriterData
@@ -33,6 +40,16 @@ class MSWriterData
 		ArrayColumn<float> _sigmaCol;
 		ArrayColumn<float> _weightCol;
 		ArrayColumn<float> _weightSpectrumCol;
+		
+		// Buffers for writing a batch of rows with one put per column. These are kept
+		// between batches, because all batches normally have the same size.
+		Vector<double> _timeBuffer, _timeCentroidBuffer, _intervalBuffer;
+		Vector<int> _antenna1Buffer, _antenna2Buffer;
+		Vector<int> _dataDescIdBuffer, _processorIdBuffer, _scanNumberBuffer, _stateIdBuffer;
+		Array<double> _uvwBuffer;
+		Array<std::complex<float>> _dataBuffer;
+		Array<bool> _flagBuffer;
+		Array<float> _sigmaBuffer, _weightBuffer, _weightSpectrumBuffer;
 
 		size_t _dyscoDataBitRate, _dyscoWeightBitRate;
 		std::string _dyscoDistribution, _dyscoNormalization;
@@ -40,6 +57,7 @@ class MSWriterData
 		
 		MSWriterData() = default;
 		void GetDyscoSpec(casacore::Record& record) const;
+		void ResizeBuffers(size_t nRows, size_t nChannels);
 		
 private:
 	MSWriterData(const MSWriterData&) = delete;
@@ -51,7 +69,12 @@ MSWriter::MSWriter(const std::string& filename) :
 	_isInitialized(false),
 	_rowIndex(0),
 	_filename(filename),
-	_useDysco(false)
+	_useDysco(false),
+	_useTiling(false),
+	_tileChannels(0),
+	_tileRows(0),
+	_tileSizeKB(0),
+	_rowsPerTimestep(0)
 {
 }
 
@@ -72,11 +95,98 @@ void MSWriter::EnableCompression(size_t dataBitRate, size_t weightBitRate, const
 	_data->_dyscoDistTruncation = distTruncation;
 }
 
+void MSWriter::EnableTiling(size_t tileChannels, size_t tileRows, size_t tileSizeKB)
+{
+	_useTiling = true;
+	_tileChannels = tileChannels;
+	_tileRows = tileRows;
+	_tileSizeKB = tileSizeKB;
+}
+
+void MSWriter::WriteMultiMS(const std::string& filename, const std::vector<std::string>& partFilenames)
+{
+	std::vector<BandInfo> bands;
+	for(const std::string& partFilename : partFilenames)
+	{
+		MeasurementSet ms(partFilename);
+		if(ms.spectralWindow().nrow() != 1 || ms.dataDescription().nrow() != 1)
+			throw std::runtime_error("Measurement set " + partFilename + " can not be made part of a multi-MS, because it does not have exactly one band");
+		bands.emplace_back(readSpectralWindow(ms, 0));
+		if(bands.back().channels.size() != bands.front().channels.size())
+			throw std::runtime_error("The parts of a multi-MS should have the same number of channels");
+	}
+	
+	Block<Table> parts(partFilenames.size());
+	for(size_t i=0; i!=partFilenames.size(); ++i)
+	{
+		MeasurementSet ms(partFilenames[i], Table::Update);
+		MSSpectralWindow spwTable = ms.spectralWindow();
+		spwTable.removeRow(0);
+		MSDataDescription dataDescTable = ms.dataDescription();
+		dataDescTable.removeRow(0);
+		for(const BandInfo& band : bands)
+			writeSpectralWindow(ms, band);
+		ScalarColumn<int>(ms, MS::columnName(casacore::MSMainEnums::DATA_DESC_ID)).fillColumn(i);
+		ms.flush();
+		parts[i] = ms;
+	}
+	
+	// Subtables of the reference table are those of the first part
+	Table concatTable(parts);
+	concatTable.rename(filename, Table::New);
+}
+
+void MSWriter::getTileShape(size_t& tileChannels, size_t& tileRows) const
+{
+	const size_t nChannels = _bandInfo.channels.size();
+	if(_tileChannels != 0 && _tileRows != 0)
+	{
+		tileChannels = std::min(_tileChannels, nChannels);
+		tileRows = _tileRows;
+		return;
+	}
+	
+	// Tiles span all channels, because readers normally read all channels of a row.
+	const size_t rowSize = 4 * nChannels * sizeof(std::complex<float>);
+	tileChannels = nChannels;
+	tileRows = std::max<size_t>(1, _tileSizeKB * 1024 / rowSize);
+	if(_rowsPerTimestep != 0)
+	{
+		if(tileRows >= _rowsPerTimestep)
+		{
+			// Use a whole number of timesteps per tile
+			tileRows = (tileRows / _rowsPerTimestep) * _rowsPerTimestep;
+		}
+		else {
+			// Divide a timestep in equally sized tiles
+			const size_t tilesPerTimestep = (_rowsPerTimestep + tileRows - 1) / tileRows;
+			tileRows = (_rowsPerTimestep + tilesPerTimestep - 1) / tilesPerTimestep;
+		}
+	}
+}
+
 void MSWriter::initialize()
 {
 	_isInitialized = true;
 	
 	TableDesc tableDesc = MS::requiredTableDesc();
+	casacore::IPosition dataShape(2, 4, _bandInfo.channels.size());
+	
+	// The FLAG column is a required column, hence its storage manager
+	// needs to be set up before the table is created
+	std::unique_ptr<TiledColumnStMan> tiledFlagStMan;
+	IPosition tileShape;
+	if(_useTiling)
+	{
+		size_t tileChannels, tileRows;
+		getTileShape(tileChannels, tileRows);
+		tileShape = IPosition(3, 4, tileChannels, tileRows);
+		std::cout << "Using tiles of " << tileChannels << " channels x " << tileRows << " rows.\n";
+		ColumnDesc& flagColumnDesc = tableDesc.rwColumnDesc(MS::columnName(casacore::MSMainEnums::FLAG));
+		flagColumnDesc.setShape(dataShape);
+		flagColumnDesc.setOptions(ColumnDesc::FixedShape);
+		tiledFlagStMan.reset(new TiledColumnStMan("TiledFlag", tileShape));
+	}
 	
 	DataManagerCtor dyscoConstructor = 0;
 	Record dyscoSpec;
@@ -86,12 +196,13 @@ void MSWriter::initialize()
 	}
 	
 	SetupNewTable newTab(_filename, tableDesc, Table::New);
+	if(tiledFlagStMan)
+		newTab.bindColumn(MS::columnName(casacore::MSMainEnums::FLAG), *tiledFlagStMan);
 	_data->_ms = MeasurementSet(newTab);
 	MeasurementSet &ms = _data->_ms;
 	ms.createDefaultSubtables(Table::New);
 	
 	ArrayColumnDesc<std::complex<float> > dataColumnDesc = ArrayColumnDesc<std::complex<float> >(MS::columnName(casacore::MSMainEnums::DATA));
-	casacore::IPosition dataShape(2, 4, _bandInfo.channels.size());
 	if (_useDysco && _data->_dyscoDataBitRate != 0) {
 		dataColumnDesc.setShape(dataShape);
 		dataColumnDesc.setOptions(ColumnDesc::Direct | ColumnDesc::FixedShape);
@@ -100,6 +211,12 @@ void MSWriter::initialize()
 		std::unique_ptr<DataManager> dyscoStMan(dyscoConstructor("DyscoData", dyscoSpec));
 		ms.addColumn(dataColumnDesc, *dyscoStMan);
 	}
+	else if(_useTiling) {
+		dataColumnDesc.setShape(dataShape);
+		dataColumnDesc.setOptions(ColumnDesc::FixedShape);
+		TiledColumnStMan tiledStMan("TiledData", tileShape);
+		ms.addColumn(dataColumnDesc, tiledStMan);
+	}
 	else {
 		dataColumnDesc.setShape(dataShape);
 		dataColumnDesc.setOptions(ColumnDesc::FixedShape);
@@ -113,6 +230,12 @@ void MSWriter::initialize()
 		std::unique_ptr<DataManager> dyscoStMan(dyscoConstructor("DyscoWeight", dyscoSpec));
 		ms.addColumn(weightSpectrumColumnDesc, *dyscoStMan);
 	}
+	else if(_useTiling) {
+		weightSpectrumColumnDesc.setShape(dataShape);
+		weightSpectrumColumnDesc.setOptions(ColumnDesc::FixedShape);
+		TiledColumnStMan tiledStMan("TiledWeightSpectrum", tileShape);
+		ms.addColumn(weightSpectrumColumnDesc, tiledStMan);
+	}
 	else {
 		weightSpectrumColumnDesc.setShape(dataShape);
 		weightSpectrumColumnDesc.setOptions(ColumnDesc::FixedShape);
@@ -221,7 +344,11 @@ void MSWriter::WriteHistoryItem(const std::string &commandLine, const std::strin
 
 void MSWriter::writeBandInfo()
 {
-	MeasurementSet &ms = _data->_ms;
+	writeSpectralWindow(_data->_ms, _bandInfo);
+}
+
+void MSWriter::writeSpectralWindow(MeasurementSet& ms, const BandInfo& band)
+{
 	MSSpectralWindow spwTable = ms.spectralWindow();
 	
 	ScalarColumn<int> numChanCol = ScalarColumn<int>(spwTable, spwTable.columnName(MSSpectralWindowEnums::NUM_CHAN));
@@ -236,22 +363,22 @@ void MSWriter::writeBandInfo()
 	ScalarColumn<double> totalBWCol = ScalarColumn<double>(spwTable, spwTable.columnName(MSSpectralWindowEnums::TOTAL_BANDWIDTH));
 	ScalarColumn<bool> flagRowCol = ScalarColumn<bool>(spwTable, spwTable.columnName(MSSpectralWindowEnums::FLAG_ROW));
 
-	const size_t nChannels = _bandInfo.channels.size();
+	const size_t nChannels = band.channels.size();
 	size_t rowIndex = spwTable.nrow();
 	spwTable.addRow();
 	numChanCol.put(rowIndex, nChannels);
-	nameCol.put(rowIndex, _bandInfo.name);
-	refFreqCol.put(rowIndex, _bandInfo.refFreq);
+	nameCol.put(rowIndex, band.name);
+	refFreqCol.put(rowIndex, band.refFreq);
 	
 	casacore::Vector<double>
 		chanFreqVec(nChannels), chanWidthVec(nChannels),
 		effectiveBWVec(nChannels), resolutionVec(nChannels);
-	for(size_t ch=0; ch!=_bandInfo.channels.size(); ++ch)
+	for(size_t ch=0; ch!=nChannels; ++ch)
 	{
-		chanFreqVec[ch] = _bandInfo.channels[ch].chanFreq;
-		chanWidthVec[ch] = _bandInfo.channels[ch].chanWidth;
-		effectiveBWVec[ch] = _bandInfo.channels[ch].effectiveBW;
-		resolutionVec[ch] = _bandInfo.channels[ch].resolution;
+		chanFreqVec[ch] = band.channels[ch].chanFreq;
+		chanWidthVec[ch] = band.channels[ch].chanWidth;
+		effectiveBWVec[ch] = band.channels[ch].effectiveBW;
+		resolutionVec[ch] = band.channels[ch].resolution;
 	}
 	chanFreqCol.put(rowIndex, chanFreqVec);
 	chanWidthCol.put(rowIndex, chanWidthVec);
@@ -259,10 +386,42 @@ void MSWriter::writeBandInfo()
 	effectiveBWCol.put(rowIndex, effectiveBWVec);
 	resolutionCol.put(rowIndex, resolutionVec);
 	
-	totalBWCol.put(rowIndex, _bandInfo.totalBandwidth);
-	flagRowCol.put(rowIndex, _bandInfo.flagRow);
+	totalBWCol.put(rowIndex, band.totalBandwidth);
+	flagRowCol.put(rowIndex, band.flagRow);
 	
-	writeDataDescEntry(rowIndex, 0, false);
+	writeDataDescEntry(ms, rowIndex, 0, false);
+}
+
+MSWriter::BandInfo MSWriter::readSpectralWindow(MeasurementSet& ms, size_t rowIndex)
+{
+	MSSpectralWindow spwTable = ms.spectralWindow();
+	
+	ScalarColumn<casacore::String> nameCol = ScalarColumn<casacore::String>(spwTable, spwTable.columnName(MSSpectralWindowEnums::NAME));
+	ScalarColumn<double> refFreqCol = ScalarColumn<double>(spwTable, spwTable.columnName(MSSpectralWindowEnums::REF_FREQUENCY));
+	ArrayColumn<double> chanFreqCol = ArrayColumn<double>(spwTable, spwTable.columnName(MSSpectralWindowEnums::CHAN_FREQ));
+	ArrayColumn<double> chanWidthCol = ArrayColumn<double>(spwTable, spwTable.columnName(MSSpectralWindowEnums::CHAN_WIDTH));
+	ArrayColumn<double> effectiveBWCol = ArrayColumn<double>(spwTable, spwTable.columnName(MSSpectralWindowEnums::EFFECTIVE_BW));
+	ArrayColumn<double> resolutionCol = ArrayColumn<double>(spwTable, spwTable.columnName(MSSpectralWindowEnums::RESOLUTION));
+	ScalarColumn<double> totalBWCol = ScalarColumn<double>(spwTable, spwTable.columnName(MSSpectralWindowEnums::TOTAL_BANDWIDTH));
+	ScalarColumn<bool> flagRowCol = ScalarColumn<bool>(spwTable, spwTable.columnName(MSSpectralWindowEnums::FLAG_ROW));
+	
+	BandInfo band;
+	band.name = nameCol(rowIndex);
+	band.refFreq = refFreqCol(rowIndex);
+	const casacore::Vector<double>
+		chanFreqVec = chanFreqCol(rowIndex), chanWidthVec = chanWidthCol(rowIndex),
+		effectiveBWVec = effectiveBWCol(rowIndex), resolutionVec = resolutionCol(rowIndex);
+	band.channels.resize(chanFreqVec.size());
+	for(size_t ch=0; ch!=band.channels.size(); ++ch)
+	{
+		band.channels[ch].chanFreq = chanFreqVec[ch];
+		band.channels[ch].chanWidth = chanWidthVec[ch];
+		band.channels[ch].effectiveBW = effectiveBWVec[ch];
+		band.channels[ch].resolution = resolutionVec[ch];
+	}
+	band.totalBandwidth = totalBWCol(rowIndex);
+	band.flagRow = flagRowCol(rowIndex);
+	return band;
 }
 
 void MSWriter::writeAntennae()
@@ -393,9 +552,8 @@ void MSWriter::writeField()
 	flagRowCol.put(index, _field.flagRow);
 }
 
-void MSWriter::writeDataDescEntry(size_t spectralWindowId, size_t polarizationId, bool flagRow)
+void MSWriter::writeDataDescEntry(MeasurementSet& ms, size_t spectralWindowId, size_t polarizationId, bool flagRow)
 {
-	MeasurementSet &ms = _data->_ms;
 	MSDataDescription dataDescTable = ms.dataDescription();
 	ScalarColumn<int> spectWindowIdCol(dataDescTable, dataDescTable.columnName(MSDataDescriptionEnums::SPECTRAL_WINDOW_ID));
 	ScalarColumn<int> polIdCol(dataDescTable, dataDescTable.columnName(MSDataDescriptionEnums::POLARIZATION_ID));
@@ -491,11 +649,120 @@ void MSWriter::writeObservation()
 void MSWriter::AddRows(size_t count)
 {
 	if(!_isInitialized)
+	{
+		// Rows are added per timestep, which sets the default tile shape
+		_rowsPerTimestep = count;
 		initialize();
+	}
 	_data->_ms.addRow(count);
 }
 
-void MSWriter::WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights)
+void MSWriterData::ResizeBuffers(size_t nRows, size_t nChannels)
+{
+	const size_t nPol = 4;
+	const IPosition dataShape(3, nPol, nChannels, nRows);
+	if(_timeBuffer.size() == nRows && _dataBuffer.shape().isEqual(dataShape))
+		return;
+	
+	_timeBuffer.resize(nRows);
+	_timeCentroidBuffer.resize(nRows);
+	_intervalBuffer.resize(nRows);
+	_antenna1Buffer.resize(nRows);
+	_antenna2Buffer.resize(nRows);
+	_uvwBuffer.resize(IPosition(2, 3, nRows));
+	_dataBuffer.resize(dataShape);
+	_flagBuffer.resize(dataShape);
+	_weightSpectrumBuffer.resize(dataShape);
+	_weightBuffer.resize(IPosition(2, nPol, nRows));
+	
+	// Columns that have the same value for every row
+	_dataDescIdBuffer.resize(nRows);
+	_dataDescIdBuffer = 0;
+	_processorIdBuffer.resize(nRows);
+	_processorIdBuffer = -1;
+	_scanNumberBuffer.resize(nRows);
+	_scanNumberBuffer = 1;
+	_stateIdBuffer.resize(nRows);
+	_stateIdBuffer = -1;
+	_sigmaBuffer.resize(IPosition(2, nPol, nRows));
+	_sigmaBuffer = 1.0;
+}
+
+void MSWriter::WriteRows(const RowBatch& batch)
+{
+	const size_t nRows = batch.rowCount;
+	if(nRows == 0)
+		return;
+	const size_t
+		nPol = 4,
+		nChannels = _bandInfo.channels.size(),
+		valCount = nChannels * nPol;
+	_data->ResizeBuffers(nRows, nChannels);
+	
+	double *uvwPtr = _data->_uvwBuffer.data();
+	for(size_t row=0; row!=nRows; ++row)
+	{
+		_data->_timeBuffer[row] = batch.times[row];
+		_data->_timeCentroidBuffer[row] = batch.timeCentroids[row];
+		_data->_intervalBuffer[row] = batch.intervals[row];
+		_data->_antenna1Buffer[row] = batch.antenna1[row];
+		_data->_antenna2Buffer[row] = batch.antenna2[row];
+		uvwPtr[row*3] = batch.u[row];
+		uvwPtr[row*3 + 1] = batch.v[row];
+		uvwPtr[row*3 + 2] = batch.w[row];
+	}
+	
+	// The batch has the same layout as the casa arrays: polarization, channel, row
+	if(batch.rowStride == valCount)
+	{
+		std::copy(batch.data, batch.data + nRows*valCount, _data->_dataBuffer.data());
+		std::copy(batch.flags, batch.flags + nRows*valCount, _data->_flagBuffer.data());
+	}
+	else {
+		for(size_t row=0; row!=nRows; ++row)
+		{
+			std::copy_n(batch.Data(row), valCount, _data->_dataBuffer.data() + row*valCount);
+			std::copy_n(batch.Flags(row), valCount, _data->_flagBuffer.data() + row*valCount);
+		}
+	}
+	float *weightSpectrumPtr = _data->_weightSpectrumBuffer.data();
+	float *weightPtr = _data->_weightBuffer.data();
+	for(size_t row=0; row!=nRows; ++row)
+	{
+		const float *weights = batch.Weights(row);
+		std::copy(weights, weights + valCount, weightSpectrumPtr + row*valCount);
+		
+		float *rowWeightPtr = weightPtr + row*nPol;
+		for(size_t p=0; p!=nPol; ++p) rowWeightPtr[p] = 0.0;
+		for(size_t ch=0; ch!=nChannels; ++ch)
+		{
+			for(size_t p=0; p!=nPol; ++p)
+				rowWeightPtr[p] += weights[ch*nPol + p];
+		}
+	}
+	
+	const Slicer rowRange(IPosition(1, _rowIndex), IPosition(1, nRows));
+	_data->_timeCol.putColumnRange(rowRange, _data->_timeBuffer);
+	_data->_timeCentroidCol.putColumnRange(rowRange, _data->_timeCentroidBuffer);
+	_data->_antenna1Col.putColumnRange(rowRange, _data->_antenna1Buffer);
+	_data->_antenna2Col.putColumnRange(rowRange, _data->_antenna2Buffer);
+	_data->_dataDescIdCol.putColumnRange(rowRange, _data->_dataDescIdBuffer);
+	_data->_uvwCol.putColumnRange(rowRange, _data->_uvwBuffer);
+	_data->_intervalCol.putColumnRange(rowRange, _data->_intervalBuffer);
+	_data->_exposureCol.putColumnRange(rowRange, _data->_intervalBuffer);
+	_data->_processorIdCol.putColumnRange(rowRange, _data->_processorIdBuffer);
+	_data->_scanNumberCol.putColumnRange(rowRange, _data->_scanNumberBuffer);
+	_data->_stateIdCol.putColumnRange(rowRange, _data->_stateIdBuffer);
+	_data->_sigmaCol.putColumnRange(rowRange, _data->_sigmaBuffer);
+	_data->_dataCol.putColumnRange(rowRange, _data->_dataBuffer);
+	_data->_flagCol.putColumnRange(rowRange, _data->_flagBuffer);
+	_data->_weightCol.putColumnRange(rowRange, _data->_weightBuffer);
+	_data->_weightSpectrumCol.putColumnRange(rowRange, _data->_weightSpectrumBuffer);
+	
+	_rowIndex += nRows;
+}
+
+void MSWriter::writeRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights)
 {
 	_data->_timeCol.put(_rowIndex, time);
 	_data->_timeCentroidCol.put(_rowIndex, timeCentroid);
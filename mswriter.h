@@ -7,6 +7,10 @@
 #include <vector>
 #include <string>
 
+namespace casacore {
+	class MeasurementSet;
+}
+
 class MSWriter : public Writer
 {
 	public:
@@ -15,6 +19,36 @@ class MSWriter : public Writer
 		
 		void EnableCompression(size_t dataBitRate, size_t weightBitRate, const std::string& distribution, double distTruncation, const std::string& normalization);
 		
+		/**
+		 * Store the DATA, FLAG and WEIGHT_SPECTRUM columns with a tiled storage manager.
+		 * A tile holds all polarizations of tileChannels channels and tileRows rows.
+		 * When tileChannels or tileRows is zero, the tile covers all channels, and the
+		 * number of rows is chosen such that a DATA tile is about tileSizeKB kilobytes
+		 * and a timestep is split evenly over tiles. The number of rows in a timestep
+		 * is taken from the first call to AddRows().
+		 */
+		void EnableTiling(size_t tileChannels, size_t tileRows, size_t tileSizeKB);
+		
+		enum { DefaultTileSizeKB = 1024 };
+		
+		struct BandInfo
+		{
+			std::string name;
+			std::vector<ChannelInfo> channels;
+			double refFreq;
+			double totalBandwidth;
+			bool flagRow;
+		};
+		
+		/**
+		 * Join measurement sets that each hold one band into a multi-MS. The spectral window
+		 * and data description tables of every part are replaced by those of all parts,
+		 * and the rows of part i are changed to refer to data description i. Finally, a
+		 * reference table that concatenates the parts is written. The parts should have
+		 * the same number of channels.
+		 */
+		static void WriteMultiMS(const std::string& filename, const std::vector<std::string>& partFilenames);
+		
 		virtual void WriteBandInfo(const std::string& name, const std::vector<ChannelInfo>& channels, double refFreq, double totalBandwidth, bool flagRow) final override;
 		virtual void WriteAntennae(const std::vector<AntennaInfo>& antennae, double time) final override;
 		virtual void WritePolarizationForLinearPols(bool flagRow) final override;
@@ -24,23 +58,31 @@ class MSWriter : public Writer
 		virtual void WriteHistoryItem(const std::string &commandLine, const std::string &application, const std::vector<std::string> &params) final override;
 		
 		virtual void AddRows(size_t count) final override;
-		virtual void WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights) final override;
+		virtual void WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights) final override
+		{
+			writeRow(time, timeCentroid, antenna1, antenna2, u, v, w, interval, data, flags, weights);
+		}
+		virtual void WriteRows(const RowBatch& batch) final override;
 		
 		virtual bool CanWriteStatistics() const final override
 		{
 			return true;
 		}
 	private:
-		void writeDataDescEntry(size_t spectralWindowId, size_t polarizationId, bool flagRow);
+		void writeRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights);
 		void writePolarizationForLinearPols();
 		void writeFeedEntries();
 		void writeBandInfo();
+		static void writeSpectralWindow(casacore::MeasurementSet& ms, const BandInfo& band);
+		static BandInfo readSpectralWindow(casacore::MeasurementSet& ms, size_t rowIndex);
+		static void writeDataDescEntry(casacore::MeasurementSet& ms, size_t spectralWindowId, size_t polarizationId, bool flagRow);
 		void writeAntennae();
 		void writeSource();
 		void writeField();
 		void writeObservation();
 		void writeHistoryItem();
 		void initialize();
+		void getTileShape(size_t& tileChannels, size_t& tileRows) const;
 		
 		class MSWriterData *_data;
 		bool _isInitialized;
@@ -48,18 +90,14 @@ class MSWriter : public Writer
 		
 		std::string _filename;
 		bool _useDysco;
+		bool _useTiling;
+		size_t _tileChannels, _tileRows, _tileSizeKB, _rowsPerTimestep;
 		
 		std::vector<AntennaInfo> _antennae;
 		double _antennaDate;
 		bool _flagPolarizationRow;
 		
-		struct {
-			std::string name;
-			std::vector<ChannelInfo> channels;
-			double refFreq;
-			double totalBandwidth;
-			bool flagRow;
-		} _bandInfo;
+		BandInfo _bandInfo;
 		
 		double _arrayX, _arrayY, _arrayZ;
 		SourceInfo _source;
@@ -0,0 +1,88 @@
+#include "multiwriter.h"
+
+MultiWriter::MultiWriter(std::vector<std::unique_ptr<Writer>>&& writers) :
+	_writers(std::move(writers))
+{ }
+
+MultiWriter::~MultiWriter()
+{ }
+
+void MultiWriter::SetArrayLocation(double x, double y, double z)
+{
+	for(std::unique_ptr<Writer>& writer : _writers)
+		writer->SetArrayLocation(x, y, z);
+}
+
+void MultiWriter::SetOffsetsPerGPUBox(const std::vector<int>& offsets)
+{
+	for(std::unique_ptr<Writer>& writer : _writers)
+		writer->SetOffsetsPerGPUBox(offsets);
+}
+
+void MultiWriter::WriteBandInfo(const std::string &name, const std::vector<ChannelInfo> &channels, double refFreq, double totalBandwidth, bool flagRow)
+{
+	for(std::unique_ptr<Writer>& writer : _writers)
+		writer->WriteBandInfo(name, channels, refFreq, totalBandwidth, flagRow);
+}
+
+void MultiWriter::WriteAntennae(const std::vector<AntennaInfo> &antennae, double time)
+{
+	for(std::unique_ptr<Writer>& writer : _writers)
+		writer->WriteAntennae(antennae, time);
+}
+
+void MultiWriter::WritePolarizationForLinearPols(bool flagRow)
+{
+	for(std::unique_ptr<Writer>& writer : _writers)
+		writer->WritePolarizationForLinearPols(flagRow);
+}
+
+void MultiWriter::WriteSource(const SourceInfo& source)
+{
+	for(std::unique_ptr<Writer>& writer : _writers)
+		writer->WriteSource(source);
+}
+
+void MultiWriter::WriteField(const FieldInfo& field)
+{
+	for(std::unique_ptr<Writer>& writer : _writers)
+		writer->WriteField(field);
+}
+
+void MultiWriter::WriteObservation(const ObservationInfo& observation)
+{
+	for(std::unique_ptr<Writer>& writer : _writers)
+		writer->WriteObservation(observation);
+}
+
+void MultiWriter::WriteHistoryItem(const std::string &commandLine, const std::string &application, const std::vector<std::string> &params)
+{
+	for(std::unique_ptr<Writer>& writer : _writers)
+		writer->WriteHistoryItem(commandLine, application, params);
+}
+
+void MultiWriter::AddRows(size_t count)
+{
+	for(std::unique_ptr<Writer>& writer : _writers)
+		writer->AddRows(count);
+}
+
+void MultiWriter::WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights)
+{
+	for(std::unique_ptr<Writer>& writer : _writers)
+		writer->WriteRow(time, timeCentroid, antenna1, antenna2, u, v, w, interval, data, flags, weights);
+}
+
+void MultiWriter::WriteRows(const RowBatch& batch)
+{
+	for(std::unique_ptr<Writer>& writer : _writers)
+		writer->WriteRows(batch);
+}
+
+bool MultiWriter::IsTimeAligned(size_t antenna1, size_t antenna2)
+{
+	bool isAligned = true;
+	for(std::unique_ptr<Writer>& writer : _writers)
+		isAligned = writer->IsTimeAligned(antenna1, antenna2) && isAligned;
+	return isAligned;
+}
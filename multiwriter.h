@@ -0,0 +1,47 @@
+#ifndef MULTI_WRITER_H
+#define MULTI_WRITER_H
+
+#include "writer.h"
+
+#include <memory>
+#include <vector>
+
+/**
+ * Passes everything on to several writers, such that one stream of rows can be
+ * written to several outputs, e.g. with different averaging settings. Each writer
+ * should queue its rows (see @ref ThreadedWriter) for the outputs to be written in
+ * parallel.
+ */
+class MultiWriter : public Writer
+{
+	public:
+		explicit MultiWriter(std::vector<std::unique_ptr<Writer>>&& writers);
+
+		virtual ~MultiWriter() final override;
+
+		virtual void SetArrayLocation(double x, double y, double z) final override;
+		virtual void SetOffsetsPerGPUBox(const std::vector<int>& offsets) final override;
+
+		virtual void WriteBandInfo(const std::string &name, const std::vector<ChannelInfo> &channels, double refFreq, double totalBandwidth, bool flagRow) final override;
+		virtual void WriteAntennae(const std::vector<AntennaInfo> &antennae, double time) final override;
+		virtual void WritePolarizationForLinearPols(bool flagRow) final override;
+		virtual void WriteSource(const SourceInfo& source) final override;
+		virtual void WriteField(const FieldInfo& field) final override;
+		virtual void WriteObservation(const ObservationInfo& observation) final override;
+		virtual void WriteHistoryItem(const std::string &commandLine, const std::string &application, const std::vector<std::string> &params) final override;
+
+		virtual void AddRows(size_t count) final override;
+		virtual void WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights) final override;
+		virtual void WriteRows(const RowBatch& batch) final override;
+
+		//! The first writer decides, because antennae are written once for all outputs
+		virtual bool AreAntennaPositionsLocal() const final override { return _writers.front()->AreAntennaPositionsLocal(); }
+		//! Statistics are only written to the first output
+		virtual bool CanWriteStatistics() const final override { return _writers.front()->CanWriteStatistics(); }
+		virtual bool IsTimeAligned(size_t antenna1, size_t antenna2) final override;
+
+	private:
+		std::vector<std::unique_ptr<Writer>> _writers;
+};
+
+#endif
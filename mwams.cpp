@@ -278,16 +278,18 @@ void MWAMS::UpdateSpectralWindowInfo(int mwaCentreSubbandNr)
 {
 	MSSpectralWindow spwTable = _data->_measurementSet.spectralWindow();
 	
-	if(spwTable.nrow() != 1) {
+	// A part of a multi-MS lists the spectral windows of all parts
+	if(spwTable.nrow() == 0) {
 		std::stringstream s;
-		s << "The spectralwindow table of a MWA MS should have exactly one row, but in " << _filename << " it has " << spwTable.nrow() << " rows.";
+		s << "The spectralwindow table of a MWA MS should have at least one row, but in " << _filename << " it has none.";
 		throw std::runtime_error(s.str());
 	}
 	
 	ScalarColumn<int> centreSubbandNrCol =
 		ScalarColumn<int>(spwTable, columnName(MWAMSEnums::MWA_CENTRE_SUBBAND_NR));
 
-	centreSubbandNrCol.put(0, mwaCentreSubbandNr);
+	for(size_t row=0; row!=spwTable.nrow(); ++row)
+		centreSubbandNrCol.put(row, mwaCentreSubbandNr);
 }
 
 void MWAMS::WriteMWATilePointingInfo(double start, double end, const int* delays, double directionRA, double directionDec)
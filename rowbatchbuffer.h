@@ -0,0 +1,188 @@
+#ifndef ROW_BATCH_BUFFER_H
+#define ROW_BATCH_BUFFER_H
+
+#include "writer.h"
+
+#include <algorithm>
+#include <complex>
+#include <memory>
+#include <vector>
+
+/**
+ * Owns the arrays of a @ref Writer::RowBatch. This is used by writers
+ * that need to keep or produce a set of rows.
+ */
+class RowBatchBuffer
+{
+	public:
+		RowBatchBuffer() : _valuesPerRow(0), _flagCount(0), _flagCapacity(0), _sharedWeights(false)
+		{ }
+
+		size_t RowCount() const { return _times.size(); }
+
+		void Clear()
+		{
+			_times.clear();
+			_timeCentroids.clear();
+			_antenna1.clear();
+			_antenna2.clear();
+			_u.clear();
+			_v.clear();
+			_w.clear();
+			_intervals.clear();
+			_data.clear();
+			_flagCount = 0;
+			_weights.clear();
+			_sharedWeights = false;
+		}
+
+		/**
+		 * Append a row. Each row added this way has its own weights.
+		 */
+		void AddRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights, size_t valuesPerRow)
+		{
+			_valuesPerRow = valuesPerRow;
+			_times.push_back(time);
+			_timeCentroids.push_back(timeCentroid);
+			_antenna1.push_back(antenna1);
+			_antenna2.push_back(antenna2);
+			_u.push_back(u);
+			_v.push_back(v);
+			_w.push_back(w);
+			_intervals.push_back(interval);
+			_data.insert(_data.end(), data, data + valuesPerRow);
+			const size_t flagStart = _flagCount;
+			std::copy(flags, flags + valuesPerRow, resizeFlags(flagStart + valuesPerRow) + flagStart);
+			_weights.insert(_weights.end(), weights, weights + valuesPerRow);
+		}
+
+		/**
+		 * Replace the contents by a copy of the batch. The rows of the batch may be
+		 * further apart than their size; the copy is always contiguous.
+		 */
+		void Assign(const Writer::RowBatch& batch)
+		{
+			const size_t valueCount = batch.rowCount * batch.valuesPerRow;
+			_valuesPerRow = batch.valuesPerRow;
+			_times.assign(batch.times, batch.times + batch.rowCount);
+			_timeCentroids.assign(batch.timeCentroids, batch.timeCentroids + batch.rowCount);
+			_antenna1.assign(batch.antenna1, batch.antenna1 + batch.rowCount);
+			_antenna2.assign(batch.antenna2, batch.antenna2 + batch.rowCount);
+			_u.assign(batch.u, batch.u + batch.rowCount);
+			_v.assign(batch.v, batch.v + batch.rowCount);
+			_w.assign(batch.w, batch.w + batch.rowCount);
+			_intervals.assign(batch.intervals, batch.intervals + batch.rowCount);
+			_sharedWeights = batch.sharedWeights;
+			bool* flags = resizeFlags(valueCount);
+			if(batch.rowStride == batch.valuesPerRow)
+			{
+				_data.assign(batch.data, batch.data + valueCount);
+				std::copy(batch.flags, batch.flags + valueCount, flags);
+				if(!batch.sharedWeights)
+					_weights.assign(batch.weights, batch.weights + valueCount);
+			}
+			else {
+				_data.resize(valueCount);
+				if(!batch.sharedWeights)
+					_weights.resize(valueCount);
+				for(size_t row=0; row!=batch.rowCount; ++row)
+				{
+					const size_t start = row * batch.valuesPerRow;
+					std::copy_n(batch.Data(row), batch.valuesPerRow, &_data[start]);
+					std::copy_n(batch.Flags(row), batch.valuesPerRow, flags + start);
+					if(!batch.sharedWeights)
+						std::copy_n(batch.Weights(row), batch.valuesPerRow, &_weights[start]);
+				}
+			}
+			if(batch.sharedWeights)
+				_weights.assign(batch.weights, batch.weights + batch.valuesPerRow);
+		}
+
+		/**
+		 * Set the number of rows, such that rows can be filled in any order with
+		 * SetRow() and the non-const array accessors. Each row has its own weights.
+		 */
+		void Resize(size_t rowCount, size_t valuesPerRow)
+		{
+			_valuesPerRow = valuesPerRow;
+			_times.resize(rowCount);
+			_timeCentroids.resize(rowCount);
+			_antenna1.resize(rowCount);
+			_antenna2.resize(rowCount);
+			_u.resize(rowCount);
+			_v.resize(rowCount);
+			_w.resize(rowCount);
+			_intervals.resize(rowCount);
+			_data.resize(rowCount * valuesPerRow);
+			resizeFlags(rowCount * valuesPerRow);
+			_weights.resize(rowCount * valuesPerRow);
+			_sharedWeights = false;
+		}
+
+		void SetRow(size_t row, double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval)
+		{
+			_times[row] = time;
+			_timeCentroids[row] = timeCentroid;
+			_antenna1[row] = antenna1;
+			_antenna2[row] = antenna2;
+			_u[row] = u;
+			_v[row] = v;
+			_w[row] = w;
+			_intervals[row] = interval;
+		}
+
+		std::complex<float>* Data(size_t row) { return &_data[row * _valuesPerRow]; }
+		bool* Flags(size_t row) { return &_flags[row * _valuesPerRow]; }
+		float* Weights(size_t row) { return &_weights[row * _valuesPerRow]; }
+
+		Writer::RowBatch View() const
+		{
+			Writer::RowBatch batch;
+			batch.rowCount = RowCount();
+			batch.valuesPerRow = _valuesPerRow;
+			batch.rowStride = _valuesPerRow;
+			batch.times = _times.data();
+			batch.timeCentroids = _timeCentroids.data();
+			batch.antenna1 = _antenna1.data();
+			batch.antenna2 = _antenna2.data();
+			batch.u = _u.data();
+			batch.v = _v.data();
+			batch.w = _w.data();
+			batch.intervals = _intervals.data();
+			batch.data = _data.data();
+			batch.flags = _flags.get();
+			batch.weights = _weights.data();
+			batch.sharedWeights = _sharedWeights;
+			return batch;
+		}
+
+	private:
+		//! Sets the number of flags, keeping existing values, and returns the flag array
+		bool* resizeFlags(size_t flagCount)
+		{
+			if(flagCount > _flagCapacity)
+			{
+				const size_t newCapacity = std::max(flagCount, _flagCapacity * 2);
+				std::unique_ptr<bool[]> newFlags(new bool[newCapacity]);
+				std::copy(_flags.get(), _flags.get() + _flagCount, newFlags.get());
+				_flags = std::move(newFlags);
+				_flagCapacity = newCapacity;
+			}
+			_flagCount = flagCount;
+			return _flags.get();
+		}
+		
+		size_t _valuesPerRow;
+		std::vector<double> _times, _timeCentroids;
+		std::vector<size_t> _antenna1, _antenna2;
+		std::vector<double> _u, _v, _w;
+		std::vector<double> _intervals;
+		std::vector<std::complex<float>> _data;
+		// Not a vector<bool>, because the flags must be a contiguous bool array
+		std::unique_ptr<bool[]> _flags;
+		size_t _flagCount, _flagCapacity;
+		std::vector<float> _weights;
+		bool _sharedWeights;
+};
+
+#endif
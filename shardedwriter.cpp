@@ -0,0 +1,132 @@
+#include "shardedwriter.h"
+
+#include "threadedwriter.h"
+
+#include <algorithm>
+#include <stdexcept>
+#include <string>
+
+ShardedWriter::ShardedWriter(std::vector<std::unique_ptr<Writer>>&& shards, const std::vector<size_t>& subbandBoundaries, size_t maxQueueSize) :
+	_subbandBoundaries(subbandBoundaries)
+{
+	if(subbandBoundaries.size() != shards.size() + 1)
+		throw std::runtime_error("ShardedWriter: the number of subband boundaries does not match the number of shards");
+	for(std::unique_ptr<Writer>& shard : shards)
+		_shards.emplace_back(new ThreadedWriter(std::move(shard), maxQueueSize));
+}
+
+ShardedWriter::~ShardedWriter()
+{ }
+
+void ShardedWriter::SetArrayLocation(double x, double y, double z)
+{
+	for(std::unique_ptr<ThreadedWriter>& shard : _shards)
+		shard->SetArrayLocation(x, y, z);
+}
+
+void ShardedWriter::SetOffsetsPerGPUBox(const std::vector<int>& offsets)
+{
+	for(std::unique_ptr<ThreadedWriter>& shard : _shards)
+		shard->SetOffsetsPerGPUBox(offsets);
+}
+
+void ShardedWriter::WriteBandInfo(const std::string &name, const std::vector<ChannelInfo> &channels, double refFreq, double totalBandwidth, bool flagRow)
+{
+	const size_t subbandCount = _subbandBoundaries.back();
+	if(channels.size() % subbandCount != 0)
+		throw std::runtime_error("When writing shards, the number of channels per subband (after averaging) should be a whole number");
+	const size_t channelsPerSubband = channels.size() / subbandCount;
+
+	_channelBoundaries.resize(_subbandBoundaries.size());
+	for(size_t i=0; i!=_subbandBoundaries.size(); ++i)
+		_channelBoundaries[i] = _subbandBoundaries[i] * channelsPerSubband;
+
+	for(size_t shard=0; shard!=_shards.size(); ++shard)
+	{
+		const std::vector<ChannelInfo> shardChannels(channels.begin() + _channelBoundaries[shard], channels.begin() + _channelBoundaries[shard+1]);
+		const size_t nChannels = shardChannels.size();
+		double shardRefFreq, shardBandwidth = 0.0;
+		if(nChannels % 2 == 0)
+			shardRefFreq = 0.5 * (shardChannels[nChannels/2-1].chanFreq + shardChannels[nChannels/2].chanFreq);
+		else
+			shardRefFreq = shardChannels[nChannels/2].chanFreq;
+		for(const ChannelInfo& channel : shardChannels)
+			shardBandwidth += channel.chanWidth;
+		_shards[shard]->WriteBandInfo(name + '_' + std::to_string(shard), shardChannels, shardRefFreq, shardBandwidth, flagRow);
+	}
+}
+
+void ShardedWriter::WriteAntennae(const std::vector<AntennaInfo> &antennae, double time)
+{
+	for(std::unique_ptr<ThreadedWriter>& shard : _shards)
+		shard->WriteAntennae(antennae, time);
+}
+
+void ShardedWriter::WritePolarizationForLinearPols(bool flagRow)
+{
+	for(std::unique_ptr<ThreadedWriter>& shard : _shards)
+		shard->WritePolarizationForLinearPols(flagRow);
+}
+
+void ShardedWriter::WriteSource(const SourceInfo& source)
+{
+	for(std::unique_ptr<ThreadedWriter>& shard : _shards)
+		shard->WriteSource(source);
+}
+
+void ShardedWriter::WriteField(const FieldInfo& field)
+{
+	for(std::unique_ptr<ThreadedWriter>& shard : _shards)
+		shard->WriteField(field);
+}
+
+void ShardedWriter::WriteObservation(const ObservationInfo& observation)
+{
+	for(std::unique_ptr<ThreadedWriter>& shard : _shards)
+		shard->WriteObservation(observation);
+}
+
+void ShardedWriter::WriteHistoryItem(const std::string &commandLine, const std::string &application, const std::vector<std::string> &params)
+{
+	for(std::unique_ptr<ThreadedWriter>& shard : _shards)
+		shard->WriteHistoryItem(commandLine, application, params);
+}
+
+void ShardedWriter::AddRows(size_t count)
+{
+	for(std::unique_ptr<ThreadedWriter>& shard : _shards)
+		shard->AddRows(count);
+}
+
+void ShardedWriter::WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights)
+{
+	for(size_t shard=0; shard!=_shards.size(); ++shard)
+	{
+		const size_t valueStart = _channelBoundaries[shard] * 4;
+		_shards[shard]->WriteRow(time, timeCentroid, antenna1, antenna2, u, v, w, interval, data + valueStart, flags + valueStart, weights + valueStart);
+	}
+}
+
+void ShardedWriter::WriteRows(const RowBatch& batch)
+{
+	for(size_t shard=0; shard!=_shards.size(); ++shard)
+	{
+		const size_t valueStart = _channelBoundaries[shard] * 4;
+		// The shard's rows are a view into the batch, with the row stride of the
+		// full band. The threaded writer copies them straight into its queue.
+		RowBatch shardBatch(batch);
+		shardBatch.valuesPerRow = (_channelBoundaries[shard+1] - _channelBoundaries[shard]) * 4;
+		shardBatch.data = batch.data + valueStart;
+		shardBatch.flags = batch.flags + valueStart;
+		shardBatch.weights = batch.weights + valueStart;
+		_shards[shard]->WriteRows(shardBatch);
+	}
+}
+
+bool ShardedWriter::IsTimeAligned(size_t antenna1, size_t antenna2)
+{
+	bool isAligned = true;
+	for(std::unique_ptr<ThreadedWriter>& shard : _shards)
+		isAligned = shard->IsTimeAligned(antenna1, antenna2) && isAligned;
+	return isAligned;
+}
@@ -0,0 +1,62 @@
+#ifndef SHARDED_WRITER_H
+#define SHARDED_WRITER_H
+
+#include "threadedwriter.h"
+#include "writer.h"
+
+#include <memory>
+#include <vector>
+
+/**
+ * Splits the band over several writers, each writing a range of coarse
+ * channels (subbands) to its own file. Every shard is written on its own
+ * thread, such that the shards are written in parallel.
+ */
+class ShardedWriter : public Writer
+{
+	public:
+		/**
+		 * @param shards One writer per shard, in order of frequency.
+		 * @param subbandBoundaries The first subband of each shard, followed by the
+		 * total number of subbands in the band. The channels of a subband are found by
+		 * dividing the channels given to WriteBandInfo() evenly over the subbands.
+		 * @param maxQueueSize Size of the write queue of each shard, see @ref ThreadedWriter.
+		 */
+		ShardedWriter(std::vector<std::unique_ptr<Writer>>&& shards, const std::vector<size_t>& subbandBoundaries, size_t maxQueueSize);
+
+		virtual ~ShardedWriter() final override;
+
+		virtual void SetArrayLocation(double x, double y, double z) final override;
+		virtual void SetOffsetsPerGPUBox(const std::vector<int>& offsets) final override;
+
+		virtual void WriteBandInfo(const std::string &name, const std::vector<ChannelInfo> &channels, double refFreq, double totalBandwidth, bool flagRow) final override;
+		virtual void WriteAntennae(const std::vector<AntennaInfo> &antennae, double time) final override;
+		virtual void WritePolarizationForLinearPols(bool flagRow) final override;
+		virtual void WriteSource(const SourceInfo& source) final override;
+		virtual void WriteField(const FieldInfo& field) final override;
+		virtual void WriteObservation(const ObservationInfo& observation) final override;
+		virtual void WriteHistoryItem(const std::string &commandLine, const std::string &application, const std::vector<std::string> &params) final override;
+
+		virtual void AddRows(size_t count) final override;
+		virtual void WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights) final override;
+		virtual void WriteRows(const RowBatch& batch) final override;
+
+		virtual bool AreAntennaPositionsLocal() const final override { return _shards.front()->AreAntennaPositionsLocal(); }
+		virtual bool CanWriteStatistics() const final override { return _shards.front()->CanWriteStatistics(); }
+		virtual bool IsTimeAligned(size_t antenna1, size_t antenna2) final override;
+
+		size_t ShardCount() const { return _shards.size(); }
+
+		//! The writer thread of a shard, e.g. to inspect its queue
+		const ThreadedWriter& Shard(size_t index) const { return *_shards[index]; }
+
+	private:
+		//! The writer threads, which own the shard writers
+		std::vector<std::unique_ptr<ThreadedWriter>> _shards;
+		std::vector<size_t> _subbandBoundaries;
+
+		//! First channel of each shard, followed by the total number of channels
+		std::vector<size_t> _channelBoundaries;
+};
+
+#endif
@@ -47,7 +47,7 @@ class SolutionFile
 	/** Empty constructor. After constructing, either @ref OpenForReading() should be called or the parameters should
 	 * be initialized and @ref OpenForWriting() or @ref OpenInMemory() should be called.
 	 */
-  SolutionFile() : _outputStream(0), _inputStream(0), _readPointer(nullptr)
+  SolutionFile() : _outputStream(0), _inputStream(0), _readPointer(nullptr), _startTime(0.0), _endTime(0.0)
   {
     strcpy(_header.intro, "MWAOCAL");
     _header.fileType = 0; // Complex jones solutions
@@ -86,6 +86,15 @@ class SolutionFile
 		_header.intervalCount = intervalCount;
 	}
 
+	/** Start and end time of the solutions, in the time units of the measurement set. The
+	 * intervals divide this time range evenly. */
+	double StartTime() const { return _startTime; }
+	double EndTime() const { return _endTime; }
+	void SetTimeRange(double startTime, double endTime) {
+		_startTime = startTime;
+		_endTime = endTime;
+	}
+
 	/** Open a new file on disk for writing. After calling this method,
 	 * data can be appended with the @ref WriteSolution() method.
 	 * @param filename Name of file to write.
@@ -97,9 +106,8 @@ class SolutionFile
 		_data.clear();
 		
 		_outputStream->write(reinterpret_cast<const char*>(&_header), sizeof(_header));
-		double timeStart = 0.0, timeEnd = 0.0;
-		_outputStream->write(reinterpret_cast<const char*>(&timeStart), sizeof(timeStart));
-		_outputStream->write(reinterpret_cast<const char*>(&timeEnd), sizeof(timeEnd)); 
+		_outputStream->write(reinterpret_cast<const char*>(&_startTime), sizeof(_startTime));
+		_outputStream->write(reinterpret_cast<const char*>(&_endTime), sizeof(_endTime)); 
   }
   
   /** Open a file for writing and reading. This allows a calibration algorithm to use this class
@@ -128,9 +136,8 @@ class SolutionFile
 		if(_inputStream->bad())
 			throw std::runtime_error("Error reading input solutions file");
 		_inputStream->read(reinterpret_cast<char*>(&_header), sizeof(_header));
-		double timeStart, timeEnd;
-		_inputStream->read(reinterpret_cast<char*>(&timeStart), sizeof(timeStart));
-		_inputStream->read(reinterpret_cast<char*>(&timeEnd), sizeof(timeEnd)); 
+		_inputStream->read(reinterpret_cast<char*>(&_startTime), sizeof(_startTime));
+		_inputStream->read(reinterpret_cast<char*>(&_endTime), sizeof(_endTime)); 
 		if(_inputStream->bad())
 			throw std::runtime_error("Error reading header from solutions file");
 	}
@@ -181,6 +188,7 @@ class SolutionFile
   std::ifstream *_inputStream;
 	std::vector<std::complex<double> > _data;
 	std::complex<double>* _readPointer;
+	double _startTime, _endTime;
 };
 
 #endif
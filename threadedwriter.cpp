@@ -1,102 +1,160 @@
 #include "threadedwriter.h"
 
-#include <boost/mem_fn.hpp>
-
-ThreadedWriter::ThreadedWriter(std::unique_ptr<Writer>&& parentWriter) :
+ThreadedWriter::ThreadedWriter(std::unique_ptr<Writer>&& parentWriter, size_t maxQueueSize) :
 	ForwardingWriter(std::move(parentWriter)),
-	_isWriterReady(false),
-	_isBufferReady(false),
+	_queuedBytes(0),
+	_maxQueueSize(maxQueueSize),
+	_isWriting(false),
 	_isFinishing(false),
-	_bufferedData(0),
-	_bufferedFlags(0),
-	_bufferedWeights(0),
+	_queueFullCount(0),
+	_queueEmptyCount(0),
+	_arraySize(0),
 	_thread(&ThreadedWriter::writerThreadFunc, this)
 {
 }
 
 ThreadedWriter::~ThreadedWriter()
 {
+	enqueuePendingRows();
 	{
 		std::lock_guard<std::mutex> lock(_mutex);
 		_isFinishing = true;
 	}
-	
-	_bufferChangeCondition.notify_all();
+
+	_queueChangeCondition.notify_all();
 	_thread.join();
-	
-	delete[] _bufferedData;
-	delete[] _bufferedFlags;
-	delete[] _bufferedWeights;
 }
 
 void ThreadedWriter::WriteBandInfo(const std::string &name, const std::vector<Writer::ChannelInfo> &channels, double refFreq, double totalBandwidth, bool flagRow)
 {
 	_arraySize = channels.size() * 4;
-	_bufferedData = new std::complex<float>[_arraySize];
-	_bufferedFlags = new bool[_arraySize];
-	_bufferedWeights = new float[_arraySize];
-	
+
 	ForwardingWriter::WriteBandInfo(name, channels, refFreq, totalBandwidth, flagRow);
 }
 
-void ThreadedWriter::AddRows(size_t rowCount)
+std::unique_ptr<ThreadedWriter::Item> ThreadedWriter::takeFreeItem()
+{
+	std::unique_ptr<Item> item;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		if(!_freeItems.empty())
+		{
+			item = std::move(_freeItems.back());
+			_freeItems.pop_back();
+		}
+	}
+	if(!item)
+		item.reset(new Item());
+	item->addRowCount = 0;
+	item->rows.Clear();
+	item->byteSize = 0;
+	return item;
+}
+
+void ThreadedWriter::enqueue(std::unique_ptr<Item> item)
 {
 	std::unique_lock<std::mutex> lock(_mutex);
-	
-	// Wait until the writer is ready AND the buffer is empty
-	while(!_isWriterReady || _isBufferReady)
-		_bufferChangeCondition.wait(lock);
-	
-	// Just keep mutex locked (might take time, but this method is not called so often...)
-	ParentWriter().AddRows(rowCount);
+	if(_queuedBytes != 0 && _queuedBytes + item->byteSize > _maxQueueSize)
+	{
+		++_queueFullCount;
+		while(_queuedBytes != 0 && _queuedBytes + item->byteSize > _maxQueueSize)
+			_queueChangeCondition.wait(lock);
+	}
+	_queuedBytes += item->byteSize;
+	_queue.emplace_back(std::move(item));
+	_queueChangeCondition.notify_all();
 }
 
-void ThreadedWriter::WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights)
+void ThreadedWriter::enqueuePendingRows()
+{
+	if(_pendingItem)
+		enqueue(std::move(_pendingItem));
+}
+
+void ThreadedWriter::waitUntilWritten()
 {
+	enqueuePendingRows();
 	std::unique_lock<std::mutex> lock(_mutex);
-	
-	// Wait until the writer is ready AND the buffer is empty (=not ready)
-	while(!_isWriterReady || _isBufferReady)
-		_bufferChangeCondition.wait(lock);
-	
-	_bufferedTime = time;
-	_bufferedTimeCentroid = timeCentroid;
-	_bufferedAntenna1 = antenna1;
-	_bufferedAntenna2 = antenna2;
-	_bufferedU = u;
-	_bufferedV = v;
-	_bufferedW = w;
-	_bufferedInterval = interval;
-	memcpy(_bufferedData, data, _arraySize * sizeof(std::complex<float>));
-	memcpy(_bufferedFlags, flags, _arraySize * sizeof(bool));
-	memcpy(_bufferedWeights, weights, _arraySize * sizeof(float));
-	
-	_isBufferReady = true;
-	_bufferChangeCondition.notify_all();
+	while(!_queue.empty() || _isWriting)
+		_queueChangeCondition.wait(lock);
+}
+
+void ThreadedWriter::AddRows(size_t rowCount)
+{
+	enqueuePendingRows();
+	std::unique_ptr<Item> item = takeFreeItem();
+	item->addRowCount = rowCount;
+	enqueue(std::move(item));
+}
+
+void ThreadedWriter::WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights)
+{
+	// Single rows are collected into one item, such that the writer thread
+	// is not woken up for every row
+	if(!_pendingItem)
+		_pendingItem = takeFreeItem();
+	_pendingItem->rows.AddRow(time, timeCentroid, antenna1, antenna2, u, v, w, interval, data, flags, weights, _arraySize);
+	_pendingItem->byteSize += rowByteSize();
+	if(_pendingItem->byteSize * 16 >= _maxQueueSize)
+		enqueuePendingRows();
+}
+
+void ThreadedWriter::WriteRows(const RowBatch& batch)
+{
+	enqueuePendingRows();
+	std::unique_ptr<Item> item = takeFreeItem();
+	item->rows.Assign(batch);
+	item->byteSize = batch.rowCount * rowByteSize();
+	enqueue(std::move(item));
+}
+
+bool ThreadedWriter::IsTimeAligned(size_t antenna1, size_t antenna2)
+{
+	waitUntilWritten();
+	return ForwardingWriter::IsTimeAligned(antenna1, antenna2);
 }
 
 void ThreadedWriter::writerThreadFunc()
 {
 	std::unique_lock<std::mutex> lock(_mutex);
-	
-	while(!_isFinishing)
+
+	while(true)
 	{
-		_isWriterReady = true;
-		_bufferChangeCondition.notify_all();
-
-		// Wait until a buffer is ready OR the writer is shutting down
-		while(!_isBufferReady && !_isFinishing)
-			_bufferChangeCondition.wait(lock);
-		
-		_isWriterReady = false;
-		if(_isBufferReady)
+		if(_queue.empty())
+		{
+			if(_isFinishing)
+				break;
+			++_queueEmptyCount;
+			while(_queue.empty() && !_isFinishing)
+				_queueChangeCondition.wait(lock);
+			continue;
+		}
+
+		// Take all queued items at once, and write them without holding the lock
+		std::vector<std::unique_ptr<Item>> items;
+		while(!_queue.empty())
+		{
+			items.emplace_back(std::move(_queue.front()));
+			_queue.pop_front();
+		}
+		_isWriting = true;
+
+		for(std::unique_ptr<Item>& item : items)
 		{
 			lock.unlock();
-			
-			ParentWriter().WriteRow(_bufferedTime, _bufferedTimeCentroid, _bufferedAntenna1, _bufferedAntenna2, _bufferedU, _bufferedV, _bufferedW, _bufferedInterval, _bufferedData, _bufferedFlags, _bufferedWeights);
-			
+
+			if(item->addRowCount != 0)
+				ParentWriter().AddRows(item->addRowCount);
+			if(item->rows.RowCount() != 0)
+				ParentWriter().WriteRows(item->rows.View());
+
 			lock.lock();
-			_isBufferReady = false;
+			// The space is released per item, so that the caller can continue as soon as possible
+			_queuedBytes -= item->byteSize;
+			_freeItems.emplace_back(std::move(item));
+			_queueChangeCondition.notify_all();
 		}
+		_isWriting = false;
+		_queueChangeCondition.notify_all();
 	}
 }
@@ -2,45 +2,88 @@
 #define THREADED_WRITER_H
 
 #include "forwardingwriter.h"
+#include "rowbatchbuffer.h"
 
-#include <string.h>
-
+#include <atomic>
 #include <condition_variable>
+#include <deque>
 #include <memory>
 #include <mutex>
 #include <thread>
+#include <vector>
 
+/**
+ * Forwards rows to the parent writer on a separate thread. Rows are queued, such
+ * that short stalls of the parent writer do not stall the caller. The queue is
+ * bounded by its size in bytes; only when it is full does the caller wait.
+ */
 class ThreadedWriter : public ForwardingWriter
 {
 	public:
-		ThreadedWriter(std::unique_ptr<Writer>&& parentWriter);
-		
+		/**
+		 * @param maxQueueSize Max number of bytes of row data that is queued and not yet
+		 * written. A batch that is larger than this is still accepted when nothing is queued.
+		 */
+		ThreadedWriter(std::unique_ptr<Writer>&& parentWriter, size_t maxQueueSize = DefaultMaxQueueSize);
+
 		virtual ~ThreadedWriter() final override;
-		
+
 		virtual void WriteBandInfo(const std::string &name, const std::vector<Writer::ChannelInfo> &channels, double refFreq, double totalBandwidth, bool flagRow) final override;
-		
+
 		virtual void AddRows(size_t rowCount) final override;
-		
+
 		virtual void WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights) final override;
-		
+
+		virtual void WriteRows(const RowBatch& batch) final override;
+
+		virtual bool IsTimeAligned(size_t antenna1, size_t antenna2) final override;
+
+		//! Nr of times the caller waited because the queue was full
+		size_t QueueFullCount() const { return _queueFullCount; }
+
+		//! Nr of times the writer thread waited because the queue was empty
+		size_t QueueEmptyCount() const { return _queueEmptyCount; }
+
+		enum { DefaultMaxQueueSize = 256*1024*1024 };
+
 	private:
-		std::condition_variable _bufferChangeCondition;
+		/**
+		 * An entry of the queue: either a call to AddRows(), or a set of rows.
+		 */
+		struct Item
+		{
+			size_t addRowCount;
+			RowBatchBuffer rows;
+			size_t byteSize;
+		};
+
+		std::unique_ptr<Item> takeFreeItem();
+		void enqueue(std::unique_ptr<Item> item);
+		void enqueuePendingRows();
+		void waitUntilWritten();
+		void writerThreadFunc();
+
+		size_t rowByteSize() const
+		{
+			return sizeof(double)*6 + sizeof(size_t)*2 + _arraySize * (sizeof(std::complex<float>) + sizeof(bool) + sizeof(float));
+		}
+
+		std::condition_variable _queueChangeCondition;
 		std::mutex _mutex;
-		bool _isWriterReady, _isBufferReady, _isFinishing;
-		
+		std::deque<std::unique_ptr<Item>> _queue;
+		//! Items that have been written, kept to reuse their allocated memory
+		std::vector<std::unique_ptr<Item>> _freeItems;
+		//! Rows from WriteRow() calls, which are collected by the caller before they are queued
+		std::unique_ptr<Item> _pendingItem;
+		size_t _queuedBytes, _maxQueueSize;
+		bool _isWriting, _isFinishing;
+		//! Nr of times the caller waited for a full queue, and the writer thread waited for an empty queue
+		std::atomic<size_t> _queueFullCount, _queueEmptyCount;
+
 		size_t _arraySize;
-		double _bufferedTime, _bufferedTimeCentroid;
-		size_t _bufferedAntenna1, _bufferedAntenna2;
-		double _bufferedU, _bufferedV, _bufferedW;
-		double _bufferedInterval;
-		std::complex<float> *_bufferedData;
-		bool *_bufferedFlags;
-		float *_bufferedWeights;
-		
+
 		// Last property, because it needs to be constructed after fields have been initialized
 		std::thread _thread;
-		
-		void writerThreadFunc();
 };
 
 #endif
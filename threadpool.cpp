@@ -0,0 +1,152 @@
+#include "threadpool.h"
+
+#include <algorithm>
+#include <iostream>
+
+#include <pthread.h>
+#include <sched.h>
+#include <unistd.h>
+
+ThreadPool::ThreadPool(size_t threadCount, bool setAffinity) :
+	_isFinishing(false)
+{
+	// At least one worker is required, because tasks may wait for data that the
+	// submitting thread produces
+	threadCount = std::max<size_t>(threadCount, 1);
+	const long cpuCount = sysconf(_SC_NPROCESSORS_ONLN);
+	for(size_t i=0; i!=threadCount; ++i)
+	{
+		_threads.emplace_back(&ThreadPool::workerThreadFunc, this);
+		if(setAffinity && cpuCount > 0)
+		{
+			cpu_set_t cpuSet;
+			CPU_ZERO(&cpuSet);
+			CPU_SET(i % cpuCount, &cpuSet);
+			if(pthread_setaffinity_np(_threads.back().native_handle(), sizeof(cpu_set_t), &cpuSet) != 0)
+				std::cout << "WARNING: Could not set the CPU affinity of worker thread " << i << ".\n";
+		}
+	}
+}
+
+ThreadPool::~ThreadPool()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_isFinishing = true;
+	}
+	_workAvailableCondition.notify_all();
+	for(std::thread& t : _threads)
+		t.join();
+}
+
+void ThreadPool::workerThreadFunc()
+{
+	std::unique_lock<std::mutex> lock(_mutex);
+	while(true)
+	{
+		while(_slotQueue.empty() && !_isFinishing)
+			_workAvailableCondition.wait(lock);
+		if(_slotQueue.empty())
+			return;
+
+		TaskGroup& group = *_slotQueue.front();
+		_slotQueue.pop_front();
+		// Run one task of this group, and then move the slot to the back of the queue,
+		// such that a group with many tasks does not keep the thread from the other
+		// groups. The slot is given back once the group has no tasks left.
+		if(!group._pendingTasks.empty())
+		{
+			std::function<void()> task = std::move(group._pendingTasks.front());
+			group._pendingTasks.pop_front();
+			group.runTask(task, lock);
+		}
+		if(group._pendingTasks.empty())
+		{
+			--group._activeSlots;
+			group._finishedCondition.notify_all();
+		}
+		else {
+			_slotQueue.push_back(&group);
+		}
+	}
+}
+
+ThreadPool::TaskGroup::TaskGroup(ThreadPool& pool, size_t maxConcurrency) :
+	_pool(pool),
+	_maxConcurrency(std::max<size_t>(maxConcurrency, 1)),
+	_activeSlots(0),
+	_runningTasks(0)
+{ }
+
+ThreadPool::TaskGroup::~TaskGroup()
+{
+	try {
+		Wait();
+	} catch(...) {
+		// Exceptions are only reported by an explicit call to Wait()
+	}
+}
+
+void ThreadPool::TaskGroup::Run(std::function<void()> task)
+{
+	{
+		std::lock_guard<std::mutex> lock(_pool._mutex);
+		_pendingTasks.emplace_back(std::move(task));
+		if(_activeSlots >= _maxConcurrency || _activeSlots >= _pool._threads.size())
+			return;
+		++_activeSlots;
+		_pool._slotQueue.push_back(this);
+	}
+	_pool._workAvailableCondition.notify_one();
+}
+
+void ThreadPool::TaskGroup::runTask(std::function<void()>& task, std::unique_lock<std::mutex>& lock)
+{
+	++_runningTasks;
+	lock.unlock();
+	try {
+		task();
+	} catch(...) {
+		lock.lock();
+		if(!_exception)
+			_exception = std::current_exception();
+		lock.unlock();
+	}
+	lock.lock();
+	--_runningTasks;
+}
+
+void ThreadPool::TaskGroup::Wait()
+{
+	std::unique_lock<std::mutex> lock(_pool._mutex);
+	while(!_pendingTasks.empty())
+	{
+		std::function<void()> task = std::move(_pendingTasks.front());
+		_pendingTasks.pop_front();
+		runTask(task, lock);
+	}
+	// Slots that were not yet picked up by a worker would keep this group waiting until a
+	// worker becomes available, even though there is no work left; hence remove those.
+	std::deque<TaskGroup*>& queue = _pool._slotQueue;
+	const size_t queueSizeBefore = queue.size();
+	queue.erase(std::remove(queue.begin(), queue.end(), this), queue.end());
+	_activeSlots -= queueSizeBefore - queue.size();
+
+	while(_activeSlots != 0 || _runningTasks != 0)
+		_finishedCondition.wait(lock);
+
+	if(_exception)
+	{
+		std::exception_ptr exception = _exception;
+		_exception = std::exception_ptr();
+		std::rethrow_exception(exception);
+	}
+}
+
+void ThreadPool::ParallelFor(size_t taskCount, size_t maxConcurrency, const std::function<void(size_t)>& function)
+{
+	TaskGroup group(*this, maxConcurrency);
+	for(size_t i=0; i!=taskCount; ++i)
+		group.Run(std::bind(function, i));
+	group.Wait();
+}
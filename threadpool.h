@@ -0,0 +1,102 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/**
+ * A set of persistent worker threads that is shared by the stages of Cotter,
+ * such that threads are not recreated for every chunk and the stages together
+ * do not use more threads than requested.
+ *
+ * Work is submitted through a @ref TaskGroup. Each group has its own limit on the
+ * number of pool threads that may run its tasks concurrently. Idle threads take
+ * work from any group that has tasks left, one task at a time in turn, and a
+ * thread that waits for a group helps by running the remaining tasks of that
+ * group itself. Long-running work should therefore be split into several
+ * tasks, such that other groups are not kept waiting.
+ */
+class ThreadPool
+{
+	public:
+		/**
+		 * Construct a pool with the given number of worker threads.
+		 * @param setAffinity If true, worker thread i is bound to CPU (i % nCPUs).
+		 */
+		explicit ThreadPool(size_t threadCount, bool setAffinity = false);
+
+		~ThreadPool();
+
+		size_t ThreadCount() const { return _threads.size(); }
+
+		/**
+		 * A set of tasks that is run by the pool. The destructor waits for
+		 * all tasks to finish.
+		 */
+		class TaskGroup
+		{
+			public:
+				/**
+				 * @param maxConcurrency Max number of pool threads that run tasks of
+				 * this group at the same time. A thread that calls Wait() can run tasks
+				 * in addition to these.
+				 */
+				TaskGroup(ThreadPool& pool, size_t maxConcurrency);
+
+				~TaskGroup();
+
+				void Run(std::function<void()> task);
+
+				/**
+				 * Wait until all tasks have finished, while running tasks
+				 * that were not yet started by the pool. If a task threw an exception,
+				 * the first such exception is rethrown.
+				 */
+				void Wait();
+
+			private:
+				friend class ThreadPool;
+
+				ThreadPool& _pool;
+				size_t _maxConcurrency;
+				//! Number of pool threads that have been assigned to this group
+				size_t _activeSlots;
+				//! Number of tasks that are currently running
+				size_t _runningTasks;
+				std::deque<std::function<void()>> _pendingTasks;
+				std::condition_variable _finishedCondition;
+				std::exception_ptr _exception;
+
+				void runTask(std::function<void()>& task, std::unique_lock<std::mutex>& lock);
+
+				TaskGroup(const TaskGroup&) = delete;
+				void operator=(const TaskGroup&) = delete;
+		};
+
+		/**
+		 * Call function(index) for all indices in [0, taskCount), using at most
+		 * maxConcurrency pool threads together with the calling thread, and return when
+		 * all have finished.
+		 */
+		void ParallelFor(size_t taskCount, size_t maxConcurrency, const std::function<void(size_t)>& function);
+
+	private:
+		void workerThreadFunc();
+
+		std::vector<std::thread> _threads;
+		//! One entry per slot that a group has been given, i.e., groups can appear several times
+		std::deque<TaskGroup*> _slotQueue;
+		std::mutex _mutex;
+		std::condition_variable _workAvailableCondition;
+		bool _isFinishing;
+
+		ThreadPool(const ThreadPool&) = delete;
+		void operator=(const ThreadPool&) = delete;
+};
+
+#endif
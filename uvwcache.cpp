@@ -0,0 +1,84 @@
+#include "uvwcache.h"
+
+#include "geometry.h"
+#include "mwaconfig.h"
+#include "threadpool.h"
+
+void UVWCache::Prepare(const std::vector<double>& times, ThreadPool& threadPool, size_t maxConcurrency)
+{
+	std::vector<double> missingTimes;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		for(double time : times)
+		{
+			if(_timesteps.find(time) == _timesteps.end())
+				missingTimes.push_back(time);
+		}
+	}
+
+	std::vector<std::shared_ptr<const AntennaUVW>> results(missingTimes.size());
+	threadPool.ParallelFor(missingTimes.size(), maxConcurrency, [&](size_t index)
+	{
+		results[index] = calculate(missingTimes[index]);
+	});
+
+	for(size_t i=0; i!=missingTimes.size(); ++i)
+		store(missingTimes[i], results[i]);
+}
+
+std::shared_ptr<const UVWCache::AntennaUVW> UVWCache::Get(double time)
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		auto iter = _timesteps.find(time);
+		if(iter != _timesteps.end())
+			return iter->second;
+	}
+	// Calculated without holding the lock; if another thread calculates the same
+	// time concurrently, both give the same result.
+	std::shared_ptr<const AntennaUVW> antennaUVW = calculate(time);
+	store(time, antennaUVW);
+	return antennaUVW;
+}
+
+void UVWCache::Clear()
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	_timesteps.clear();
+	_insertionOrder.clear();
+}
+
+std::shared_ptr<const UVWCache::AntennaUVW> UVWCache::calculate(double time) const
+{
+	Geometry::UVWTimestepInfo uvwInfo;
+	Geometry::PrepareTimestepUVW(uvwInfo, time/86400.0, _mwaConfig.ArrayLongitudeRad(), _mwaConfig.ArrayLattitudeRad(), _raHrs, _decDegs);
+
+	const size_t antennaCount = _mwaConfig.NAntennae();
+	std::shared_ptr<AntennaUVW> antennaUVW(new AntennaUVW());
+	antennaUVW->u.resize(antennaCount);
+	antennaUVW->v.resize(antennaCount);
+	antennaUVW->w.resize(antennaCount);
+	for(size_t antenna=0; antenna!=antennaCount; ++antenna)
+	{
+		const double
+			x = _mwaConfig.Antenna(antenna).position[0],
+			y = _mwaConfig.Antenna(antenna).position[1],
+			z = _mwaConfig.Antenna(antenna).position[2];
+		Geometry::CalcUVW(uvwInfo, x, y, z, antennaUVW->u[antenna], antennaUVW->v[antenna], antennaUVW->w[antenna]);
+	}
+	return antennaUVW;
+}
+
+void UVWCache::store(double time, const std::shared_ptr<const AntennaUVW>& antennaUVW)
+{
+	std::lock_guard<std::mutex> lock(_mutex);
+	if(_timesteps.emplace(time, antennaUVW).second)
+	{
+		_insertionOrder.push_back(time);
+		while(_insertionOrder.size() > _capacity)
+		{
+			_timesteps.erase(_insertionOrder.front());
+			_insertionOrder.pop_front();
+		}
+	}
+}
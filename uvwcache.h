@@ -0,0 +1,82 @@
+#ifndef UVW_CACHE_H
+#define UVW_CACHE_H
+
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+class MWAConfig;
+class ThreadPool;
+
+/**
+ * Calculates the u,v,w of all antennas once per timestep, such that the uvw of
+ * a baseline is found by subtraction. Calculating the uvws of a timestep requires
+ * the precession/nutation matrix, which is far more expensive than the
+ * per-antenna projection.
+ *
+ * The cache can be used from several threads at the same time. It holds a
+ * limited number of timesteps; the least recently added timestep is removed first.
+ */
+class UVWCache
+{
+	public:
+		struct AntennaUVW
+		{
+			std::vector<double> u, v, w;
+		};
+
+		UVWCache(const MWAConfig& mwaConfig, size_t capacity) :
+			_mwaConfig(mwaConfig), _capacity(capacity), _raHrs(0.0), _decDegs(0.0)
+		{ }
+
+		/**
+		 * Set the direction towards which the uvws are calculated. This removes
+		 * all cached timesteps.
+		 */
+		void SetPhaseCentre(double raHrs, double decDegs)
+		{
+			Clear();
+			_raHrs = raHrs;
+			_decDegs = decDegs;
+		}
+
+		/**
+		 * Calculates the antenna uvws of the given times in parallel,
+		 * for those times that are not yet in the cache.
+		 * @param times Times in MJD seconds.
+		 */
+		void Prepare(const std::vector<double>& times, ThreadPool& threadPool, size_t maxConcurrency);
+
+		/**
+		 * Returns the antenna uvws at the given time in MJD seconds.
+		 * These are calculated if the time is not yet in the cache.
+		 */
+		std::shared_ptr<const AntennaUVW> Get(double time);
+
+		void BaselineUVW(double time, size_t antenna1, size_t antenna2, double& u, double& v, double& w)
+		{
+			std::shared_ptr<const AntennaUVW> antennaUVW = Get(time);
+			u = antennaUVW->u[antenna1] - antennaUVW->u[antenna2];
+			v = antennaUVW->v[antenna1] - antennaUVW->v[antenna2];
+			w = antennaUVW->w[antenna1] - antennaUVW->w[antenna2];
+		}
+
+		//! Remove all timesteps
+		void Clear();
+
+	private:
+		std::shared_ptr<const AntennaUVW> calculate(double time) const;
+		void store(double time, const std::shared_ptr<const AntennaUVW>& antennaUVW);
+
+		const MWAConfig& _mwaConfig;
+		const size_t _capacity;
+		double _raHrs, _decDegs;
+		std::mutex _mutex;
+		std::map<double, std::shared_ptr<const AntennaUVW>> _timesteps;
+		//! Times in the order they were added
+		std::deque<double> _insertionOrder;
+};
+
+#endif
@@ -58,6 +58,32 @@ class Writer
 			bool flagRow;
 		};
 		
+		/**
+		 * A set of rows in structure-of-arrays form, normally all rows of one timestep.
+		 * The metadata arrays have one element per row. The visibilities, flags and weights
+		 * of row i start at index i * valuesPerRow, where valuesPerRow is the number of
+		 * channels times the number of polarizations.
+		 */
+		struct RowBatch
+		{
+			size_t rowCount, valuesPerRow;
+			//! Distance in values between the start of two consecutive rows, at least valuesPerRow
+			size_t rowStride;
+			const double *times, *timeCentroids;
+			const size_t *antenna1, *antenna2;
+			const double *u, *v, *w;
+			const double *intervals;
+			const std::complex<float> *data;
+			const bool *flags;
+			const float *weights;
+			//! If true, all rows use the single row of weights that 'weights' points to
+			bool sharedWeights;
+			
+			const std::complex<float>* Data(size_t row) const { return data + row * rowStride; }
+			const bool* Flags(size_t row) const { return flags + row * rowStride; }
+			const float* Weights(size_t row) const { return sharedWeights ? weights : weights + row * rowStride; }
+		};
+		
 		virtual ~Writer() { }
 		
 		virtual void SetArrayLocation(double x, double y, double z) { }
@@ -74,6 +100,20 @@ class Writer
 		virtual void AddRows(size_t count) = 0;
 		virtual void WriteRow(double time, double timeCentroid, size_t antenna1, size_t antenna2, double u, double v, double w, double interval, const std::complex<float>* data, const bool* flags, const float *weights) = 0;
 		
+		/**
+		 * Write several rows at once. Writers that can handle rows in bulk should
+		 * override this; by default, the rows are written one by one with WriteRow().
+		 */
+		virtual void WriteRows(const RowBatch& batch)
+		{
+			for(size_t row=0; row!=batch.rowCount; ++row)
+			{
+				WriteRow(batch.times[row], batch.timeCentroids[row], batch.antenna1[row], batch.antenna2[row],
+					batch.u[row], batch.v[row], batch.w[row], batch.intervals[row],
+					batch.Data(row), batch.Flags(row), batch.Weights(row));
+			}
+		}
+		
 		virtual bool AreAntennaPositionsLocal() const { return false; }
 		virtual bool CanWriteStatistics() const { return false; }
 		